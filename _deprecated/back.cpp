@@ -105,7 +105,7 @@ int loop(config conf)
             
             // curr[:n_approved] was confirmed by main model. However, we need to make sure we 
             // are working on the same sequence. So we pass the length of the prefix (=n_prefix) and 
-            // its crc32 checksum. Main server will check that it matches ground truth sequence.
+            // its crc32c checksum. Main server will check that it matches ground truth sequence.
             // Alternative way to handle this would be to have some sort of query_id or session_id.
             // 
             // At small context lengths delta passing wouldn't be needed and 
@@ -11,6 +11,7 @@
 #include <httplib.h>
 
 #include "utils.h"
+#include "../prefix_crc.h"
 
 namespace llama_duo
 {
@@ -20,8 +21,9 @@ using llama_tokens = std::vector<llama_token>;
 struct spec_context
 {
     llama_tokens candidate;          // current shared candidate
+    prefix_crc   checksums;          // crc32c of every prefix of candidate
     size_t       n_approved     = 0; // how many were validated by main model
-    uint32_t     crc32_approved = 0; // crc32 checksum of approved part 
+    uint32_t     crc32_approved = 0; // crc32c checksum of approved part 
     std::mutex   mtx;
 };
 
@@ -187,7 +189,7 @@ void llama_lead::serve()
 
             // offset based on what we approved in the past
             size_t       n_prefix         = req_j["n_prefix"];
-            // crc32 checksum of non-passed prefix
+            // crc32c checksum of non-passed prefix
             uint32_t     crc32_prefix     = req_j["crc32_prefix"]; 
             {
                 std::lock_guard<std::mutex> _lock(spec_ctx_.mtx);
@@ -202,7 +204,7 @@ void llama_lead::serve()
                 }
                 else
                 {
-                    uint32_t local_crc32_prefix = crc32(candidate.begin(), candidate.begin() + n_prefix);
+                    uint32_t local_crc32_prefix = spec_ctx_.checksums.prefix(n_prefix);
                     if (local_crc32_prefix != crc32_prefix)
                     {
                         prefix_mismatch = true;
@@ -243,6 +245,7 @@ void llama_lead::serve()
                                 continue;
                             }
                             candidate.push_back(remote_candidate[i]);
+                            spec_ctx_.checksums.push_back(remote_candidate[i]);
                         }
                     }
                     else
@@ -312,6 +315,8 @@ void llama_lead::serve()
             {
                 std::lock_guard<std::mutex> _lock(spec_ctx_.mtx);
                 spec_ctx_.candidate      = prompt;
+                spec_ctx_.checksums.truncate(0);
+                spec_ctx_.checksums.append(prompt.begin(), prompt.end());
                 spec_ctx_.n_approved     = 0;
                 spec_ctx_.crc32_approved = 0;
             }
@@ -511,13 +516,15 @@ int llama_lead::generate(const llama_tokens & tokens_list, size_t n_reuse)
             if (n_match != next_tokens.size())
             {
                 spec.erase(spec.begin() + next_tokens_pos, spec.end());
+                spec_ctx_.checksums.truncate(next_tokens_pos);
                 for (const auto tok: next_tokens)
                 {
                     spec.push_back(tok);
                 }
+                spec_ctx_.checksums.append(next_tokens.begin(), next_tokens.end());
             }
             spec_ctx_.n_approved     = next_tokens_pos + next_tokens.size();
-            spec_ctx_.crc32_approved = crc32(spec.begin(), spec.begin() + next_tokens_pos + next_tokens.size());
+            spec_ctx_.crc32_approved = spec_ctx_.checksums.prefix(spec_ctx_.n_approved);
             input_seq.assign(spec.begin() + n_cur - 1, spec.end());
         }
 
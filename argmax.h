@@ -0,0 +1,544 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace llama_duo
+{
+
+// argmax over logits rows.
+//
+// All kernels return the *first* index of the maximum value and agree with
+// each other on every row, so switching kernels never changes generated
+// tokens. NaNs are never picked, wherever they are: every kernel starts
+// from -inf at index 0, and comparisons with NaN are false. A row with
+// nothing above -inf gives index 0. The old scalar loop in greedy_tokens
+// started from the first element instead, so the kernels differ from it
+// only on rows with a NaN there.
+//
+// SIMD kernels are compiled with function-level target attributes and
+// picked at runtime, so the binary does not need -mavx2 / -mavx512f.
+
+struct argmax_result
+{
+    float   value;
+    int32_t index;
+};
+
+// combine two partial results, ties go to the smaller index
+inline argmax_result argmax_merge(const argmax_result & a, const argmax_result & b)
+{
+    if (b.value > a.value || (b.value == a.value && b.index < a.index))
+    {
+        return b;
+    }
+    return a;
+}
+
+inline argmax_result argmax_scalar(const float * x, int32_t n)
+{
+    argmax_result res = { -INFINITY, 0 };
+    for (int32_t i = 0; i < n; i++)
+    {
+        if (x[i] > res.value)
+        {
+            res.value = x[i];
+            res.index = i;
+        }
+    }
+    return res;
+}
+
+// reduce per-lane (value, index) pairs left in SIMD accumulators
+inline argmax_result argmax_reduce_lanes(const float * values, const int32_t * indices, int32_t n_lanes)
+{
+    argmax_result res = { values[0], indices[0] };
+    for (int32_t i = 1; i < n_lanes; i++)
+    {
+        res = argmax_merge(res, { values[i], indices[i] });
+    }
+    return res;
+}
+
+// continue scalar scan over the tail; indices there are larger than
+// everything seen so far, so strict '>' keeps first-index semantics
+inline argmax_result argmax_tail(argmax_result res, const float * x, int32_t from, int32_t n)
+{
+    for (int32_t i = from; i < n; i++)
+    {
+        if (x[i] > res.value)
+        {
+            res.value = x[i];
+            res.index = i;
+        }
+    }
+    return res;
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define LLAMA_DUO_ARGMAX_X86 1
+
+// 4 independent accumulators to hide compare + blend latency
+__attribute__((target("avx2")))
+inline argmax_result argmax_avx2(const float * x, int32_t n)
+{
+    const int32_t kStep = 32;
+    if (n < kStep)
+    {
+        return argmax_scalar(x, n);
+    }
+
+    // lanes start below everything, so a NaN never becomes a lane's maximum
+    __m256  v0 = _mm256_set1_ps(-INFINITY);
+    __m256  v1 = v0, v2 = v0, v3 = v0;
+    __m256i i0 = _mm256_setzero_si256();
+    __m256i i1 = i0, i2 = i0, i3 = i0;
+
+    __m256i c0 = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i c1 = _mm256_add_epi32(c0, _mm256_set1_epi32(8));
+    __m256i c2 = _mm256_add_epi32(c0, _mm256_set1_epi32(16));
+    __m256i c3 = _mm256_add_epi32(c0, _mm256_set1_epi32(24));
+    const __m256i step = _mm256_set1_epi32(kStep);
+
+    int32_t i = 0;
+    for (; i + kStep <= n; i += kStep)
+    {
+        const __m256 x0 = _mm256_loadu_ps(x + i);
+        const __m256 x1 = _mm256_loadu_ps(x + i + 8);
+        const __m256 x2 = _mm256_loadu_ps(x + i + 16);
+        const __m256 x3 = _mm256_loadu_ps(x + i + 24);
+
+        const __m256 m0 = _mm256_cmp_ps(x0, v0, _CMP_GT_OQ);
+        const __m256 m1 = _mm256_cmp_ps(x1, v1, _CMP_GT_OQ);
+        const __m256 m2 = _mm256_cmp_ps(x2, v2, _CMP_GT_OQ);
+        const __m256 m3 = _mm256_cmp_ps(x3, v3, _CMP_GT_OQ);
+
+        v0 = _mm256_blendv_ps(v0, x0, m0);
+        v1 = _mm256_blendv_ps(v1, x1, m1);
+        v2 = _mm256_blendv_ps(v2, x2, m2);
+        v3 = _mm256_blendv_ps(v3, x3, m3);
+
+        i0 = _mm256_blendv_epi8(i0, c0, _mm256_castps_si256(m0));
+        i1 = _mm256_blendv_epi8(i1, c1, _mm256_castps_si256(m1));
+        i2 = _mm256_blendv_epi8(i2, c2, _mm256_castps_si256(m2));
+        i3 = _mm256_blendv_epi8(i3, c3, _mm256_castps_si256(m3));
+
+        c0 = _mm256_add_epi32(c0, step);
+        c1 = _mm256_add_epi32(c1, step);
+        c2 = _mm256_add_epi32(c2, step);
+        c3 = _mm256_add_epi32(c3, step);
+    }
+
+    alignas(32) float   values[kStep];
+    alignas(32) int32_t indices[kStep];
+    _mm256_store_ps(values,      v0);
+    _mm256_store_ps(values + 8,  v1);
+    _mm256_store_ps(values + 16, v2);
+    _mm256_store_ps(values + 24, v3);
+    _mm256_store_si256(reinterpret_cast<__m256i *>(indices),      i0);
+    _mm256_store_si256(reinterpret_cast<__m256i *>(indices + 8),  i1);
+    _mm256_store_si256(reinterpret_cast<__m256i *>(indices + 16), i2);
+    _mm256_store_si256(reinterpret_cast<__m256i *>(indices + 24), i3);
+
+    return argmax_tail(argmax_reduce_lanes(values, indices, kStep), x, i, n);
+}
+
+__attribute__((target("avx512f")))
+inline argmax_result argmax_avx512(const float * x, int32_t n)
+{
+    const int32_t kStep = 64;
+    if (n < kStep)
+    {
+        return argmax_scalar(x, n);
+    }
+
+    __m512  v0 = _mm512_set1_ps(-INFINITY);
+    __m512  v1 = v0, v2 = v0, v3 = v0;
+    __m512i i0 = _mm512_setzero_si512();
+    __m512i i1 = i0, i2 = i0, i3 = i0;
+
+    __m512i c0 = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m512i c1 = _mm512_add_epi32(c0, _mm512_set1_epi32(16));
+    __m512i c2 = _mm512_add_epi32(c0, _mm512_set1_epi32(32));
+    __m512i c3 = _mm512_add_epi32(c0, _mm512_set1_epi32(48));
+    const __m512i step = _mm512_set1_epi32(kStep);
+
+    int32_t i = 0;
+    for (; i + kStep <= n; i += kStep)
+    {
+        const __m512 x0 = _mm512_loadu_ps(x + i);
+        const __m512 x1 = _mm512_loadu_ps(x + i + 16);
+        const __m512 x2 = _mm512_loadu_ps(x + i + 32);
+        const __m512 x3 = _mm512_loadu_ps(x + i + 48);
+
+        const __mmask16 m0 = _mm512_cmp_ps_mask(x0, v0, _CMP_GT_OQ);
+        const __mmask16 m1 = _mm512_cmp_ps_mask(x1, v1, _CMP_GT_OQ);
+        const __mmask16 m2 = _mm512_cmp_ps_mask(x2, v2, _CMP_GT_OQ);
+        const __mmask16 m3 = _mm512_cmp_ps_mask(x3, v3, _CMP_GT_OQ);
+
+        v0 = _mm512_mask_blend_ps(m0, v0, x0);
+        v1 = _mm512_mask_blend_ps(m1, v1, x1);
+        v2 = _mm512_mask_blend_ps(m2, v2, x2);
+        v3 = _mm512_mask_blend_ps(m3, v3, x3);
+
+        i0 = _mm512_mask_blend_epi32(m0, i0, c0);
+        i1 = _mm512_mask_blend_epi32(m1, i1, c1);
+        i2 = _mm512_mask_blend_epi32(m2, i2, c2);
+        i3 = _mm512_mask_blend_epi32(m3, i3, c3);
+
+        c0 = _mm512_add_epi32(c0, step);
+        c1 = _mm512_add_epi32(c1, step);
+        c2 = _mm512_add_epi32(c2, step);
+        c3 = _mm512_add_epi32(c3, step);
+    }
+
+    alignas(64) float   values[kStep];
+    alignas(64) int32_t indices[kStep];
+    _mm512_store_ps(values,      v0);
+    _mm512_store_ps(values + 16, v1);
+    _mm512_store_ps(values + 32, v2);
+    _mm512_store_ps(values + 48, v3);
+    _mm512_store_si512(indices,      i0);
+    _mm512_store_si512(indices + 16, i1);
+    _mm512_store_si512(indices + 32, i2);
+    _mm512_store_si512(indices + 48, i3);
+
+    return argmax_tail(argmax_reduce_lanes(values, indices, kStep), x, i, n);
+}
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#define LLAMA_DUO_ARGMAX_NEON 1
+
+inline argmax_result argmax_neon(const float * x, int32_t n)
+{
+    const int32_t kStep = 16;
+    if (n < kStep)
+    {
+        return argmax_scalar(x, n);
+    }
+
+    float32x4_t v0 = vdupq_n_f32(-INFINITY);
+    float32x4_t v1 = v0, v2 = v0, v3 = v0;
+    uint32x4_t  i0 = vdupq_n_u32(0);
+    uint32x4_t  i1 = i0, i2 = i0, i3 = i0;
+
+    const uint32_t lanes[4] = { 0, 1, 2, 3 };
+    uint32x4_t c0 = vld1q_u32(lanes);
+    uint32x4_t c1 = vaddq_u32(c0, vdupq_n_u32(4));
+    uint32x4_t c2 = vaddq_u32(c0, vdupq_n_u32(8));
+    uint32x4_t c3 = vaddq_u32(c0, vdupq_n_u32(12));
+    const uint32x4_t step = vdupq_n_u32(kStep);
+
+    int32_t i = 0;
+    for (; i + kStep <= n; i += kStep)
+    {
+        const float32x4_t x0 = vld1q_f32(x + i);
+        const float32x4_t x1 = vld1q_f32(x + i + 4);
+        const float32x4_t x2 = vld1q_f32(x + i + 8);
+        const float32x4_t x3 = vld1q_f32(x + i + 12);
+
+        const uint32x4_t m0 = vcgtq_f32(x0, v0);
+        const uint32x4_t m1 = vcgtq_f32(x1, v1);
+        const uint32x4_t m2 = vcgtq_f32(x2, v2);
+        const uint32x4_t m3 = vcgtq_f32(x3, v3);
+
+        v0 = vbslq_f32(m0, x0, v0);
+        v1 = vbslq_f32(m1, x1, v1);
+        v2 = vbslq_f32(m2, x2, v2);
+        v3 = vbslq_f32(m3, x3, v3);
+
+        i0 = vbslq_u32(m0, c0, i0);
+        i1 = vbslq_u32(m1, c1, i1);
+        i2 = vbslq_u32(m2, c2, i2);
+        i3 = vbslq_u32(m3, c3, i3);
+
+        c0 = vaddq_u32(c0, step);
+        c1 = vaddq_u32(c1, step);
+        c2 = vaddq_u32(c2, step);
+        c3 = vaddq_u32(c3, step);
+    }
+
+    float   values[kStep];
+    int32_t indices[kStep];
+    vst1q_f32(values,      v0);
+    vst1q_f32(values + 4,  v1);
+    vst1q_f32(values + 8,  v2);
+    vst1q_f32(values + 12, v3);
+    vst1q_u32(reinterpret_cast<uint32_t *>(indices),      i0);
+    vst1q_u32(reinterpret_cast<uint32_t *>(indices + 4),  i1);
+    vst1q_u32(reinterpret_cast<uint32_t *>(indices + 8),  i2);
+    vst1q_u32(reinterpret_cast<uint32_t *>(indices + 12), i3);
+
+    return argmax_tail(argmax_reduce_lanes(values, indices, kStep), x, i, n);
+}
+#endif
+
+using argmax_fn = argmax_result (*)(const float *, int32_t);
+
+struct argmax_kernel
+{
+    const char * name;
+    argmax_fn    fn;
+};
+
+// best kernel for the CPU we are running on, resolved once
+inline const argmax_kernel & argmax_best_kernel()
+{
+    static const argmax_kernel kernel = []()
+    {
+#if defined(LLAMA_DUO_ARGMAX_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+        {
+            return argmax_kernel{ "avx512", argmax_avx512 };
+        }
+        if (__builtin_cpu_supports("avx2"))
+        {
+            return argmax_kernel{ "avx2", argmax_avx2 };
+        }
+#elif defined(LLAMA_DUO_ARGMAX_NEON)
+        return argmax_kernel{ "neon", argmax_neon };
+#endif
+        return argmax_kernel{ "scalar", argmax_scalar };
+    }();
+    return kernel;
+}
+
+inline argmax_result argmax(const float * x, int32_t n)
+{
+    return argmax_best_kernel().fn(x, n);
+}
+
+// Small pool which splits argmax work over rows and, for long rows, over
+// column ranges of the same row. The calling thread always takes part, so
+// a pool with n_threads = 1 has no workers and runs everything inline.
+// run() is serialized: one caller at a time.
+class argmax_pool
+{
+  public:
+    explicit argmax_pool(size_t n_threads, int32_t min_chunk = 32768)
+        : min_chunk_(std::max<int32_t>(min_chunk, 1024))
+    {
+        for (size_t i = 1; i < n_threads; i++)
+        {
+            workers_.emplace_back([this]() { worker(); });
+        }
+    }
+
+    ~argmax_pool()
+    {
+        {
+            std::lock_guard<std::mutex> _lock(mtx_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (auto & w : workers_)
+        {
+            w.join();
+        }
+    }
+
+    argmax_pool(const argmax_pool &) = delete;
+    argmax_pool & operator=(const argmax_pool &) = delete;
+
+    size_t n_threads() const
+    {
+        return workers_.size() + 1;
+    }
+
+    // rows[i] points to n_cols values; argmax index of row i goes to out[i]
+    template<typename index_t>
+    void run(const std::vector<const float *> & rows, int32_t n_cols, index_t * out)
+    {
+        std::lock_guard<std::mutex> _run_lock(run_mtx_);
+        if (rows.empty() || n_cols <= 0)
+        {
+            return;
+        }
+
+        const size_t  n_rows  = rows.size();
+        const size_t  total   = n_rows * static_cast<size_t>(n_cols);
+        const size_t  n_split = std::min(n_threads(), std::max<size_t>(total / min_chunk_, 1));
+        if (n_split <= 1)
+        {
+            for (size_t r = 0; r < n_rows; r++)
+            {
+                out[r] = static_cast<index_t>(argmax(rows[r], n_cols).index);
+            }
+            return;
+        }
+
+        // every row is cut into the same number of column chunks, so that
+        // the number of chunks is at least the number of threads.
+        const int32_t n_col_chunks = static_cast<int32_t>(std::min<size_t>((n_split + n_rows - 1) / n_rows, n_cols / min_chunk_ + 1));
+        const int32_t col_chunk    = (n_cols + n_col_chunks - 1) / n_col_chunks;
+
+        chunks_.clear();
+        for (size_t r = 0; r < n_rows; r++)
+        {
+            for (int32_t from = 0; from < n_cols; from += col_chunk)
+            {
+                chunks_.push_back({ rows[r], from, std::min(n_cols, from + col_chunk), { 0.0f, 0 } });
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> _lock(mtx_);
+            next_.store(0);
+            n_finished_ = 0;
+            generation_++;
+        }
+        cv_.notify_all();
+
+        process();
+
+        // wait for every worker, not just for every chunk: chunks_ is
+        // rebuilt by the next call and nobody may be reading it then.
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            done_cv_.wait(lock, [this]() { return n_finished_ == workers_.size(); });
+        }
+
+        const size_t per_row = chunks_.size() / n_rows;
+        for (size_t r = 0; r < n_rows; r++)
+        {
+            argmax_result res = chunks_[r * per_row].result;
+            for (size_t c = 1; c < per_row; c++)
+            {
+                res = argmax_merge(res, chunks_[r * per_row + c].result);
+            }
+            out[r] = static_cast<index_t>(res.index);
+        }
+    }
+
+  private:
+    struct chunk
+    {
+        const float * row;
+        int32_t       from;
+        int32_t       to;
+        argmax_result result;
+    };
+
+    void process()
+    {
+        while (true)
+        {
+            size_t i = next_.fetch_add(1);
+            if (i >= chunks_.size())
+            {
+                break;
+            }
+            auto & c = chunks_[i];
+            c.result = argmax(c.row + c.from, c.to - c.from);
+            c.result.index += c.from;
+        }
+    }
+
+    void worker()
+    {
+        uint64_t seen = 0;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                cv_.wait(lock, [this, seen]() { return stop_ || generation_ != seen; });
+                if (stop_)
+                {
+                    return;
+                }
+                seen = generation_;
+            }
+            process();
+            {
+                std::lock_guard<std::mutex> _lock(mtx_);
+                if (++n_finished_ == workers_.size())
+                {
+                    done_cv_.notify_one();
+                }
+            }
+        }
+    }
+
+    const int32_t            min_chunk_;
+    std::vector<std::thread> workers_;
+    std::vector<chunk>       chunks_;
+    std::atomic<size_t>      next_{0};
+    size_t                   n_finished_ = 0;
+    uint64_t                 generation_ = 0;
+    bool                     stop_       = false;
+    std::mutex               mtx_;
+    std::mutex               run_mtx_;
+    std::condition_variable  cv_;
+    std::condition_variable  done_cv_;
+};
+
+// One candidate for greedy verification: rows[i] are the main model's
+// logits after the token before drafts[i], rows.back() those after the last
+// draft, so there are drafts.size() + 1 rows.
+template<typename token_t>
+struct greedy_candidate
+{
+    std::vector<const float *> rows;
+    std::vector<token_t>       drafts;
+    // the main model's picks up to and including the first that differs
+    // from the draft, all drafts.size() + 1 if none does
+    std::vector<token_t>       preds;
+};
+
+// Verifies candidates in rounds: round i reduces row i of every candidate
+// whose drafts matched so far, all of them in one run(). Rows after a
+// rejected draft are never read, which is most of them when the drafter is
+// off track; with vocab-sized rows that is what the verification costs.
+template<typename token_t>
+void greedy_verify(argmax_pool & pool, int32_t n_cols, std::vector<greedy_candidate<token_t>> & cands)
+{
+    std::vector<const float *> rows;
+    std::vector<size_t>        owner;
+    std::vector<token_t>       out;
+    for (auto & c : cands)
+    {
+        c.preds.clear();
+    }
+    for (size_t i = 0; ; i++)
+    {
+        rows.clear();
+        owner.clear();
+        for (size_t k = 0; k < cands.size(); k++)
+        {
+            const auto & c = cands[k];
+            if (c.preds.size() == i && i < c.rows.size() && (i == 0 || c.preds[i - 1] == c.drafts[i - 1]))
+            {
+                rows.push_back(c.rows[i]);
+                owner.push_back(k);
+            }
+        }
+        if (rows.empty())
+        {
+            break;
+        }
+        out.resize(rows.size());
+        pool.run(rows, n_cols, out.data());
+        for (size_t j = 0; j < rows.size(); j++)
+        {
+            cands[owner[j]].preds.push_back(out[j]);
+        }
+    }
+}
+
+}
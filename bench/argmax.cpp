@@ -0,0 +1,105 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "argmax.h"
+
+// micro-benchmark: greedy_tokens' original scalar loop vs argmax kernels.
+// usage: argmax-bench [n_vocab] [n_iter]
+
+namespace
+{
+
+// the loop greedy_tokens used before argmax.h
+int32_t baseline(const float * logits, int32_t n_vocab)
+{
+    int32_t new_token_id = 0;
+    for (int32_t token_id = 1; token_id < n_vocab; token_id++)
+    {
+        if (logits[token_id] > logits[new_token_id])
+        {
+            new_token_id = token_id;
+        }
+    }
+    return new_token_id;
+}
+
+template<typename fn_t>
+double time_us(size_t n_iter, fn_t fn)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n_iter; i++)
+    {
+        fn();
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::micro>(end - start).count() / n_iter;
+}
+
+}
+
+int main(int argc, char ** argv)
+{
+    using namespace llama_duo;
+
+    const int32_t n_vocab = argc > 1 ? std::atoi(argv[1]) : 128256;
+    const size_t  n_iter  = argc > 2 ? std::atoi(argv[2]) : 200;
+    const size_t  n_hw    = std::max<size_t>(1, std::thread::hardware_concurrency());
+
+    std::mt19937 rng(1234);
+    std::normal_distribution<float> dist(0.0f, 4.0f);
+
+    const size_t max_rows = 16;
+    std::vector<float> data(max_rows * n_vocab);
+    for (auto & v : data)
+    {
+        v = dist(rng);
+    }
+
+    std::vector<size_t> thread_counts;
+    for (size_t n = 1; n < n_hw; n *= 2)
+    {
+        thread_counts.push_back(n);
+    }
+    thread_counts.push_back(n_hw);
+
+    printf("kernel: %s, n_vocab: %d, iterations: %zu\n", argmax_best_kernel().name, n_vocab, n_iter);
+    printf("%6s %8s %14s %14s %9s\n", "rows", "threads", "baseline us", "argmax us", "speedup");
+
+    for (size_t n_rows : { 1, 2, 5, 9, 16 })
+    {
+        std::vector<const float *> rows;
+        for (size_t r = 0; r < n_rows; r++)
+        {
+            rows.push_back(data.data() + r * n_vocab);
+        }
+
+        std::vector<int32_t> expected(n_rows);
+        double base_us = time_us(n_iter, [&]()
+        {
+            for (size_t r = 0; r < n_rows; r++)
+            {
+                expected[r] = baseline(rows[r], n_vocab);
+            }
+        });
+
+        for (size_t n_threads : thread_counts)
+        {
+            argmax_pool pool(n_threads);
+            std::vector<int32_t> got(n_rows);
+            double us = time_us(n_iter, [&]() { pool.run(rows, n_vocab, got.data()); });
+            if (got != expected)
+            {
+                fprintf(stderr, "mismatch: rows=%zu threads=%zu\n", n_rows, n_threads);
+                return 1;
+            }
+            printf("%6zu %8zu %14.2f %14.2f %8.2fx\n", n_rows, n_threads, base_us, us, base_us / us);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,285 @@
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "draft_channel.h"
+#include "prefix_crc.h"
+
+// loopback check of the remote drafting protocol, no models needed: frame
+// encoding round trips, truncated and malformed frames, and a hello /
+// verdict / drafts session between a draft_listener and
+// draft_channel::connect on 127.0.0.1, ended by a verdict whose crc does not
+// match the drafter's copy of the verified tokens. Exits 1 on any failure.
+// usage: draft-loopback [port]
+
+namespace
+{
+
+using namespace llama_duo;
+
+int n_failed = 0;
+
+void check(bool ok, const char * what)
+{
+    if (!ok)
+    {
+        fprintf(stderr, "FAILED: %s\n", what);
+        n_failed++;
+    }
+}
+
+const uint64_t kVarints[] = {
+    0, 1, 0x7f, 0x80, 0x3fff, 0x4000, 0xffffffffull, 0x100000000ull,
+    (1ull << 63) - 1, 1ull << 63, std::numeric_limits<uint64_t>::max(),
+};
+
+const float kFloats[] = {
+    0.0f, -0.0f, 1.0f, 1e-45f, std::numeric_limits<float>::max(), std::numeric_limits<float>::infinity(),
+};
+
+// zigzag edges: the largest steps up and down a llama_token allows
+const std::vector<llama_token> kTokens = {
+    0, std::numeric_limits<llama_token>::max(), std::numeric_limits<llama_token>::min(),
+    std::numeric_limits<llama_token>::max(), -1, 1, 128255, 128255, 0,
+};
+
+frame_writer sample_frame()
+{
+    frame_writer f(frame_type::drafts);
+    for (uint64_t v : kVarints)
+    {
+        f.put_varint(v);
+    }
+    for (float v : kFloats)
+    {
+        f.put_float(v);
+    }
+    f.put_tokens(nullptr, 0);
+    f.put_tokens(kTokens.data(), kTokens.size());
+    token_dist dist;
+    dist.ids = { 7, 3, 128000 };
+    dist.p   = { 0.5f, 0.25f, 0.25f };
+    f.put_dist(dist);
+    return f;
+}
+
+// reads sample_frame() back, true if every field matched
+bool read_sample(const std::vector<uint8_t> & payload)
+{
+    frame_reader r(payload);
+    bool same = r.type() == frame_type::drafts;
+    for (uint64_t v : kVarints)
+    {
+        same = r.get_varint() == v && same;
+    }
+    for (float v : kFloats)
+    {
+        const float got = r.get_float();
+        same = got == v && std::signbit(got) == std::signbit(v) && same;
+    }
+    std::vector<llama_token> tokens;
+    r.get_tokens(tokens);
+    same = tokens.empty() && same;
+    r.get_tokens(tokens);
+    same = tokens == kTokens && same;
+    token_dist dist;
+    r.get_dist(dist);
+    same = dist.ids == std::vector<llama_token>({ 7, 3, 128000 }) && dist.p == std::vector<float>({ 0.5f, 0.25f, 0.25f }) && same;
+    return r.ok() && same;
+}
+
+void check_frames()
+{
+    const std::vector<uint8_t> payload = sample_frame().payload();
+    check(read_sample(payload), "frame round trip");
+
+    // every field runs past the end of a cut-off frame sooner or later
+    for (size_t n = 0; n < payload.size(); n++)
+    {
+        if (read_sample(std::vector<uint8_t>(payload.begin(), payload.begin() + n)))
+        {
+            fprintf(stderr, "FAILED: frame cut to %zu of %zu bytes read back\n", n, payload.size());
+            n_failed++;
+        }
+    }
+
+    // a varint longer than 64 bits
+    std::vector<uint8_t> overlong(12, 0x80);
+    overlong[0] = static_cast<uint8_t>(frame_type::idle);
+    overlong.back() = 0x01;
+    frame_reader r(overlong);
+    r.get_varint();
+    check(!r.ok(), "overlong varint rejected");
+
+    // more tokens announced than bytes left
+    frame_writer f(frame_type::verdict);
+    f.put_varint(1000);
+    f.put_varint(2);
+    std::vector<llama_token> tokens;
+    frame_reader t(f.payload());
+    t.get_tokens(tokens);
+    check(!t.ok() && tokens.empty(), "token count past the end rejected");
+}
+
+frame_writer verdict(uint64_t epoch, size_t from, const std::vector<llama_token> & tokens, uint32_t crc)
+{
+    frame_writer f(frame_type::verdict);
+    f.put_varint(epoch);
+    f.put_varint(from);
+    f.put_tokens(tokens.data(), tokens.size());
+    f.put_varint(crc);
+    return f;
+}
+
+// the drafter side of serve_draft_session, minus the model: answers hello,
+// drafts the last verified token + 1 twice after every verdict and ends the
+// session when a verdict's crc differs from its own
+void drafter(std::unique_ptr<draft_channel> ch, bool & crc_mismatch)
+{
+    std::vector<uint8_t> payload;
+    if (!ch || !ch->recv(payload))
+    {
+        return;
+    }
+    frame_reader hello(payload);
+    const uint64_t version = hello.get_varint();
+    const uint64_t n_vocab = hello.get_varint();
+    frame_writer reply(frame_type::hello);
+    reply.put_varint(kDraftProtocolVersion);
+    reply.put_varint(n_vocab);
+    if (!hello.ok() || version != kDraftProtocolVersion || !ch->send(reply))
+    {
+        return;
+    }
+
+    prefix_crc verified;
+    std::vector<llama_token> tokens;
+    while (ch->recv(payload))
+    {
+        frame_reader r(payload);
+        if (r.type() != frame_type::verdict)
+        {
+            break;
+        }
+        const uint64_t epoch = r.get_varint();
+        const uint64_t pos   = r.get_varint();
+        r.get_tokens(tokens);
+        const uint64_t crc   = r.get_varint();
+        if (!r.ok() || pos != verified.size() || tokens.empty())
+        {
+            break;
+        }
+        verified.append(tokens.begin(), tokens.end());
+        if (crc != verified.prefix(verified.size()))
+        {
+            crc_mismatch = true;
+            break;
+        }
+        const std::vector<llama_token> drafts = { tokens.back() + 1, tokens.back() + 2 };
+        frame_writer f(frame_type::drafts);
+        f.put_varint(epoch);
+        f.put_varint(verified.size());
+        f.put_tokens(drafts.data(), drafts.size());
+        f.put_varint(0);
+        if (!ch->send(f))
+        {
+            break;
+        }
+    }
+    ch->close();
+}
+
+void check_session(int32_t port)
+{
+    draft_listener listener;
+    int32_t p = port;
+    while (p < port + 16 && !listener.listen("127.0.0.1", p))
+    {
+        p++;
+    }
+    check(p < port + 16, "listen on 127.0.0.1");
+    if (p == port + 16)
+    {
+        return;
+    }
+
+    bool crc_mismatch = false;
+    std::thread serve([&]() { drafter(listener.accept(), crc_mismatch); });
+
+    std::unique_ptr<draft_channel> ch = draft_channel::connect("127.0.0.1:" + std::to_string(p));
+    check(ch != nullptr, "connect to 127.0.0.1");
+    if (!ch)
+    {
+        listener.close();
+        serve.join();
+        return;
+    }
+
+    std::vector<uint8_t> payload;
+    frame_writer hello(frame_type::hello);
+    hello.put_varint(kDraftProtocolVersion);
+    hello.put_varint(128256);
+    check(ch->send(hello) && ch->recv(payload), "hello exchange");
+    frame_reader reply(payload);
+    check(reply.type() == frame_type::hello && reply.get_varint() == kDraftProtocolVersion
+        && reply.get_varint() == 128256 && reply.ok(), "hello reply");
+
+    // the prompt, then one more verified token
+    prefix_crc target;
+    const std::vector<llama_token> prompt = { 128000, 9906, 1917 };
+    target.append(prompt.begin(), prompt.end());
+    check(ch->send(verdict(1, 0, prompt, target.prefix(target.size()))) && ch->recv(payload), "prompt verdict");
+    std::vector<llama_token> drafts;
+    frame_reader d(payload);
+    const uint64_t epoch = d.get_varint();
+    const uint64_t pos   = d.get_varint();
+    d.get_tokens(drafts);
+    check(d.ok() && d.type() == frame_type::drafts && epoch == 1 && pos == 3
+        && drafts == std::vector<llama_token>({ 1918, 1919 }), "drafts after the prompt");
+
+    const std::vector<llama_token> next = { 1918 };
+    target.append(next.begin(), next.end());
+    check(ch->send(verdict(2, 3, next, target.prefix(target.size()))) && ch->recv(payload), "second verdict");
+    frame_reader d2(payload);
+    d2.get_varint();
+    check(d2.ok() && d2.get_varint() == 4, "drafts after the second verdict");
+
+    // a verdict whose crc covers different tokens ends the session
+    const std::vector<llama_token> bad = { 1919 };
+    prefix_crc other = target;
+    other.push_back(1920);
+    check(ch->send(verdict(3, 4, bad, other.prefix(other.size()))), "send mismatching verdict");
+    check(!ch->recv(payload), "drafter hangs up after a crc mismatch");
+    serve.join();
+    check(crc_mismatch, "drafter saw the crc mismatch");
+
+    // close() unblocks a pending accept()
+    std::thread waiting([&]() { check(listener.accept() == nullptr, "accept after close"); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    listener.close();
+    waiting.join();
+}
+
+}
+
+int main(int argc, char ** argv)
+{
+    const int32_t port = argc > 1 ? std::atoi(argv[1]) : 18097;
+
+    check_frames();
+    check_session(port);
+
+    if (n_failed > 0)
+    {
+        fprintf(stderr, "%d checks failed\n", n_failed);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,369 @@
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <json.hpp>
+
+// Runs duo over a grid of settings and collects what --stats-json reports.
+// Every prompt runs once per thread split without a draft model, as the
+// baseline, and once per draft model, draft length and thread split; the
+// speedup of a speculative run is its decode speed over the baseline's for
+// the same prompt, threads and repetition.
+//
+// usage: duo-bench -m MAIN [-md DRAFT[,DRAFT...]] [--draft N[,N...]] [--threads T/TD[,T/TD...]]
+//                  [-p PROMPT | -f PROMPTS] [-n N] [--reps R] [--seed S] [--duo PATH]
+//                  [--format json|csv] [-o OUT] [-- more duo args]
+// PROMPTS has one prompt per line. Results go to OUT or stdout.
+
+namespace
+{
+
+using json = nlohmann::json;
+
+struct bench_config
+{
+    std::string              duo;
+    std::string              model;
+    std::vector<std::string> drafts;
+    std::vector<int>         n_drafts  = { 4 };
+    std::vector<std::string> threads   = { "" };
+    std::vector<std::string> prompts;
+    int                      n_predict = 128;
+    int                      n_reps    = 1;
+    int                      seed      = 42;
+    std::string              format    = "json";
+    std::string              out;
+    std::vector<std::string> extra;
+};
+
+std::vector<std::string> split(const std::string & value, char sep)
+{
+    std::vector<std::string> res;
+    std::istringstream iss(value);
+    std::string item;
+    while (std::getline(iss, item, sep))
+    {
+        if (!item.empty())
+        {
+            res.push_back(item);
+        }
+    }
+    return res;
+}
+
+std::string quote(const std::string & arg)
+{
+#ifdef _WIN32
+    return "\"" + arg + "\"";
+#else
+    std::string res = "'";
+    for (char c : arg)
+    {
+        res += c == '\'' ? std::string("'\\''") : std::string(1, c);
+    }
+    return res + "'";
+#endif
+}
+
+std::string temp_dir()
+{
+#ifdef _WIN32
+    const char * dir = getenv("TEMP");
+    return dir != nullptr ? dir : ".";
+#else
+    const char * dir = getenv("TMPDIR");
+    return dir != nullptr ? dir : "/tmp";
+#endif
+}
+
+bool parse_args(int argc, char ** argv, bench_config & cfg)
+{
+    const std::string self = argv[0];
+    const size_t slash = self.find_last_of("/\\");
+    cfg.duo = (slash == std::string::npos ? std::string(".") : self.substr(0, slash)) + "/duo";
+
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--")
+        {
+            cfg.extra.assign(argv + i + 1, argv + argc);
+            break;
+        }
+        if (i + 1 >= argc)
+        {
+            fprintf(stderr, "missing value for %s\n", arg.c_str());
+            return false;
+        }
+        const std::string value = argv[++i];
+        if (arg == "-m")
+        {
+            cfg.model = value;
+        }
+        else if (arg == "-md")
+        {
+            cfg.drafts = split(value, ',');
+        }
+        else if (arg == "--draft")
+        {
+            cfg.n_drafts.clear();
+            for (const std::string & n : split(value, ','))
+            {
+                cfg.n_drafts.push_back(std::atoi(n.c_str()));
+            }
+        }
+        else if (arg == "--threads")
+        {
+            cfg.threads = split(value, ',');
+        }
+        else if (arg == "-p")
+        {
+            cfg.prompts.push_back(value);
+        }
+        else if (arg == "-f")
+        {
+            std::ifstream in(value);
+            if (!in)
+            {
+                fprintf(stderr, "could not read %s\n", value.c_str());
+                return false;
+            }
+            for (std::string line; std::getline(in, line); )
+            {
+                if (!line.empty())
+                {
+                    cfg.prompts.push_back(line);
+                }
+            }
+        }
+        else if (arg == "-n")
+        {
+            cfg.n_predict = std::atoi(value.c_str());
+        }
+        else if (arg == "--reps")
+        {
+            cfg.n_reps = std::atoi(value.c_str());
+        }
+        else if (arg == "--seed")
+        {
+            cfg.seed = std::atoi(value.c_str());
+        }
+        else if (arg == "--duo")
+        {
+            cfg.duo = value;
+        }
+        else if (arg == "--format")
+        {
+            cfg.format = value;
+        }
+        else if (arg == "-o")
+        {
+            cfg.out = value;
+        }
+        else
+        {
+            fprintf(stderr, "unknown argument %s\n", arg.c_str());
+            return false;
+        }
+    }
+    if (cfg.model.empty() || cfg.prompts.empty() || (cfg.format != "json" && cfg.format != "csv"))
+    {
+        fprintf(stderr, "usage: %s -m MAIN [-md DRAFT[,...]] [--draft N[,...]] [--threads T/TD[,...]] (-p PROMPT | -f PROMPTS)"
+                        " [-n N] [--reps R] [--seed S] [--duo PATH] [--format json|csv] [-o OUT] [-- duo args]\n", argv[0]);
+        return false;
+    }
+    return true;
+}
+
+// one duo run; an empty draft is the baseline
+struct run_spec
+{
+    size_t      prompt;
+    int         rep;
+    std::string draft;
+    int         n_draft;
+    std::string threads; // "T/TD", empty: duo's default
+};
+
+bool run(const bench_config & cfg, const run_spec & spec, const std::string & prompt_file, json & row)
+{
+    const std::string stats_file = temp_dir() + "/duo-bench-stats.json";
+    const std::string log_file   = temp_dir() + "/duo-bench.log";
+    remove(stats_file.c_str());
+
+    std::string cmd = quote(cfg.duo) + " -m " + quote(cfg.model) + " -f " + quote(prompt_file)
+        + " -n " + std::to_string(cfg.n_predict) + " --seed " + std::to_string(cfg.seed)
+        + " --stats-json " + quote(stats_file);
+    if (!spec.draft.empty())
+    {
+        cmd += " -md " + quote(spec.draft) + " --draft " + std::to_string(spec.n_draft);
+    }
+    const std::vector<std::string> t = split(spec.threads, '/');
+    if (t.size() > 0)
+    {
+        cmd += " -t " + t[0];
+    }
+    if (t.size() > 1 && !spec.draft.empty())
+    {
+        cmd += " -td " + t[1];
+    }
+    for (const std::string & arg : cfg.extra)
+    {
+        cmd += " " + quote(arg);
+    }
+#ifdef _WIN32
+    cmd += " > NUL 2> " + quote(log_file);
+#else
+    cmd += " > /dev/null 2> " + quote(log_file);
+#endif
+
+    if (std::system(cmd.c_str()) != 0)
+    {
+        fprintf(stderr, "failed: %s\nsee %s\n", cmd.c_str(), log_file.c_str());
+        return false;
+    }
+    std::ifstream in(stats_file);
+    try
+    {
+        row = json::parse(in);
+    }
+    catch (const std::exception & e)
+    {
+        fprintf(stderr, "could not read %s: %s\n", stats_file.c_str(), e.what());
+        return false;
+    }
+    row["prompt"]        = spec.prompt;
+    row["rep"]           = spec.rep;
+    row["model_draft"]   = spec.draft;
+    row["n_draft"]       = spec.draft.empty() ? 0 : spec.n_draft;
+    row["threads"]       = t.size() > 0 ? std::atoi(t[0].c_str()) : 0;
+    row["threads_draft"] = t.size() > 1 && !spec.draft.empty() ? std::atoi(t[1].c_str()) : 0;
+    return true;
+}
+
+std::string to_csv(const json & rows)
+{
+    static const char * columns[] = {
+        "prompt", "rep", "model_draft", "n_draft", "threads", "threads_draft", "prefill_tokens", "prefill_tps",
+        "tokens", "decode_tps", "speedup", "drafted", "accepted", "acceptance", "acceptance_by_position",
+        "itl_p50_ms", "itl_p99_ms"
+    };
+    std::ostringstream oss;
+    for (size_t i = 0; i < sizeof(columns) / sizeof(columns[0]); i++)
+    {
+        oss << (i > 0 ? "," : "") << columns[i];
+    }
+    oss << "\n";
+    for (const json & row : rows)
+    {
+        for (size_t i = 0; i < sizeof(columns) / sizeof(columns[0]); i++)
+        {
+            const json & v = row[columns[i]];
+            oss << (i > 0 ? "," : "");
+            if (v.is_string())
+            {
+                oss << "\"" << v.get<std::string>() << "\"";
+            }
+            else if (v.is_array())
+            {
+                // positions separated by ';' to stay one column
+                for (size_t k = 0; k < v.size(); k++)
+                {
+                    oss << (k > 0 ? ";" : "") << v[k].get<double>();
+                }
+            }
+            else
+            {
+                oss << v.dump();
+            }
+        }
+        oss << "\n";
+    }
+    return oss.str();
+}
+
+}
+
+int main(int argc, char ** argv)
+{
+    bench_config cfg;
+    if (!parse_args(argc, argv, cfg))
+    {
+        return 1;
+    }
+
+    std::vector<std::string> prompt_files;
+    for (size_t i = 0; i < cfg.prompts.size(); i++)
+    {
+        prompt_files.push_back(temp_dir() + "/duo-bench-prompt-" + std::to_string(i) + ".txt");
+        std::ofstream(prompt_files.back()) << cfg.prompts[i];
+    }
+
+    json rows = json::array();
+    fprintf(stderr, "%-6s %-4s %-24s %-6s %-8s %10s %10s %8s %10s %10s\n",
+        "prompt", "rep", "draft", "n", "threads", "prefill", "decode", "speedup", "itl p50", "itl p99");
+    for (size_t p = 0; p < cfg.prompts.size(); p++)
+    {
+        for (int rep = 0; rep < cfg.n_reps; rep++)
+        {
+            for (const std::string & threads : cfg.threads)
+            {
+                std::vector<run_spec> specs = { { p, rep, "", 0, threads } };
+                for (const std::string & draft : cfg.drafts)
+                {
+                    for (int n_draft : cfg.n_drafts)
+                    {
+                        specs.push_back({ p, rep, draft, n_draft, threads });
+                    }
+                }
+
+                double baseline_tps = 0.0;
+                for (const run_spec & spec : specs)
+                {
+                    json row;
+                    if (!run(cfg, spec, prompt_files[p], row))
+                    {
+                        return 1;
+                    }
+                    const double tps = row["decode_tps"].get<double>();
+                    if (spec.draft.empty())
+                    {
+                        baseline_tps = tps;
+                    }
+                    row["speedup"] = baseline_tps > 0.0 ? tps / baseline_tps : 0.0;
+                    fprintf(stderr, "%-6zu %-4d %-24s %-6d %-8s %10.1f %10.1f %8.2f %10.2f %10.2f\n",
+                        p, rep, spec.draft.empty() ? "-" : spec.draft.substr(spec.draft.find_last_of("/\\") + 1).c_str(),
+                        row["n_draft"].get<int>(), threads.empty() ? "-" : threads.c_str(),
+                        row["prefill_tps"].get<double>(), tps, row["speedup"].get<double>(),
+                        row["itl_p50_ms"].get<double>(), row["itl_p99_ms"].get<double>());
+                    rows.push_back(row);
+                }
+            }
+        }
+    }
+
+    for (const std::string & f : prompt_files)
+    {
+        remove(f.c_str());
+    }
+
+    const std::string res = cfg.format == "csv" ? to_csv(rows) : rows.dump(2) + "\n";
+    if (cfg.out.empty())
+    {
+        fputs(res.c_str(), stdout);
+    }
+    else
+    {
+        std::ofstream out(cfg.out);
+        out << res;
+        if (!out)
+        {
+            fprintf(stderr, "could not write %s\n", cfg.out.c_str());
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,209 @@
+#!/usr/bin/env python3
+# Writes a tiny random llama main model and a draft model made of its first
+# layers, as f32 GGUF files, so duo-bench runs on machines without real
+# models. The layers only nudge the residual stream, so the two models agree
+# on most tokens, as a real main/draft pair would.
+#
+# usage: make_tiny_models.py [out_dir] [--vocab N] [--embd N] [--heads N] [--layers N] [--draft-layers N] [--mix X] [--seed S]
+# Needs nothing beyond the standard library.
+
+import argparse
+import array
+import os
+import random
+import struct
+import sys
+
+GGUF_MAGIC     = 0x46554747
+GGUF_VERSION   = 3
+GGUF_ALIGNMENT = 32
+
+T_UINT32  = 4
+T_INT32   = 5
+T_FLOAT32 = 6
+T_BOOL    = 7
+T_STRING  = 8
+T_ARRAY   = 9
+
+GGML_TYPE_F32 = 0
+
+TOKEN_NORMAL  = 1
+TOKEN_UNKNOWN = 2
+TOKEN_CONTROL = 3
+TOKEN_BYTE    = 6
+
+WORDS = (
+    "the of and to in is was that for it as with be on not he by are this at from his but have an they which "
+    "one you were all we her she there been their has would when more will if no out so said what up its about "
+    "into than them can only other new some could time these two may then do first any my now such like our over "
+    "man me even most made after also did many before must through back years where much your way well down "
+    "should because each just those people how too little state good very make world still own see men work long "
+    "get here between both life being under never day same another know while last might us great old year off "
+    "come since against go came right used take three once upon a fox quick brown lazy dog jumps"
+).split()
+
+
+def vocab(n_vocab):
+    tokens = [("<unk>", TOKEN_UNKNOWN), ("<s>", TOKEN_CONTROL), ("</s>", TOKEN_CONTROL)]
+    tokens += [("<0x%02X>" % b, TOKEN_BYTE) for b in range(256)]
+    pieces = ["▁"] + [chr(c) for c in range(ord("a"), ord("z") + 1)]
+    pieces += ["▁" + chr(c) for c in range(ord("a"), ord("z") + 1)]
+    pieces += ["▁" + w for w in WORDS] + [w for w in WORDS]
+    pieces += [a + b for a in "etaoinshrdlu" for b in "etaoinshrdlu"]
+    seen = set()
+    for p in pieces:
+        if len(tokens) >= n_vocab:
+            break
+        if p not in seen:
+            seen.add(p)
+            tokens.append((p, TOKEN_NORMAL))
+    if len(tokens) < n_vocab:
+        sys.exit("--vocab is larger than the built-in pieces (%d)" % len(tokens))
+    # longer pieces merge first
+    scores = [0.0 if t != TOKEN_NORMAL else float(len(p)) - i * 1e-4 for i, (p, t) in enumerate(tokens)]
+    return [p for p, _ in tokens], scores, [t for _, t in tokens]
+
+
+class gguf_writer:
+    def __init__(self):
+        self.kv = []
+        self.tensors = []
+
+    def add(self, key, vtype, value, etype=None):
+        self.kv.append((key, vtype, value, etype))
+
+    def add_tensor(self, name, dims, data):
+        self.tensors.append((name, dims, data))
+
+    @staticmethod
+    def _str(s):
+        b = s.encode("utf-8")
+        return struct.pack("<Q", len(b)) + b
+
+    @staticmethod
+    def _val(vtype, v):
+        if vtype == T_UINT32:
+            return struct.pack("<I", v)
+        if vtype == T_INT32:
+            return struct.pack("<i", v)
+        if vtype == T_FLOAT32:
+            return struct.pack("<f", v)
+        if vtype == T_BOOL:
+            return struct.pack("<?", v)
+        if vtype == T_STRING:
+            return gguf_writer._str(v)
+        raise ValueError(vtype)
+
+    def write(self, path):
+        out = bytearray(struct.pack("<IIQQ", GGUF_MAGIC, GGUF_VERSION, len(self.tensors), len(self.kv)))
+        for key, vtype, value, etype in self.kv:
+            out += self._str(key) + struct.pack("<I", vtype)
+            if vtype == T_ARRAY:
+                out += struct.pack("<IQ", etype, len(value))
+                for v in value:
+                    out += self._val(etype, v)
+            else:
+                out += self._val(vtype, value)
+
+        offset = 0
+        for name, dims, data in self.tensors:
+            out += self._str(name) + struct.pack("<I", len(dims))
+            out += b"".join(struct.pack("<Q", d) for d in dims)
+            out += struct.pack("<IQ", GGML_TYPE_F32, offset)
+            offset += -(-len(data) * 4 // GGUF_ALIGNMENT) * GGUF_ALIGNMENT
+
+        with open(path, "wb") as f:
+            f.write(out)
+            f.write(b"\0" * (-len(out) % GGUF_ALIGNMENT))
+            for _, _, data in self.tensors:
+                data.tofile(f)
+                f.write(b"\0" * (-len(data) * 4 % GGUF_ALIGNMENT))
+
+
+def tensor(rng, n, scale):
+    return array.array("f", (rng.gauss(0.0, scale) for _ in range(n)))
+
+
+def ones(n):
+    return array.array("f", [1.0] * n)
+
+
+def model(args, rng):
+    n_embd, n_ff = args.embd, max(32, args.embd * 8 // 3 // 32 * 32)
+    shared = {
+        "token_embd.weight":  ([n_embd, args.vocab], tensor(rng, n_embd * args.vocab, 1.0)),
+        "output_norm.weight": ([n_embd], ones(n_embd)),
+        "output.weight":      ([n_embd, args.vocab], tensor(rng, n_embd * args.vocab, 1.0)),
+    }
+    blocks = []
+    for _ in range(args.layers):
+        s = args.mix / n_embd ** 0.5
+        blocks.append({
+            "attn_norm.weight":   ([n_embd], ones(n_embd)),
+            "attn_q.weight":      ([n_embd, n_embd], tensor(rng, n_embd * n_embd, 1.0 / n_embd ** 0.5)),
+            "attn_k.weight":      ([n_embd, n_embd], tensor(rng, n_embd * n_embd, 1.0 / n_embd ** 0.5)),
+            "attn_v.weight":      ([n_embd, n_embd], tensor(rng, n_embd * n_embd, 1.0 / n_embd ** 0.5)),
+            "attn_output.weight": ([n_embd, n_embd], tensor(rng, n_embd * n_embd, s)),
+            "ffn_norm.weight":    ([n_embd], ones(n_embd)),
+            "ffn_gate.weight":    ([n_embd, n_ff], tensor(rng, n_embd * n_ff, 1.0 / n_embd ** 0.5)),
+            "ffn_up.weight":      ([n_embd, n_ff], tensor(rng, n_embd * n_ff, 1.0 / n_embd ** 0.5)),
+            "ffn_down.weight":    ([n_ff, n_embd], tensor(rng, n_ff * n_embd, s)),
+        })
+    return n_ff, shared, blocks
+
+
+def write(path, name, args, n_ff, shared, blocks, tokens, scores, types):
+    w = gguf_writer()
+    w.add("general.architecture", T_STRING, "llama")
+    w.add("general.name", T_STRING, name)
+    w.add("general.alignment", T_UINT32, GGUF_ALIGNMENT)
+    w.add("general.file_type", T_UINT32, 0)
+    w.add("llama.context_length", T_UINT32, 4096)
+    w.add("llama.embedding_length", T_UINT32, args.embd)
+    w.add("llama.block_count", T_UINT32, len(blocks))
+    w.add("llama.feed_forward_length", T_UINT32, n_ff)
+    w.add("llama.rope.dimension_count", T_UINT32, args.embd // args.heads)
+    w.add("llama.attention.head_count", T_UINT32, args.heads)
+    w.add("llama.attention.head_count_kv", T_UINT32, args.heads)
+    w.add("llama.attention.layer_norm_rms_epsilon", T_FLOAT32, 1e-5)
+    w.add("tokenizer.ggml.model", T_STRING, "llama")
+    w.add("tokenizer.ggml.tokens", T_ARRAY, tokens, T_STRING)
+    w.add("tokenizer.ggml.scores", T_ARRAY, scores, T_FLOAT32)
+    w.add("tokenizer.ggml.token_type", T_ARRAY, types, T_INT32)
+    w.add("tokenizer.ggml.unknown_token_id", T_UINT32, 0)
+    w.add("tokenizer.ggml.bos_token_id", T_UINT32, 1)
+    w.add("tokenizer.ggml.eos_token_id", T_UINT32, 2)
+    w.add("tokenizer.ggml.add_bos_token", T_BOOL, True)
+    w.add("tokenizer.ggml.add_eos_token", T_BOOL, False)
+    for key, (dims, data) in shared.items():
+        w.add_tensor(key, dims, data)
+    for i, block in enumerate(blocks):
+        for key, (dims, data) in block.items():
+            w.add_tensor("blk.%d.%s" % (i, key), dims, data)
+    w.write(path)
+    print("%s: %d layers, %.1f MiB" % (path, len(blocks), os.path.getsize(path) / 2.0 ** 20))
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("out_dir", nargs="?", default=".")
+    ap.add_argument("--vocab", type=int, default=512)
+    ap.add_argument("--embd", type=int, default=128)
+    ap.add_argument("--heads", type=int, default=4)
+    ap.add_argument("--layers", type=int, default=6)
+    ap.add_argument("--draft-layers", type=int, default=2)
+    ap.add_argument("--mix", type=float, default=0.3, help="scale of what each layer adds to the residual stream")
+    ap.add_argument("--seed", type=int, default=42)
+    args = ap.parse_args()
+    if args.draft_layers < 1 or args.draft_layers > args.layers or args.embd % args.heads != 0:
+        sys.exit("need 1 <= --draft-layers <= --layers and --embd divisible by --heads")
+
+    os.makedirs(args.out_dir, exist_ok=True)
+    tokens, scores, types = vocab(args.vocab)
+    n_ff, shared, blocks = model(args, random.Random(args.seed))
+    write(os.path.join(args.out_dir, "tiny-main.gguf"), "tiny-main", args, n_ff, shared, blocks, tokens, scores, types)
+    write(os.path.join(args.out_dir, "tiny-draft.gguf"), "tiny-draft", args, n_ff, shared, blocks[:args.draft_layers], tokens, scores, types)
+
+
+if __name__ == "__main__":
+    main()
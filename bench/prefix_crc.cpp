@@ -0,0 +1,156 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "prefix_crc.h"
+
+// micro-benchmark: lead.cpp's per-step crc32 over the whole approved prefix
+// vs prefix_crc, plus raw throughput of the crc32c kernels.
+// usage: crc-bench [n_tokens] [n_iter]
+
+namespace
+{
+
+// the checksum lead.cpp used before prefix_crc.h
+template<typename iter_t>
+uint32_t baseline(iter_t begin, iter_t end)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    for (auto it = begin; it != end; ++it)
+    {
+        const auto val = *it;
+        const uint8_t * bytes = reinterpret_cast<const uint8_t*>(&val);
+        for (uint32_t i = 0; i < sizeof(val); ++i)
+        {
+            crc = crc ^ bytes[i];
+            for (uint32_t j = 0; j < 8; j++)
+            {
+                if (crc & 1)
+                    crc = (crc >> 1) ^ 0xEDB88320;
+                else
+                    crc = crc >> 1;
+            }
+        }
+    }
+    return ~crc;
+}
+
+template<typename fn_t>
+double time_us(size_t n_iter, fn_t fn)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n_iter; i++)
+    {
+        fn();
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::micro>(end - start).count() / n_iter;
+}
+
+// approved length after every verification of a simulated generation:
+// 1 to 5 tokens at a time
+std::vector<size_t> approval_steps(size_t n_prompt, size_t n_tokens, std::mt19937 & rng)
+{
+    std::uniform_int_distribution<size_t> step(1, 5);
+    std::vector<size_t> res;
+    for (size_t n = n_prompt; n < n_tokens; n += step(rng))
+    {
+        res.push_back(n);
+    }
+    res.push_back(n_tokens);
+    return res;
+}
+
+}
+
+int main(int argc, char ** argv)
+{
+    using namespace llama_duo;
+
+    const size_t n_tokens = argc > 1 ? std::atoi(argv[1]) : 4096;
+    const size_t n_iter   = argc > 2 ? std::atoi(argv[2]) : 20;
+
+    std::vector<crc32c_kernel> kernels = { { "slice8", crc32c_slice8 } };
+#if defined(LLAMA_DUO_CRC32C_X86)
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        kernels.push_back({ "sse4.2", crc32c_sse42 });
+    }
+#elif defined(LLAMA_DUO_CRC32C_ARM)
+    kernels.push_back({ "armv8", crc32c_armv8 });
+#endif
+
+    // standard check value
+    const char * check = "123456789";
+    for (const auto & k : kernels)
+    {
+        const uint32_t got = ~k.fn(~0u, reinterpret_cast<const uint8_t *>(check), 9);
+        if (got != 0xE3069283u)
+        {
+            fprintf(stderr, "%s: crc32c(\"123456789\") = %08x, expected e3069283\n", k.name, got);
+            return 1;
+        }
+    }
+
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<llama_token> token(0, 128255);
+    std::vector<llama_token> tokens(n_tokens);
+    for (auto & t : tokens)
+    {
+        t = token(rng);
+    }
+
+    prefix_crc rolling;
+    rolling.append(tokens.begin(), tokens.end());
+    for (size_t n = 0; n <= n_tokens; n++)
+    {
+        if (rolling.prefix(n) != crc32c(tokens.data(), n * sizeof(llama_token)))
+        {
+            fprintf(stderr, "prefix_crc mismatch at %zu\n", n);
+            return 1;
+        }
+    }
+
+    printf("kernel: %s, tokens: %zu, iterations: %zu\n", crc32c_best_kernel().name, n_tokens, n_iter);
+
+    // whole sequence at once
+    const double bytes = n_tokens * sizeof(llama_token);
+    volatile uint32_t sink = 0;
+    printf("%-10s %12s %12s\n", "checksum", "us", "MB/s");
+    const double base_us = time_us(n_iter, [&]() { sink = baseline(tokens.begin(), tokens.end()); });
+    printf("%-10s %12.2f %12.1f\n", "crc32", base_us, bytes / base_us);
+    for (const auto & k : kernels)
+    {
+        const double us = time_us(n_iter, [&]() { sink = k.fn(~0u, reinterpret_cast<const uint8_t *>(tokens.data()), bytes); });
+        printf("%-10s %12.2f %12.1f\n", k.name, us, bytes / us);
+    }
+
+    // a generation: checksum of the approved prefix after every verification
+    const std::vector<size_t> steps = approval_steps(n_tokens / 4, n_tokens, rng);
+    const double base_gen_us = time_us(n_iter, [&]()
+    {
+        for (size_t n : steps)
+        {
+            sink = baseline(tokens.begin(), tokens.begin() + n);
+        }
+    });
+    const double rolling_gen_us = time_us(n_iter, [&]()
+    {
+        prefix_crc r;
+        r.append(tokens.begin(), tokens.begin() + steps[0]);
+        for (size_t n : steps)
+        {
+            r.append(tokens.begin() + r.size(), tokens.begin() + n);
+            sink = r.prefix(n);
+        }
+    });
+    printf("\ngeneration, prompt %zu, %zu verifications\n", steps[0], steps.size());
+    printf("%-10s %12s %12s\n", "checksum", "total us", "us/step");
+    printf("%-10s %12.2f %12.3f\n", "crc32", base_gen_us, base_gen_us / steps.size());
+    printf("%-10s %12.2f %12.3f\n", "rolling", rolling_gen_us, rolling_gen_us / steps.size());
+    printf("speedup: %.1fx\n", base_gen_us / rolling_gen_us);
+
+    return 0;
+}
@@ -0,0 +1,276 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace llama_duo
+{
+
+// "0-3,8,10-11" to { 0, 1, 2, 3, 8, 10, 11 }, as in /sys cpu and node lists
+inline std::vector<int> parse_cpu_list(const std::string & list)
+{
+    std::vector<int> res;
+    std::istringstream iss(list);
+    std::string item;
+    while (std::getline(iss, item, ','))
+    {
+        int from = 0, to = 0;
+        const int n = sscanf(item.c_str(), "%d-%d", &from, &to);
+        if (n < 1)
+        {
+            continue;
+        }
+        for (int c = from; c <= (n == 2 ? to : from); c++)
+        {
+            res.push_back(c);
+        }
+    }
+    return res;
+}
+
+inline std::string format_cpu_list(std::vector<int> cpus)
+{
+    std::sort(cpus.begin(), cpus.end());
+    std::string res;
+    for (size_t i = 0; i < cpus.size(); )
+    {
+        size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1)
+        {
+            j++;
+        }
+        res += (res.empty() ? "" : ",") + std::to_string(cpus[i]) + (j > i ? "-" + std::to_string(cpus[j]) : "");
+        i = j + 1;
+    }
+    return res;
+}
+
+// The cores one model runs on: its threads are pinned to these cpus and its
+// KV cache is allocated on 'node'.
+struct core_set
+{
+    std::vector<int> cpus;      // logical cpus, SMT siblings included
+    size_t           n_cores = 0;
+    int              node    = -1;
+
+    bool empty() const
+    {
+        return cpus.empty();
+    }
+};
+
+// Physical cores of the host, ordered by NUMA node, then by the last level
+// cache they share, so neighbours in the order are as close as it gets.
+// Read from /sys on Linux, empty elsewhere.
+class cpu_topology
+{
+  public:
+    static cpu_topology read()
+    {
+        cpu_topology topo;
+#ifdef __linux__
+        const std::string sys = "/sys/devices/system/";
+        std::map<int, int> node_of;
+        for (int node = 0; ; node++)
+        {
+            const std::string list = read_line(sys + "node/node" + std::to_string(node) + "/cpulist");
+            if (list.empty() && node > 0)
+            {
+                break;
+            }
+            for (int c : parse_cpu_list(list))
+            {
+                node_of[c] = node;
+            }
+        }
+
+        std::map<int, size_t> core_of; // first SMT sibling to index in cores_
+        for (int c : parse_cpu_list(read_line(sys + "cpu/online")))
+        {
+            const std::string dir = sys + "cpu/cpu" + std::to_string(c) + "/";
+            const std::vector<int> siblings = parse_cpu_list(read_line(dir + "topology/thread_siblings_list"));
+            const int first = siblings.empty() ? c : siblings.front();
+            auto it = core_of.find(first);
+            if (it == core_of.end())
+            {
+                cpu_core core;
+                core.node  = node_of.count(c) ? node_of[c] : 0;
+                core.cache = first;
+                int top_level = 0;
+                for (int idx = 0; ; idx++)
+                {
+                    const std::string cache = dir + "cache/index" + std::to_string(idx) + "/";
+                    const std::string level = read_line(cache + "level");
+                    if (level.empty())
+                    {
+                        break;
+                    }
+                    // cpus sharing the last level cache have the same first cpu in its list
+                    const std::vector<int> shared = parse_cpu_list(read_line(cache + "shared_cpu_list"));
+                    if (std::atoi(level.c_str()) >= top_level && !shared.empty())
+                    {
+                        top_level  = std::atoi(level.c_str());
+                        core.cache = shared.front();
+                    }
+                }
+                it = core_of.emplace(first, topo.cores_.size()).first;
+                topo.cores_.push_back(core);
+            }
+            topo.cores_[it->second].cpus.push_back(c);
+        }
+        std::sort(topo.cores_.begin(), topo.cores_.end(), [](const cpu_core & a, const cpu_core & b)
+        {
+            return a.node != b.node ? a.node < b.node : a.cache != b.cache ? a.cache < b.cache : a.cpus.front() < b.cpus.front();
+        });
+#endif
+        return topo;
+    }
+
+    size_t n_cores() const
+    {
+        return cores_.size();
+    }
+
+    size_t n_cpus() const
+    {
+        size_t n = 0;
+        for (const auto & core : cores_)
+        {
+            n += core.cpus.size();
+        }
+        return n;
+    }
+
+    size_t n_nodes() const
+    {
+        std::vector<int> nodes;
+        for (const auto & core : cores_)
+        {
+            nodes.push_back(core.node);
+        }
+        std::sort(nodes.begin(), nodes.end());
+        return std::unique(nodes.begin(), nodes.end()) - nodes.begin();
+    }
+
+    // Disjoint core sets for the main and the draft model: the main model
+    // takes cores from the front of the order, the draft model from the back,
+    // so they end up on different nodes and caches whenever the counts allow.
+    // If they ask for more than there is, both shares shrink in proportion.
+    // False with fewer than two cores.
+    bool split(size_t n_main, size_t n_draft, core_set & main, core_set & draft) const
+    {
+        const size_t n = cores_.size();
+        if (n < 2 || n_main == 0 || n_draft == 0)
+        {
+            return false;
+        }
+        if (n_main + n_draft > n)
+        {
+            n_draft = std::min(n - 1, std::max<size_t>(1, (n * n_draft + (n_main + n_draft) / 2) / (n_main + n_draft)));
+            n_main  = n - n_draft;
+        }
+        main  = make_set(0, n_main);
+        draft = make_set(n - n_draft, n);
+        return true;
+    }
+
+  private:
+    struct cpu_core
+    {
+        int              node  = 0;
+        int              cache = 0; // first cpu sharing the last level cache
+        std::vector<int> cpus;      // SMT siblings
+    };
+
+    static std::string read_line(const std::string & path)
+    {
+        std::ifstream in(path);
+        std::string line;
+        std::getline(in, line);
+        return line;
+    }
+
+    core_set make_set(size_t from, size_t to) const
+    {
+        core_set res;
+        std::map<int, size_t> per_node;
+        for (size_t i = from; i < to; i++)
+        {
+            res.cpus.insert(res.cpus.end(), cores_[i].cpus.begin(), cores_[i].cpus.end());
+            per_node[cores_[i].node]++;
+        }
+        res.n_cores = to - from;
+        res.node = std::max_element(per_node.begin(), per_node.end(), [](const std::pair<const int, size_t> & a, const std::pair<const int, size_t> & b)
+        {
+            return a.second < b.second;
+        })->first;
+        return res;
+    }
+
+    std::vector<cpu_core> cores_;
+};
+
+// pins the calling thread to 'set', an empty set leaves it as it is; threads
+// it starts afterwards inherit the pinning
+inline bool pin_thread(const core_set & set)
+{
+    if (set.empty())
+    {
+        return true;
+    }
+#ifdef __linux__
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for (int c : set.cpus)
+    {
+        if (c < CPU_SETSIZE)
+        {
+            CPU_SET(c, &mask);
+        }
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) == 0;
+#else
+    (void) set;
+    return false;
+#endif
+}
+
+// Memory the calling thread touches first from now on comes from 'node' if
+// it has room, -1 goes back to the default policy. Plain syscall, so there
+// is no dependency on libnuma.
+inline bool prefer_node(int node)
+{
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+    const int kMpolDefault   = 0;
+    const int kMpolPreferred = 1;
+    unsigned long mask[1024 / (8 * sizeof(unsigned long))] = {};
+    if (node >= 1024)
+    {
+        return false;
+    }
+    if (node < 0)
+    {
+        return syscall(SYS_set_mempolicy, kMpolDefault, nullptr, 0) == 0;
+    }
+    mask[node / (8 * sizeof(unsigned long))] |= 1ul << (node % (8 * sizeof(unsigned long)));
+    return syscall(SYS_set_mempolicy, kMpolPreferred, mask, 1024 + 1) == 0;
+#else
+    (void) node;
+    return false;
+#endif
+}
+
+}
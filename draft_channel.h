@@ -0,0 +1,506 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include <llama.h>
+
+#include "spec_sampling.h"
+
+namespace llama_duo
+{
+
+// Binary protocol between duo and a remote drafter (duo --draft-serve).
+//
+// One TCP connection per generation and drafter, dialed by either side:
+// the main model connects to --draft-serve drafters, --draft-join drafters
+// connect to its --draft-listen port; the main model always speaks first.
+// A frame is a varint payload length followed by the payload: a type byte
+// and the fields below. Integers are LEB128 varints, token lists a count
+// and the zigzag-encoded difference to the previous token. Nothing is ever
+// sent twice: verdicts carry what was verified since the previous verdict,
+// drafts only new tokens, and both are tagged with the main model's
+// token_log epoch instead of the prefix.
+//
+//   hello    main -> drafter: version, n_vocab, n_draft, temp, top_k, top_p, seed
+//            drafter -> main: version, n_vocab
+//   verdict  main -> drafter: epoch, from, tokens, crc32c of [0, from + n);
+//            [0, from + n) is verified. The first verdict is the prompt.
+//            Both sides keep a prefix_crc of the verified tokens, a
+//            drafter whose copy differs ends the session.
+//   drafts   drafter -> main: epoch, pos, tokens, with_dists[, dists]
+//   idle     drafter -> main: n_verified it stopped drafting at
+//   stop     main -> drafter
+enum class frame_type : uint8_t
+{
+    hello   = 1,
+    verdict = 2,
+    drafts  = 3,
+    idle    = 4,
+    stop    = 5,
+};
+
+static const uint64_t kDraftProtocolVersion = 2;
+
+class frame_writer
+{
+  public:
+    explicit frame_writer(frame_type type)
+        : buf_(1, static_cast<uint8_t>(type))
+    {
+    }
+
+    void put_varint(uint64_t v)
+    {
+        while (v >= 0x80)
+        {
+            buf_.push_back(static_cast<uint8_t>(v) | 0x80);
+            v >>= 7;
+        }
+        buf_.push_back(static_cast<uint8_t>(v));
+    }
+
+    void put_float(float f)
+    {
+        uint32_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        for (int i = 0; i < 4; i++)
+        {
+            buf_.push_back(static_cast<uint8_t>(bits >> (8 * i)));
+        }
+    }
+
+    void put_tokens(const llama_token * tokens, size_t n)
+    {
+        put_varint(n);
+        int64_t prev = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            const int64_t d = static_cast<int64_t>(tokens[i]) - prev;
+            put_varint((static_cast<uint64_t>(d) << 1) ^ static_cast<uint64_t>(d >> 63));
+            prev = tokens[i];
+        }
+    }
+
+    void put_dist(const token_dist & dist)
+    {
+        put_tokens(dist.ids.data(), dist.ids.size());
+        for (float p : dist.p)
+        {
+            put_float(p);
+        }
+    }
+
+    const std::vector<uint8_t> & payload() const
+    {
+        return buf_;
+    }
+
+  private:
+    std::vector<uint8_t> buf_;
+};
+
+// reads fields in the order they were written; ok() turns false on the
+// first field running past the end and stays false
+class frame_reader
+{
+  public:
+    explicit frame_reader(const std::vector<uint8_t> & payload)
+        : buf_(payload)
+        , pos_(1)
+        , ok_(!payload.empty())
+    {
+    }
+
+    frame_type type() const
+    {
+        return ok_ ? static_cast<frame_type>(buf_[0]) : frame_type::stop;
+    }
+
+    bool ok() const
+    {
+        return ok_;
+    }
+
+    uint64_t get_varint()
+    {
+        uint64_t v = 0;
+        for (int shift = 0; ok_ && shift < 64; shift += 7)
+        {
+            if (pos_ >= buf_.size())
+            {
+                break;
+            }
+            const uint8_t b = buf_[pos_++];
+            v |= static_cast<uint64_t>(b & 0x7f) << shift;
+            if ((b & 0x80) == 0)
+            {
+                return v;
+            }
+        }
+        ok_ = false;
+        return 0;
+    }
+
+    float get_float()
+    {
+        if (!ok_ || pos_ + 4 > buf_.size())
+        {
+            ok_ = false;
+            return 0.0f;
+        }
+        uint32_t bits = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            bits |= static_cast<uint32_t>(buf_[pos_++]) << (8 * i);
+        }
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        return f;
+    }
+
+    void get_tokens(std::vector<llama_token> & out)
+    {
+        const uint64_t n = get_varint();
+        // every token takes at least a byte
+        if (n > buf_.size() - pos_)
+        {
+            ok_ = false;
+        }
+        out.clear();
+        int64_t prev = 0;
+        for (uint64_t i = 0; ok_ && i < n; i++)
+        {
+            const uint64_t z = get_varint();
+            prev += static_cast<int64_t>((z >> 1) ^ (~(z & 1) + 1));
+            out.push_back(static_cast<llama_token>(prev));
+        }
+    }
+
+    void get_dist(token_dist & dist)
+    {
+        get_tokens(dist.ids);
+        dist.p.resize(ok_ ? dist.ids.size() : 0);
+        for (float & p : dist.p)
+        {
+            p = get_float();
+        }
+    }
+
+  private:
+    const std::vector<uint8_t> & buf_;
+    size_t pos_;
+    bool   ok_;
+};
+
+// Framed TCP connection. send() may be called from any thread; one thread
+// at a time calls recv(). close() unblocks a pending recv().
+class draft_channel
+{
+  public:
+#ifdef _WIN32
+    using socket_t = SOCKET;
+#else
+    using socket_t = int;
+#endif
+
+    explicit draft_channel(socket_t fd)
+        : fd_(fd)
+    {
+        // frames are small and latency is all that matters
+        int one = 1;
+        setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char *>(&one), sizeof(one));
+#ifdef SO_NOSIGPIPE
+        setsockopt(fd_, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    }
+
+    ~draft_channel()
+    {
+        close();
+#ifdef _WIN32
+        closesocket(fd_);
+#else
+        ::close(fd_);
+#endif
+    }
+
+    draft_channel(const draft_channel &) = delete;
+    draft_channel & operator=(const draft_channel &) = delete;
+
+    // host:port, nullptr if we could not connect
+    static std::unique_ptr<draft_channel> connect(const std::string & address)
+    {
+        const size_t colon = address.rfind(':');
+        if (colon == std::string::npos || !init_sockets())
+        {
+            return nullptr;
+        }
+        const std::string host = address.substr(0, colon);
+        const std::string port = address.substr(colon + 1);
+
+        addrinfo hints = {};
+        hints.ai_family   = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo * res = nullptr;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0)
+        {
+            return nullptr;
+        }
+        std::unique_ptr<draft_channel> ch;
+        for (addrinfo * ai = res; ai != nullptr && !ch; ai = ai->ai_next)
+        {
+            socket_t fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (!valid(fd))
+            {
+                continue;
+            }
+            if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            {
+                ch.reset(new draft_channel(fd));
+            }
+            else
+            {
+                close_socket(fd);
+            }
+        }
+        freeaddrinfo(res);
+        return ch;
+    }
+
+    bool send(const frame_writer & frame)
+    {
+        const std::vector<uint8_t> & payload = frame.payload();
+        std::vector<uint8_t> buf;
+        buf.reserve(payload.size() + 10);
+        uint64_t n = payload.size();
+        while (n >= 0x80)
+        {
+            buf.push_back(static_cast<uint8_t>(n) | 0x80);
+            n >>= 7;
+        }
+        buf.push_back(static_cast<uint8_t>(n));
+        buf.insert(buf.end(), payload.begin(), payload.end());
+
+        std::lock_guard<std::mutex> _lock(send_mtx_);
+        size_t off = 0;
+        while (off < buf.size())
+        {
+            // a drafter going away is not worth a SIGPIPE
+#ifdef MSG_NOSIGNAL
+            const auto sent = ::send(fd_, reinterpret_cast<const char *>(buf.data() + off), buf.size() - off, MSG_NOSIGNAL);
+#else
+            const auto sent = ::send(fd_, reinterpret_cast<const char *>(buf.data() + off), buf.size() - off, 0);
+#endif
+            if (sent <= 0)
+            {
+                return false;
+            }
+            off += sent;
+        }
+        return true;
+    }
+
+    // false once the connection is closed or the peer sent garbage
+    bool recv(std::vector<uint8_t> & payload)
+    {
+        uint64_t n = 0;
+        for (int shift = 0; ; shift += 7)
+        {
+            uint8_t b;
+            if (shift > 28 || !read_exact(&b, 1))
+            {
+                return false;
+            }
+            n |= static_cast<uint64_t>(b & 0x7f) << shift;
+            if ((b & 0x80) == 0)
+            {
+                break;
+            }
+        }
+        if (n == 0 || n > kMaxFrame)
+        {
+            return false;
+        }
+        payload.resize(n);
+        return read_exact(payload.data(), n);
+    }
+
+    void close()
+    {
+#ifdef _WIN32
+        shutdown(fd_, SD_BOTH);
+#else
+        shutdown(fd_, SHUT_RDWR);
+#endif
+    }
+
+  private:
+    friend class draft_listener;
+
+    static const uint64_t kMaxFrame = 64 << 20;
+
+    static bool init_sockets()
+    {
+#ifdef _WIN32
+        static const bool ok = []()
+        {
+            WSADATA data;
+            return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+        }();
+        return ok;
+#else
+        return true;
+#endif
+    }
+
+    static bool valid(socket_t fd)
+    {
+#ifdef _WIN32
+        return fd != INVALID_SOCKET;
+#else
+        return fd >= 0;
+#endif
+    }
+
+    static void close_socket(socket_t fd)
+    {
+#ifdef _WIN32
+        closesocket(fd);
+#else
+        ::close(fd);
+#endif
+    }
+
+    bool read_exact(uint8_t * dst, size_t n)
+    {
+        while (n > 0)
+        {
+            if (rpos_ == rbuf_.size())
+            {
+                rbuf_.resize(64 << 10);
+                const auto got = ::recv(fd_, reinterpret_cast<char *>(rbuf_.data()), rbuf_.size(), 0);
+                if (got <= 0)
+                {
+                    rbuf_.clear();
+                    rpos_ = 0;
+                    return false;
+                }
+                rbuf_.resize(got);
+                rpos_ = 0;
+            }
+            const size_t k = std::min(n, rbuf_.size() - rpos_);
+            memcpy(dst, rbuf_.data() + rpos_, k);
+            rpos_ += k;
+            dst   += k;
+            n     -= k;
+        }
+        return true;
+    }
+
+    socket_t             fd_;
+    std::mutex           send_mtx_;
+    std::vector<uint8_t> rbuf_;
+    size_t               rpos_ = 0;
+};
+
+class draft_listener
+{
+  public:
+    ~draft_listener()
+    {
+        if (draft_channel::valid(fd_))
+        {
+            draft_channel::close_socket(fd_);
+        }
+    }
+
+    bool listen(const std::string & host, int32_t port)
+    {
+        if (!draft_channel::init_sockets())
+        {
+            return false;
+        }
+        addrinfo hints = {};
+        hints.ai_family   = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags    = AI_PASSIVE;
+        addrinfo * res = nullptr;
+        if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res) != 0)
+        {
+            return false;
+        }
+        for (addrinfo * ai = res; ai != nullptr; ai = ai->ai_next)
+        {
+            fd_ = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (!draft_channel::valid(fd_))
+            {
+                continue;
+            }
+            int one = 1;
+            setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char *>(&one), sizeof(one));
+            if (bind(fd_, ai->ai_addr, ai->ai_addrlen) == 0 && ::listen(fd_, 4) == 0)
+            {
+                break;
+            }
+            draft_channel::close_socket(fd_);
+            fd_ = invalid();
+        }
+        freeaddrinfo(res);
+        return draft_channel::valid(fd_);
+    }
+
+    // blocks until a peer connects
+    std::unique_ptr<draft_channel> accept()
+    {
+        const draft_channel::socket_t fd = ::accept(fd_, nullptr, nullptr);
+        if (!draft_channel::valid(fd))
+        {
+            return nullptr;
+        }
+        return std::unique_ptr<draft_channel>(new draft_channel(fd));
+    }
+
+    // unblocks a pending accept()
+    void close()
+    {
+        if (draft_channel::valid(fd_))
+        {
+#ifdef _WIN32
+            shutdown(fd_, SD_BOTH);
+#else
+            shutdown(fd_, SHUT_RDWR);
+#endif
+        }
+    }
+
+  private:
+    static draft_channel::socket_t invalid()
+    {
+#ifdef _WIN32
+        return INVALID_SOCKET;
+#else
+        return -1;
+#endif
+    }
+
+    draft_channel::socket_t fd_ = invalid();
+};
+
+}
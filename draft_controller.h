@@ -0,0 +1,199 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <json.hpp>
+
+namespace llama_duo
+{
+
+// Picks the draft length for every speculation round.
+//
+// The main model reports each verification as (drafts offered, drafts
+// accepted); accepted drafts are always a prefix of the offered ones. Over a
+// moving window of such reports we estimate s_i, the probability that draft
+// i is accepted given that all drafts before it were. Estimates are smoothed
+// towards s_{i-1}, so positions we never tried look like the last one we did
+// and get explored when acceptance is high.
+// The expected accepted prefix for length k is sum_{i<k} prod_{j<=i} s_j.
+// Drafting k tokens costs k * r target steps, where r is the measured
+// draft/target step time ratio, so we pick
+//
+//     k* = argmax_k (1 + E[accepted | k]) / (1 + k * r)
+//
+// within [n_min, n_max]. With n_min == n_max the controller is a no-op
+// and only collects stats.
+//
+// Called from both threads, so everything is under a mutex; calls happen
+// once per round and per verification, not per token.
+class draft_controller
+{
+  public:
+    draft_controller(size_t n_min, size_t n_max, size_t window)
+        : n_min_(std::max<size_t>(1, n_min))
+        , n_max_(std::max(n_max, std::max<size_t>(1, n_min)))
+        , window_(std::max<size_t>(1, window))
+        , n_next_(n_max_)
+    {
+    }
+
+    // draft length for the next round
+    size_t next_length()
+    {
+        std::lock_guard<std::mutex> _lock(mtx_);
+        n_rounds_++;
+        n_drafted_len_ += n_next_;
+        n_len_min_      = std::min(n_len_min_, n_next_);
+        n_len_max_      = std::max(n_len_max_, n_next_);
+        return n_next_;
+    }
+
+    // current length without counting it as a round
+    size_t current_length() const
+    {
+        std::lock_guard<std::mutex> _lock(mtx_);
+        return n_next_;
+    }
+
+    // drafter stopped a round early because the draft was not confident
+    void report_early_stop()
+    {
+        std::lock_guard<std::mutex> _lock(mtx_);
+        n_early_stops_++;
+    }
+
+    // time the drafter spent per draft token
+    void report_draft_time(int64_t dur_us, size_t n_tokens)
+    {
+        if (n_tokens == 0)
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> _lock(mtx_);
+        draft_us_ = ema(draft_us_, 1.0 * dur_us / n_tokens);
+    }
+
+    // time of one target verification decode
+    void report_target_time(int64_t dur_us)
+    {
+        std::lock_guard<std::mutex> _lock(mtx_);
+        target_us_ = ema(target_us_, 1.0 * dur_us);
+    }
+
+    // verification result from the main model
+    void report_verification(size_t n_offered, size_t n_accepted)
+    {
+        if (n_offered == 0)
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> _lock(mtx_);
+        history_.push_back({ n_offered, std::min(n_accepted, n_offered) });
+        if (history_.size() > window_)
+        {
+            history_.pop_front();
+        }
+        if (n_min_ < n_max_)
+        {
+            n_next_ = pick();
+        }
+    }
+
+    // short summary of what the controller did, for the final stats line
+    std::string summary() const
+    {
+        std::lock_guard<std::mutex> _lock(mtx_);
+        std::ostringstream oss;
+        oss << "draft_len: " << (n_rounds_ > 0 ? 1.0 * n_drafted_len_ / n_rounds_ : 0.0)
+            << " [" << (n_rounds_ > 0 ? n_len_min_ : 0) << ".." << n_len_max_ << "]"
+            << " early_stops: " << n_early_stops_ << "/" << n_rounds_;
+        return oss.str();
+    }
+
+    // the same, for --stats-json
+    nlohmann::json to_json() const
+    {
+        std::lock_guard<std::mutex> _lock(mtx_);
+        return {
+            { "avg",         n_rounds_ > 0 ? 1.0 * n_drafted_len_ / n_rounds_ : 0.0 },
+            { "min",         n_rounds_ > 0 ? n_len_min_ : 0 },
+            { "max",         n_len_max_ },
+            { "rounds",      n_rounds_ },
+            { "early_stops", n_early_stops_ }
+        };
+    }
+
+  private:
+    struct report
+    {
+        size_t n_offered;
+        size_t n_accepted;
+    };
+
+    static double ema(double prev, double value)
+    {
+        return prev <= 0.0 ? value : 0.9 * prev + 0.1 * value;
+    }
+
+    size_t pick() const
+    {
+        // base[i]: reports where draft i was offered and all before it accepted
+        // hits[i]: reports where draft i was accepted as well
+        std::vector<size_t> base(n_max_, 0), hits(n_max_, 0);
+        for (const auto & r : history_)
+        {
+            for (size_t i = 0; i < std::min(r.n_offered, n_max_) && i <= r.n_accepted; i++)
+            {
+                base[i]++;
+                hits[i] += i < r.n_accepted;
+            }
+        }
+
+        const double r = (draft_us_ > 0.0 && target_us_ > 0.0) ? draft_us_ / target_us_ : 0.1;
+
+        size_t best_k    = n_min_;
+        double best_rate = 0.0;
+        double survival  = 1.0;
+        double expected  = 0.0;
+        double s_prev    = 0.5;
+        for (size_t k = 1; k <= n_max_; k++)
+        {
+            const double s_k = (hits[k - 1] + 2.0 * s_prev) / (base[k - 1] + 2.0);
+            s_prev    = s_k;
+            survival *= s_k;
+            expected += survival;
+            const double rate = (1.0 + expected) / (1.0 + k * r);
+            if (k >= n_min_ && rate > best_rate)
+            {
+                best_rate = rate;
+                best_k    = k;
+            }
+        }
+        return best_k;
+    }
+
+    const size_t       n_min_;
+    const size_t       n_max_;
+    const size_t       window_;
+    size_t             n_next_;
+    std::deque<report> history_;
+    double             draft_us_  = 0.0;
+    double             target_us_ = 0.0;
+
+    size_t             n_rounds_      = 0;
+    size_t             n_drafted_len_ = 0;
+    size_t             n_len_min_     = SIZE_MAX;
+    size_t             n_len_max_     = 0;
+    size_t             n_early_stops_ = 0;
+
+    mutable std::mutex mtx_;
+};
+
+}
@@ -0,0 +1,488 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <llama.h>
+
+#include "draft_channel.h"
+#include "prefix_crc.h"
+#include "token_log.h"
+
+namespace llama_duo
+{
+
+// Remote drafters feeding one main model, any number of them at a time.
+//
+// Every drafter has a lane: a token_log with the verified prefix and that
+// drafter's drafts after it, a reader thread appending the drafts it sends
+// and a writer thread sending it the lane's verdicts. The main model
+// commits each verdict to every lane; right before it verifies, select()
+// compares each lane's drafts with the tokens it has just produced, which
+// gives the per-drafter acceptance, and copies the tail of the most
+// promising lane into the main candidate. A lane scores the drafts that
+// agree with the main model plus the drafts after them it is expected to
+// get accepted at its acceptance rate, so drafters that are behind or often
+// wrong get fewer verifications.
+//
+// Drafters join by being dialed (addresses are redialed every second while
+// they are not connected) or by dialing in (--draft-listen), and may leave
+// at any time. Lanes and their flags are guarded by the main model's mutex,
+// drafts wake it up through its condition variable.
+class draft_ensemble
+{
+  public:
+    // says hello on a new connection, false if the drafter does not fit
+    using handshake_fn = std::function<bool(draft_channel &, const std::string &)>;
+
+    draft_ensemble(std::mutex & mtx, std::condition_variable & cv, const token_log & log, bool with_dists, handshake_fn handshake)
+        : mtx_(mtx)
+        , cv_(cv)
+        , log_(log)
+        , with_dists_(with_dists)
+        , handshake_(handshake)
+    {
+    }
+
+    ~draft_ensemble()
+    {
+        stop();
+    }
+
+    draft_ensemble(const draft_ensemble &) = delete;
+    draft_ensemble & operator=(const draft_ensemble &) = delete;
+
+    // dials 'addresses' once before returning, then keeps redialing the ones
+    // which are not connected and accepts drafters on host:listen_port
+    bool start(const std::vector<std::string> & addresses, const std::string & host, int32_t listen_port)
+    {
+        addresses_ = addresses;
+        for (const std::string & address : addresses_)
+        {
+            dial(address, true);
+        }
+        if (listen_port > 0)
+        {
+            if (!listener_.listen(host, listen_port))
+            {
+                fprintf(stderr, "could not listen for drafters on %s:%d\n", host.c_str(), listen_port);
+                return false;
+            }
+            fprintf(stderr, "drafters can join on %s:%d\n", host.c_str(), listen_port);
+            acceptor_ = std::thread([this]() { accept_loop(); });
+        }
+        manager_ = std::thread([this]() { manage(); });
+        return true;
+    }
+
+    // disconnects everyone, after the main model is done
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> _lock(mtx_);
+            if (stopping_)
+            {
+                return;
+            }
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        listener_.close();
+        if (acceptor_.joinable())
+        {
+            acceptor_.join();
+        }
+        if (manager_.joinable())
+        {
+            manager_.join();
+        }
+        std::vector<std::shared_ptr<lane>> lanes;
+        {
+            std::lock_guard<std::mutex> _lock(mtx_);
+            lanes.swap(lanes_);
+        }
+        for (auto & l : lanes)
+        {
+            retire(l);
+        }
+    }
+
+    // caller holds the mutex: some lane has drafts up to n_wanted, or
+    // nothing more is coming from any of them
+    bool ready(size_t n_wanted) const
+    {
+        bool idle = true;
+        for (const auto & l : lanes_)
+        {
+            if (l->log.size() >= n_wanted)
+            {
+                return true;
+            }
+            idle = idle && l->idle;
+        }
+        return idle;
+    }
+
+    // main model, before reading drafts from 'log': the main model produced
+    // 'produced' at 'pos' and will verify up to n_verify drafts after them.
+    // Scores the lanes, replaces the drafts in 'log' with the best lane's.
+    void select(token_log & log, size_t pos, const std::vector<llama_token> & produced, size_t n_verify)
+    {
+        std::lock_guard<std::mutex> _lock(mtx_);
+        lane * best = nullptr;
+        double best_score = 0.0;
+        for (auto & l : lanes_)
+        {
+            l->log.read(pos, tail_);
+            if (tail_.empty())
+            {
+                continue;
+            }
+            size_t n_agree = 0;
+            while (n_agree < tail_.size() && n_agree < produced.size() && tail_[n_agree] == produced[n_agree])
+            {
+                n_agree++;
+            }
+            // drafts are checked up to the first one the main model rejects
+            l->n_offered += std::min(n_agree + 1, std::min(tail_.size(), produced.size()));
+            l->n_agreed  += n_agree;
+
+            double score = n_agree;
+            if (n_agree == produced.size())
+            {
+                const double rate = l->acceptance();
+                double p = 1.0;
+                for (size_t i = n_agree; i < tail_.size() && i < n_agree + n_verify; i++)
+                {
+                    p     *= rate;
+                    score += p;
+                }
+            }
+            if (best == nullptr || score > best_score || (score == best_score && l->acceptance() > best->acceptance()))
+            {
+                best       = l.get();
+                best_score = score;
+            }
+        }
+        if (best == nullptr)
+        {
+            return;
+        }
+        best->n_selected++;
+        best->log.read(pos, tail_);
+        dists_.resize(with_dists_ ? tail_.size() : 0);
+        for (size_t i = 0; i < dists_.size(); i++)
+        {
+            dists_[i] = best->log.dist(pos + i);
+        }
+        log.replace(pos, tail_, dists_);
+    }
+
+    // main model: the verdict it just committed to its own log
+    void commit(size_t pos, const std::vector<llama_token> & tokens, size_t n_verified)
+    {
+        {
+            std::lock_guard<std::mutex> _lock(mtx_);
+            for (auto & l : lanes_)
+            {
+                l->log.commit(pos, tokens, n_verified);
+                l->idle = l->gone;
+            }
+        }
+        cv_.notify_all();
+    }
+
+    // one line per drafter seen during the generation
+    void print_stats() const
+    {
+        std::lock_guard<std::mutex> _lock(mtx_);
+        for (const lane_stats & s : stats_)
+        {
+            fprintf(stderr, "drafter %s: drafted: %zu agreed: %zu acceptance: %.3f selected: %zu\n",
+                s.name.c_str(), s.n_offered, s.n_agreed, s.n_offered > 0 ? 1.0 * s.n_agreed / s.n_offered : 0.0, s.n_selected);
+        }
+    }
+
+  private:
+    struct lane_stats
+    {
+        std::string name;
+        size_t n_offered  = 0; // drafts compared with what the main model produced
+        size_t n_agreed   = 0;
+        size_t n_selected = 0; // verifications which used this lane's drafts
+    };
+
+    struct lane : lane_stats
+    {
+        lane(const std::string & name, size_t capacity, bool with_dists)
+            : log(capacity, with_dists)
+        {
+            this->name = name;
+        }
+
+        // smoothed, so a new drafter is neither trusted nor ignored
+        double acceptance() const
+        {
+            return (n_agreed + 1.0) / (n_offered + 2.0);
+        }
+
+        token_log log;
+        std::unique_ptr<draft_channel> ch;
+        bool idle = false; // stopped extending until the next verdict
+        bool gone = false; // disconnected
+        std::thread reader, writer;
+    };
+
+    void dial(const std::string & address, bool report)
+    {
+        std::unique_ptr<draft_channel> ch = draft_channel::connect(address);
+        if (!ch)
+        {
+            if (report)
+            {
+                fprintf(stderr, "could not connect to the drafter at %s, retrying in the background\n", address.c_str());
+            }
+            return;
+        }
+        add(std::move(ch), address);
+    }
+
+    void accept_loop()
+    {
+        size_t n_joined = 0;
+        while (true)
+        {
+            std::unique_ptr<draft_channel> ch = listener_.accept();
+            {
+                std::lock_guard<std::mutex> _lock(mtx_);
+                if (stopping_)
+                {
+                    return;
+                }
+            }
+            if (ch)
+            {
+                add(std::move(ch), "joined-" + std::to_string(++n_joined));
+            }
+        }
+    }
+
+    // Reaps lanes whose drafter has left as soon as they are gone and
+    // redials once a second. cv_ is woken on every verdict and every frame,
+    // so it waits for the next dial deadline, not just for a notification.
+    void manage()
+    {
+        using clock = std::chrono::steady_clock;
+        auto any_gone = [this]()
+        {
+            return std::any_of(lanes_.begin(), lanes_.end(), [](const std::shared_ptr<lane> & l) { return l->gone; });
+        };
+        clock::time_point next_dial = clock::now() + std::chrono::seconds(1);
+        std::unique_lock<std::mutex> lock(mtx_);
+        while (!stopping_)
+        {
+            cv_.wait_until(lock, next_dial, [&]() { return stopping_ || any_gone(); });
+            if (stopping_)
+            {
+                // stop() retires whatever is left
+                break;
+            }
+            const bool redial = clock::now() >= next_dial;
+            if (redial)
+            {
+                next_dial = clock::now() + std::chrono::seconds(1);
+            }
+            std::vector<std::shared_ptr<lane>> gone;
+            std::vector<std::string> missing = addresses_;
+            for (size_t i = 0; i < lanes_.size(); )
+            {
+                if (lanes_[i]->gone)
+                {
+                    gone.push_back(lanes_[i]);
+                    lanes_.erase(lanes_.begin() + i);
+                    continue;
+                }
+                missing.erase(std::remove(missing.begin(), missing.end(), lanes_[i]->name), missing.end());
+                i++;
+            }
+            lock.unlock();
+            for (auto & l : gone)
+            {
+                retire(l);
+            }
+            for (const std::string & address : missing)
+            {
+                if (redial && std::find_if(gone.begin(), gone.end(), [&](const std::shared_ptr<lane> & l) { return l->name == address; }) == gone.end())
+                {
+                    dial(address, false);
+                }
+            }
+            lock.lock();
+        }
+    }
+
+    void add(std::unique_ptr<draft_channel> ch, const std::string & name)
+    {
+        if (!handshake_(*ch, name))
+        {
+            return;
+        }
+        std::shared_ptr<lane> l = std::make_shared<lane>(name, log_.capacity(), with_dists_);
+        l->ch = std::move(ch);
+        {
+            std::lock_guard<std::mutex> _lock(mtx_);
+            if (stopping_)
+            {
+                return;
+            }
+            // verdicts committed from now on reach the lane through commit()
+            std::vector<llama_token> verified;
+            const token_log::view v = log_.read(0, verified);
+            verified.resize(v.n_verified);
+            l->log.commit(0, verified, verified.size());
+            l->reader = std::thread([this, l]() { read_drafts(*l); });
+            l->writer = std::thread([this, l]() { write_verdicts(*l); });
+            lanes_.push_back(l);
+        }
+        fprintf(stderr, "drafter %s joined\n", name.c_str());
+        cv_.notify_all();
+    }
+
+    // joins the lane's threads and keeps its numbers
+    void retire(const std::shared_ptr<lane> & l)
+    {
+        // the writer stops once the lane is gone or we are, and closes the
+        // connection, which ends the reader
+        l->writer.join();
+        l->reader.join();
+        std::lock_guard<std::mutex> _lock(mtx_);
+        stats_.push_back(*l);
+    }
+
+    void read_drafts(lane & l)
+    {
+        std::vector<uint8_t>     payload;
+        std::vector<llama_token> tokens;
+        std::vector<token_dist>  dists;
+        while (l.ch->recv(payload))
+        {
+            frame_reader r(payload);
+            if (r.type() == frame_type::drafts)
+            {
+                const uint64_t epoch = r.get_varint();
+                const uint64_t pos   = r.get_varint();
+                r.get_tokens(tokens);
+                dists.assign(r.get_varint() != 0 ? tokens.size() : 0, token_dist());
+                for (token_dist & d : dists)
+                {
+                    r.get_dist(d);
+                }
+                if (!r.ok())
+                {
+                    break;
+                }
+                size_t n_appended = 0;
+                while (n_appended < tokens.size()
+                    && l.log.append(epoch, pos + n_appended, tokens[n_appended], dists.empty() ? token_dist() : std::move(dists[n_appended])))
+                {
+                    n_appended++;
+                }
+                if (n_appended > 0)
+                {
+                    {
+                        std::lock_guard<std::mutex> _lock(mtx_);
+                    }
+                    cv_.notify_all();
+                }
+            }
+            else if (r.type() == frame_type::idle)
+            {
+                const uint64_t n_verified = r.get_varint();
+                if (!r.ok())
+                {
+                    break;
+                }
+                {
+                    // stale if we have verified more since, that verdict wakes the drafter up
+                    std::lock_guard<std::mutex> _lock(mtx_);
+                    l.idle = l.log.state().n_verified == n_verified;
+                }
+                cv_.notify_all();
+            }
+            else
+            {
+                break;
+            }
+        }
+        {
+            std::lock_guard<std::mutex> _lock(mtx_);
+            if (!stopping_)
+            {
+                fprintf(stderr, "drafter %s left\n", l.name.c_str());
+            }
+            l.gone = true;
+            l.idle = true;
+        }
+        cv_.notify_all();
+    }
+
+    // every verdict as soon as it is in the lane, only what was verified
+    // since the previous one
+    void write_verdicts(lane & l)
+    {
+        size_t n_sent = 0;
+        std::vector<llama_token> tokens;
+        prefix_crc verified;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                cv_.wait(lock, [&]() { return stopping_ || l.gone || l.log.state().n_verified != n_sent; });
+                if (stopping_ || l.gone)
+                {
+                    break;
+                }
+            }
+            const token_log::view v = l.log.read(n_sent, tokens);
+            frame_writer verdict(frame_type::verdict);
+            verdict.put_varint(v.epoch);
+            verdict.put_varint(n_sent);
+            verdict.put_tokens(tokens.data(), v.n_verified - n_sent);
+            verified.append(tokens.begin(), tokens.begin() + (v.n_verified - n_sent));
+            verdict.put_varint(verified.prefix(v.n_verified));
+            l.ch->send(verdict);
+            n_sent = v.n_verified;
+        }
+        l.ch->send(frame_writer(frame_type::stop));
+        l.ch->close();
+    }
+
+    std::mutex              & mtx_;
+    std::condition_variable & cv_;
+    const token_log         & log_;
+    const bool                with_dists_;
+    handshake_fn              handshake_;
+
+    std::vector<std::string> addresses_;
+    draft_listener           listener_;
+    std::thread              acceptor_, manager_;
+
+    // guarded by mtx_
+    std::vector<std::shared_ptr<lane>> lanes_;
+    std::vector<lane_stats>            stats_;
+    bool                               stopping_ = false;
+
+    // select() scratch, main model thread only
+    std::vector<llama_token> tail_;
+    std::vector<token_dist>  dists_;
+};
+
+}
@@ -0,0 +1,278 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+
+#include <json.hpp>
+#include <llama.h>
+
+namespace llama_duo
+{
+
+// Keeps the drafter out of the main model's way while the two share a
+// device: the same cores and memory bandwidth, or the same GPU. The main
+// model reports every decode; around each of its own decodes the drafter
+// asks how to go on, according to the policy:
+//
+//   off       drafts as it likes, only the stats are kept
+//   pause     does not start a decode while the main model is decoding
+//   throttle  after a decode that overlapped the main model's, rests so it
+//             only takes 'duty' of the time, less if the main model is done
+//             before that
+//   shrink    decodes with n_threads_low threads while the main model is
+//             decoding and with all of its own otherwise
+//
+// Whatever the policy, the drafter runs at full speed in the gaps between
+// the main model's decodes, which is when its drafts are needed most. Both
+// models' decode time is counted, with how much of it overlapped and how
+// long the drafter was held back.
+class draft_scheduler
+{
+  public:
+    enum policy_t
+    {
+        OFF,
+        PAUSE,
+        THROTTLE,
+        SHRINK
+    };
+
+    static bool parse_policy(const std::string & name, policy_t & policy)
+    {
+        static const char * names[] = { "off", "pause", "throttle", "shrink" };
+        for (int i = 0; i < 4; i++)
+        {
+            if (name == names[i])
+            {
+                policy = static_cast<policy_t>(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    draft_scheduler(policy_t policy, float duty, uint32_t n_threads_low)
+        : policy_(policy)
+        , duty_(std::min(1.0f, std::max(0.01f, duty)))
+        , n_threads_low_(std::max<uint32_t>(1, n_threads_low))
+        , last_us_(now_us())
+    {
+    }
+
+    policy_t policy() const
+    {
+        return policy_;
+    }
+
+    // main model, around every decode
+    void target_begin()
+    {
+        std::lock_guard<std::mutex> _lock(mtx_);
+        account();
+        target_busy_ = true;
+        n_target_decodes_++;
+    }
+
+    void target_end()
+    {
+        {
+            std::lock_guard<std::mutex> _lock(mtx_);
+            account();
+            target_busy_ = false;
+        }
+        cv_.notify_all();
+    }
+
+    // drafter, right before a decode on ctx
+    void draft_begin(llama_context * ctx)
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (policy_ == PAUSE && target_busy_)
+        {
+            const int64_t start_us = now_us();
+            cv_.wait(lock, [this]() { return !target_busy_; });
+            paused_us_ += now_us() - start_us;
+        }
+        if (policy_ == SHRINK)
+        {
+            if (n_threads_ == 0)
+            {
+                n_threads_       = llama_n_threads(ctx);
+                n_threads_batch_ = llama_n_threads_batch(ctx);
+            }
+            const bool low = target_busy_ && n_threads_low_ < n_threads_;
+            if (low != shrunk_)
+            {
+                llama_set_n_threads(ctx, low ? n_threads_low_ : n_threads_, low ? std::min(n_threads_low_, n_threads_batch_) : n_threads_batch_);
+                shrunk_ = low;
+            }
+        }
+        account();
+        draft_busy_      = true;
+        draft_start_us_  = now_us();
+        draft_overlaps_  = target_busy_;
+    }
+
+    // drafter, right after the decode
+    void draft_end()
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        account();
+        draft_busy_ = false;
+        const int64_t dur_us = now_us() - draft_start_us_;
+        n_draft_decodes_++;
+        if (shrunk_)
+        {
+            shrunk_us_ += dur_us;
+        }
+        if (policy_ == THROTTLE && (draft_overlaps_ || target_busy_) && duty_ < 1.0f)
+        {
+            const int64_t start_us = now_us();
+            const auto rest = std::chrono::microseconds(static_cast<int64_t>(dur_us * (1.0f - duty_) / duty_));
+            cv_.wait_for(lock, rest, [this]() { return !target_busy_; });
+            slept_us_ += now_us() - start_us;
+        }
+    }
+
+    void print_stats() const
+    {
+        std::lock_guard<std::mutex> _lock(mtx_);
+        fprintf(stderr, "scheduler: main: %.1f ms in %zu decodes, %.1f ms alongside drafting; draft: %.1f ms in %zu decodes, held back %.1f ms (paused %.1f, rested %.1f, shrunk %.1f)\n",
+            1e-3 * target_us_, n_target_decodes_, 1e-3 * overlap_us_, 1e-3 * draft_us_, n_draft_decodes_,
+            1e-3 * (paused_us_ + slept_us_ + shrunk_us_), 1e-3 * paused_us_, 1e-3 * slept_us_, 1e-3 * shrunk_us_);
+    }
+
+    nlohmann::json to_json() const
+    {
+        static const char * names[] = { "off", "pause", "throttle", "shrink" };
+        std::lock_guard<std::mutex> _lock(mtx_);
+        return {
+            { "policy",            names[policy_] },
+            { "target_decode_ms",  1e-3 * target_us_ },
+            { "target_decodes",    n_target_decodes_ },
+            { "overlap_ms",        1e-3 * overlap_us_ },
+            { "draft_decode_ms",   1e-3 * draft_us_ },
+            { "draft_decodes",     n_draft_decodes_ },
+            { "draft_paused_ms",   1e-3 * paused_us_ },
+            { "draft_rested_ms",   1e-3 * slept_us_ },
+            { "draft_shrunk_ms",   1e-3 * shrunk_us_ }
+        };
+    }
+
+  private:
+    static int64_t now_us()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // busy time since the last state change, under mtx_
+    void account()
+    {
+        const int64_t now = now_us();
+        const int64_t dt  = now - last_us_;
+        target_us_  += target_busy_ ? dt : 0;
+        draft_us_   += draft_busy_ ? dt : 0;
+        overlap_us_ += target_busy_ && draft_busy_ ? dt : 0;
+        last_us_ = now;
+    }
+
+    const policy_t policy_;
+    const float    duty_;
+    const uint32_t n_threads_low_;
+
+    mutable std::mutex      mtx_;
+    std::condition_variable cv_;
+    bool     target_busy_     = false;
+    bool     draft_busy_      = false;
+    bool     draft_overlaps_  = false;
+    bool     shrunk_          = false;
+    uint32_t n_threads_       = 0; // the drafter's own, as it was created
+    uint32_t n_threads_batch_ = 0;
+    int64_t  last_us_;
+    int64_t  draft_start_us_  = 0;
+
+    size_t  n_target_decodes_ = 0;
+    size_t  n_draft_decodes_  = 0;
+    int64_t target_us_        = 0;
+    int64_t draft_us_         = 0;
+    int64_t overlap_us_       = 0;
+    int64_t paused_us_        = 0;
+    int64_t slept_us_         = 0;
+    int64_t shrunk_us_        = 0;
+};
+
+// one decode of the main model; a null scheduler is fine
+class target_decode_scope
+{
+  public:
+    explicit target_decode_scope(draft_scheduler * sched)
+        : sched_(sched)
+    {
+        if (sched_ != nullptr)
+        {
+            sched_->target_begin();
+        }
+    }
+
+    target_decode_scope(const target_decode_scope &) = delete;
+    target_decode_scope & operator=(const target_decode_scope &) = delete;
+
+    ~target_decode_scope()
+    {
+        end();
+    }
+
+    // the decode is over before the end of the scope
+    void end()
+    {
+        if (sched_ != nullptr)
+        {
+            sched_->target_end();
+            sched_ = nullptr;
+        }
+    }
+
+  private:
+    draft_scheduler * sched_;
+};
+
+// one decode of the drafter
+class draft_decode_scope
+{
+  public:
+    draft_decode_scope(draft_scheduler * sched, llama_context * ctx)
+        : sched_(sched)
+    {
+        if (sched_ != nullptr)
+        {
+            sched_->draft_begin(ctx);
+        }
+    }
+
+    draft_decode_scope(const draft_decode_scope &) = delete;
+    draft_decode_scope & operator=(const draft_decode_scope &) = delete;
+
+    ~draft_decode_scope()
+    {
+        end();
+    }
+
+    void end()
+    {
+        if (sched_ != nullptr)
+        {
+            sched_->draft_end();
+            sched_ = nullptr;
+        }
+    }
+
+  private:
+    draft_scheduler * sched_;
+};
+
+}
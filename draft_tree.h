@@ -0,0 +1,115 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <llama.h>
+
+#include "argmax.h"
+
+namespace llama_duo
+{
+
+// Token tree produced by the drafter. Node i holds tokens[i]; parent[i] is
+// the index of its parent or -1 if it directly continues the candidate.
+// Parents are always added before their children.
+struct draft_tree
+{
+    std::vector<llama_token> tokens;
+    std::vector<int32_t>     parent;
+    std::vector<int32_t>     depth;  // 0 for children of the root
+
+    size_t size() const
+    {
+        return tokens.size();
+    }
+
+    bool empty() const
+    {
+        return tokens.empty();
+    }
+
+    void clear()
+    {
+        tokens.clear();
+        parent.clear();
+        depth.clear();
+    }
+
+    int32_t add(llama_token token, int32_t parent_idx)
+    {
+        tokens.push_back(token);
+        parent.push_back(parent_idx);
+        depth.push_back(parent_idx < 0 ? 0 : depth[parent_idx] + 1);
+        return static_cast<int32_t>(tokens.size()) - 1;
+    }
+
+    // child of 'node' (-1 is the root) holding 'token', -1 if there is none
+    int32_t find_child(int32_t node, llama_token token) const
+    {
+        for (size_t i = std::max<int32_t>(node + 1, 0); i < tokens.size(); i++)
+        {
+            if (parent[i] == node && tokens[i] == token)
+            {
+                return static_cast<int32_t>(i);
+            }
+        }
+        return -1;
+    }
+
+    bool has_children(int32_t node) const
+    {
+        return std::find(parent.begin() + std::max<int32_t>(node + 1, 0), parent.end(), node) != parent.end();
+    }
+};
+
+struct token_prob
+{
+    llama_token token;
+    float       p;
+};
+
+// k most likely tokens with their softmax probabilities, best first
+inline std::vector<token_prob> top_tokens(const float * logits, int32_t n_vocab, int32_t k)
+{
+    const argmax_result best = argmax(logits, n_vocab);
+    float sum = 0.0f;
+    for (int32_t i = 0; i < n_vocab; i++)
+    {
+        sum += std::exp(logits[i] - best.value);
+    }
+
+    std::vector<token_prob> res = { { best.index, 1.0f / sum } };
+    if (k <= 1)
+    {
+        return res;
+    }
+
+    // k is tiny, keep a sorted list of the best logits
+    std::vector<std::pair<float, llama_token>> top;
+    for (int32_t i = 0; i < n_vocab; i++)
+    {
+        if (i == best.index || (top.size() == static_cast<size_t>(k - 1) && logits[i] <= top.back().first))
+        {
+            continue;
+        }
+        auto it = std::upper_bound(top.begin(), top.end(), logits[i], [](float v, const std::pair<float, llama_token> & e)
+        {
+            return v > e.first;
+        });
+        top.insert(it, { logits[i], i });
+        if (top.size() > static_cast<size_t>(k - 1))
+        {
+            top.pop_back();
+        }
+    }
+    for (const auto & t : top)
+    {
+        res.push_back({ t.second, std::exp(t.first - best.value) / sum });
+    }
+    return res;
+}
+
+}
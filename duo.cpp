@@ -1,17 +1,38 @@
+#include <algorithm>
 #include <chrono>
 #include <cmath>
 #include <condition_variable>
 #include <cstdio>
+#include <fstream>
 #include <functional>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <common.h>
+#include <json.hpp>
 #include <llama.h>
 
-//#include "utils.h"
+#include "argmax.h"
+#include "cpu_topology.h"
+#include "draft_channel.h"
+#include "draft_controller.h"
+#include "draft_ensemble.h"
+#include "draft_scheduler.h"
+#include "draft_tree.h"
+#include "model_loader.h"
+#include "ngram_index.h"
+#include "options.h"
+#include "prefix_crc.h"
+#include "server.h"
+#include "spec_sampling.h"
+#include "state_cache.h"
+#include "suffix_index.h"
+#include "token_log.h"
+#include "trace.h"
+#include "vocab_subset.h"
 
 namespace llama_duo
 {
@@ -57,291 +78,1894 @@ std::vector<llama_token> greedy_tokens(
         llama_model * model,
         llama_context * ctx,
         int32_t from_idx,
-        int32_t to_idx)
+        int32_t to_idx,
+        argmax_pool & pool)
 {
     auto n_vocab = llama_n_vocab(model);
     std::vector<llama_token> res;
-    if (n_vocab <= 0)
+    if (n_vocab <= 0 || to_idx <= from_idx)
     {
         return res;
     }
 
+    trace_span span("argmax", "rows", to_idx - from_idx);
+    std::vector<const float *> rows;
     for (int idx = from_idx; idx < to_idx; idx++)
     {
-        auto * logits  = llama_get_logits_ith(ctx, idx);
-        llama_token new_token_id = 0;
-        for (llama_token token_id = 1; token_id < n_vocab; token_id++)
-        {
-            if (logits[token_id] > logits[new_token_id])
-            {
-                new_token_id = token_id;
-            }
-        }
-
-        res.push_back(new_token_id);
+        rows.push_back(llama_get_logits_ith(ctx, idx));
     }
+    res.resize(rows.size());
+    pool.run(rows, n_vocab, res.data());
     return res;
 }
 
 using llama_tokens = std::vector<llama_token>;
 
-enum Turn
+// the main model's picks for rows [from_idx, to_idx), which come after
+// input_seq's tokens, up to the first one that rejects a draft
+llama_tokens greedy_verified_tokens(
+        llama_model * model,
+        llama_context * ctx,
+        int32_t from_idx,
+        int32_t to_idx,
+        const llama_tokens & input_seq,
+        argmax_pool & pool)
 {
-    NONE = 0,
-    SPEC = 1,
-    MAIN = 2
-};
+    std::vector<greedy_candidate<llama_token>> cands(1);
+    for (int idx = from_idx; idx < to_idx; idx++)
+    {
+        cands[0].rows.push_back(llama_get_logits_ith(ctx, idx));
+    }
+    cands[0].drafts.assign(input_seq.begin() + 1, input_seq.end());
+    trace_span span("argmax", "rows", to_idx - from_idx);
+    greedy_verify(pool, llama_n_vocab(model), cands);
+    span.set(1, "reduced", cands[0].preds.size());
+    return cands[0].preds;
+}
 
 struct shared_context
 {
-    llama_tokens candidate;
+    shared_context(size_t capacity, bool with_dists)
+        : log(capacity, with_dists)
+    {
+    }
+
+    // candidate sequence; when sampling, drafted tokens carry the draft
+    // distribution they were sampled from.
+    token_log    log;
+    // tree mode: drafts hanging off the last token of the log, when the
+    // log had tree_base tokens
+    draft_tree   tree;
+    size_t       tree_base  = 0;
+    // chain mode: drafter stopped extending until the next verdict
+    bool         draft_idle = false;
+    // remote drafters, which draft into lanes of their own instead of log
+    draft_ensemble * ensemble = nullptr;
+    // local drafter: when it may decode alongside the main model
+    draft_scheduler * sched   = nullptr;
     std::mutex   mtx;
     bool         done = false;
-    Turn         turn = NONE;
+    // interactive mode: the reply is over, the drafter waits for the next
+    // message instead of exiting
+    bool         multi_turn    = false;
+    bool         between_turns = false;
     std::condition_variable cv;
+
+    // main model: no more tokens, for good or until the next message
+    void end_turn()
+    {
+        {
+            std::lock_guard<std::mutex> _lock(mtx);
+            (multi_turn ? between_turns : done) = true;
+        }
+        cv.notify_all();
+    }
+
+    // interactive mode: the next message follows the verified tokens. The
+    // drafter keeps its thread and KV cache and resyncs on it like on any
+    // verdict. False if it does not fit.
+    bool begin_turn(const llama_tokens & message)
+    {
+        bool ok = false;
+        {
+            std::lock_guard<std::mutex> _lock(mtx);
+            const size_t n_verified = log.state().n_verified;
+            ok = log.commit(n_verified, message, n_verified + message.size());
+            between_turns = false;
+            draft_idle    = false;
+        }
+        cv.notify_all();
+        return ok;
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> _lock(mtx);
+            done = true;
+        }
+        cv.notify_all();
+    }
+
+    // the log is lock-free; waiters still sleep on cv, so touch the
+    // mutex before waking them up to not lose the notification
+    void notify()
+    {
+        {
+            std::lock_guard<std::mutex> _lock(mtx);
+        }
+        cv.notify_all();
+    }
 };
 
-template<typename iter_t>
-static int decode(llama_context * ctx, iter_t from, iter_t to, int offset, bool all_logits, llama_batch & batch)
+// how many drafts the main model had when it was ready to verify
+struct draft_fill_stats
 {
-    llama_batch_clear(batch);
-    size_t i = offset;
-    for (auto it = from; it != to; ++it)
+    size_t n_zero    = 0;
+    size_t n_partial = 0;
+    size_t n_full    = 0;
+
+    void add(size_t n_drafts, size_t n_wanted)
+    {
+        if (n_drafts == 0)
+        {
+            n_zero++;
+        }
+        else if (n_drafts < n_wanted)
+        {
+            n_partial++;
+        }
+        else
+        {
+            n_full++;
+        }
+    }
+
+    std::string summary() const
+    {
+        return "drafts zero/partial/full: " + std::to_string(n_zero) + "/" + std::to_string(n_partial) + "/" + std::to_string(n_full);
+    }
+};
+
+// one-shot chain run as --stats-json reports it. Acceptance is per draft
+// position, given that every draft before it was accepted. Latency between
+// tokens spreads the time of each verification evenly over the tokens it
+// accepted.
+struct generation_stats
+{
+    size_t  n_prefill  = 0;
+    int64_t prefill_us = 0;
+    size_t  n_tokens   = 0;
+    int64_t decode_us  = 0;
+    size_t  n_drafted  = 0;
+    size_t  n_accepted = 0;
+    std::vector<size_t> n_offered_at, n_taken_at;
+    std::vector<double> token_ms;
+
+    void add_verification(size_t n_offered, size_t n_taken)
+    {
+        n_drafted  += n_offered;
+        n_accepted += n_taken;
+        const size_t n_reached = std::min(n_offered, n_taken + 1);
+        if (n_offered_at.size() < n_reached)
+        {
+            n_offered_at.resize(n_reached);
+            n_taken_at.resize(n_reached);
+        }
+        for (size_t i = 0; i < n_reached; i++)
+        {
+            n_offered_at[i]++;
+            n_taken_at[i] += i < n_taken;
+        }
+    }
+
+    void add_tokens(size_t n, int64_t dur_us)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            token_ms.push_back(1.0e-3 * dur_us / n);
+        }
+    }
+
+    double percentile_ms(double p) const
+    {
+        if (token_ms.empty())
+        {
+            return 0.0;
+        }
+        std::vector<double> sorted = token_ms;
+        std::sort(sorted.begin(), sorted.end());
+        return sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))];
+    }
+
+    nlohmann::json to_json() const
     {
-        llama_batch_add(batch, *it, i++, { 0 }, all_logits);
+        std::vector<double> acceptance;
+        for (size_t i = 0; i < n_offered_at.size(); i++)
+        {
+            acceptance.push_back(1.0 * n_taken_at[i] / n_offered_at[i]);
+        }
+        return {
+            { "prefill_tokens", n_prefill },
+            { "prefill_tps",    prefill_us > 0 ? 1.0e6 * n_prefill / prefill_us : 0.0 },
+            { "tokens",         n_tokens },
+            { "decode_tps",     decode_us > 0 ? 1.0e6 * n_tokens / decode_us : 0.0 },
+            { "drafted",        n_drafted },
+            { "accepted",       n_accepted },
+            { "acceptance",     n_drafted > 0 ? 1.0 * n_accepted / n_drafted : 0.0 },
+            { "acceptance_by_position", acceptance },
+            { "itl_p50_ms",     percentile_ms(0.50) },
+            { "itl_p99_ms",     percentile_ms(0.99) }
+        };
     }
-    batch.logits[batch.n_tokens - 1] = true;
+};
+
+// tokens per decode for a --prefill-chunk of n_chunk, never more than the batch
+static size_t chunk_size(llama_context * ctx, size_t n_chunk)
+{
+    const size_t n_batch = llama_n_batch(ctx);
+    return n_chunk > 0 ? std::min(n_chunk, n_batch) : n_batch;
+}
+
+// Decodes [from, to) into seq 0 from position offset on, at most n_chunk
+// tokens per llama_decode. Only the last chunk has logits: all its tokens
+// with all_logits, else just the last one. batch holds llama_n_batch tokens.
+template<typename iter_t>
+static int decode(llama_context * ctx, iter_t from, iter_t to, int offset, bool all_logits, llama_batch & batch, size_t n_chunk = 0)
+{
+    n_chunk = chunk_size(ctx, n_chunk);
     int res = 0;
-    if (llama_decode(ctx, batch) != 0)
+    for (auto it = from; it != to && res == 0; )
     {
-        fprintf(stderr, "llama_decode() failed: n_tokens=%d\n", batch.n_tokens - 1);
-        res = 1;
+        const size_t n_left = std::distance(it, to);
+        const size_t n      = std::min(n_chunk, n_left);
+        trace_span span("decode", "tokens", n, "pos", offset);
+        llama_batch_clear(batch);
+        for (size_t i = 0; i < n; i++, ++it)
+        {
+            llama_batch_add(batch, *it, offset++, { 0 }, all_logits && n == n_left);
+        }
+        batch.logits[batch.n_tokens - 1] = true;
+        if (llama_decode(ctx, batch) != 0)
+        {
+            fprintf(stderr, "llama_decode() failed: n_tokens=%d\n", batch.n_tokens);
+            res = 1;
+        }
     }
     return res;
 }
 
+// Run-ahead drafting. The drafter never waits for its turn: it keeps
+// extending the candidate while the main model verifies, assuming everything
+// pending will be accepted, and appends each new token to the log right
+// away. It resyncs only when the log no longer ends with what it drafted,
+// and pauses when it is two draft lengths past the last verified token or
+// when the draft is no longer confident.
+//
+// With --lookup, continuations copied from earlier in the prompt and output
+// are drafted first, without a decode, then with --corpus the most frequent
+// continuation in earlier generations; the draft model decodes them along
+// with its own next token once neither finds anything. model can be null
+// then, the drafter waits for the next verdict instead. Verified output goes
+// into the corpus as it comes.
 static void speculation(
     llama_model    * model,
     llama_context  * ctx,
     shared_context * sctx,
     const llama_tokens & input,
-    size_t n_draft) 
+    size_t n_cached,
+    draft_controller & controller,
+    const duo_params & dparams,
+    argmax_pool & pool,
+    const sampling_params & sparams,
+    uint32_t seed,
+    suffix_index * corpus,
+    const vocab_subset & draft_vocab)
 {
-    llama_batch batch = llama_batch_init(512, 0, 1);
-    decode(ctx, input.begin(), input.end(), 0, false, batch);
+    trace_recorder::instance().name_thread("draft");
+    llama_batch batch = llama_batch_init(model != nullptr ? llama_n_batch(ctx) : 1, 0, 1);
+    draft_head head(draft_vocab, model != nullptr ? llama_n_vocab(model) : 0);
+
+    // tokens [0, n_past) of local are in the draft KV cache
+    llama_tokens local = input;
+    size_t n_past = n_cached;
+
+    // indexes the verified part of local, the corpus its output part
+    std::unique_ptr<ngram_index> lookup;
+    size_t n_corpus = input.size();
+    llama_tokens copied;
+    if (dparams.lookup > 0)
+    {
+        lookup.reset(new ngram_index(dparams.lookup_min, dparams.lookup));
+    }
+
+    std::mt19937 rng(seed);
+    dist_builder builder;
+    std::vector<token_dist> local_dists;
+    if (!sparams.greedy())
+    {
+        local_dists.resize(local.size());
+    }
+
+    // log state as of the last sync; local[0, seen.n_verified) is verified
+    token_log::view seen = sctx->log.state();
+    llama_tokens     delta;
+    bool             paused = false;
 
-    int logit_idx = input.size() - 1;
-    llama_tokens local = input, shared;
-    size_t match_len;
+    auto can_extend = [&](const token_log::view & v)
+    {
+        const size_t n_ahead = v.n_verified + 2 * controller.current_length();
+        return !paused && local.size() < std::min(n_ahead, sctx->log.capacity());
+    };
 
-    while (true) 
+    while (true)
     {
+        token_log::view cur;
+        bool between_turns = false;
         {
+            trace_span span("wait");
             std::unique_lock<std::mutex> lock(sctx->mtx);
-            sctx->cv.wait(lock, [&sctx] { return sctx->turn == Turn::SPEC || sctx->done; });
+            auto in_sync = [&]()
+            {
+                return cur.epoch == seen.epoch && cur.size == local.size();
+            };
+            auto ready = [&]()
+            {
+                cur = sctx->log.state();
+                return sctx->done || !in_sync() || (!sctx->between_turns && can_extend(cur)) || cur.n_verified != seen.n_verified;
+            };
+            if (!ready())
+            {
+                sctx->draft_idle = true;
+                sctx->cv.notify_all();
+                sctx->cv.wait(lock, ready);
+            }
             if (sctx->done)
             {
                 break;
             }
-            shared = sctx->candidate;
-            sctx->turn = Turn::NONE;
+            between_turns = sctx->between_turns;
         }
 
-        bool match = true;
-        match_len = local.size() - 1;
-        for (size_t i = 0; i < std::min(shared.size(), local.size()); i++)
+        if (cur.n_verified != seen.n_verified)
+        {
+            paused = false;
+        }
+        if (cur.epoch != seen.epoch || cur.size != local.size())
         {
-            if (shared[i] != local[i])
+            // only what is after the verified prefix can differ
+            cur = sctx->log.read(seen.n_verified, delta);
+            size_t n_common = seen.n_verified;
+            while (n_common < local.size() && n_common < cur.size && local[n_common] == delta[n_common - seen.n_verified])
             {
-                match = false;
-                match_len = i;
-                llama_kv_cache_seq_rm(ctx, 0, i, -1);
-                break;
+                n_common++;
+            }
+            local.resize(n_common);
+            local.insert(local.end(), delta.begin() + (n_common - seen.n_verified), delta.end());
+            if (!sparams.greedy())
+            {
+                // tokens we did not draft come from the main model
+                local_dists.resize(n_common);
+                local_dists.resize(local.size());
             }
+            if (n_past > n_common)
+            {
+                llama_kv_cache_seq_rm(ctx, 0, n_common, -1);
+                n_past = n_common;
+            }
+        }
+        seen = cur;
+        // a full disk leaves the corpus as it was
+        for (; corpus != nullptr && n_corpus < seen.n_verified; n_corpus++)
+        {
+            corpus->append(local[n_corpus]);
         }
-        if (!(match && shared.size() < local.size())) 
+        // nothing to draft until the next message is in
+        if (between_turns || !can_extend(seen))
         {
-            local = shared;
+            continue;
+        }
+
+        if (lookup || corpus != nullptr)
+        {
+            trace_span span("lookup");
+            const size_t n_room = std::min(seen.n_verified + 2 * controller.current_length(), sctx->log.capacity()) - local.size();
+            copied.clear();
+            if (lookup)
+            {
+                lookup->append(local.begin() + lookup->size(), local.begin() + seen.n_verified);
+                lookup->draft(local, n_room, copied);
+            }
+            if (copied.empty() && corpus != nullptr)
+            {
+                corpus->draft(local, dparams.corpus_min, n_room, copied);
+            }
+            span.set(0, "tokens", copied.size());
+            for (llama_token t : copied)
+            {
+                local.push_back(t);
+                if (!sparams.greedy())
+                {
+                    local_dists.push_back({ { t }, { 1.0f } });
+                }
+                // a verdict came in, we resync on the next iteration
+                if (!sctx->log.append(seen.epoch, local.size() - 1, t, sparams.greedy() ? token_dist() : local_dists.back()))
+                {
+                    break;
+                }
+                seen.size = local.size();
+            }
+            if (!copied.empty())
+            {
+                sctx->notify();
+                continue;
+            }
+            if (model == nullptr)
+            {
+                paused = true;
+                continue;
+            }
         }
 
-        for (size_t i = 0; i < n_draft; i++)
+        const int64_t start_us = ggml_time_us();
         {
-            decode(ctx, local.begin() + match_len, local.end(), match_len, false, batch);
-            logit_idx = local.size() - match_len - 1;
-            auto next_tokens = greedy_tokens(model, ctx, logit_idx, logit_idx + 1);
-            match_len = local.size();
-            local.push_back(next_tokens[0]);
+            // the prompt in chunks first, then mostly a single token
+            draft_decode_scope sched(sctx->sched, ctx);
+            decode(ctx, local.begin() + n_past, local.end(), n_past, false, batch, dparams.prefill_chunk);
         }
+        const float * row = head.row(llama_get_logits_ith(ctx, batch.n_tokens - 1));
+        n_past = local.size();
 
+        // draft's top token probability, only computed when we need it
+        float p_top = 1.0f;
+        if (sparams.greedy() && dparams.draft_p_min > 0.0f)
         {
-            std::unique_lock<std::mutex> lock(sctx->mtx);
-            sctx->candidate = local;
-            sctx->turn = Turn::MAIN;
-            sctx->cv.notify_one();
+            auto top = top_tokens(row, head.n_cols(), 1)[0];
+            local.push_back(head.token(top.token));
+            p_top = top.p;
+        }
+        else if (sparams.greedy())
+        {
+            trace_span span("argmax", "rows", 1);
+            llama_token col = 0;
+            pool.run({ row }, head.n_cols(), &col);
+            local.push_back(head.token(col));
+        }
+        else
+        {
+            local_dists.push_back(builder.build(row, head.n_cols(), sparams));
+            head.to_tokens(local_dists.back().ids);
+            local.push_back(sample(local_dists.back(), rng));
+            p_top = *std::max_element(local_dists.back().p.begin(), local_dists.back().p.end());
+        }
+        controller.report_draft_time(ggml_time_us() - start_us, 1);
+
+        // low confidence: the main model will likely reject anything after
+        // this token, wait for the verdict instead of drafting further
+        if (p_top < dparams.draft_p_min)
+        {
+            paused = true;
+            controller.report_early_stop();
+        }
+
+        // fails if a verdict came in meanwhile, we resync on the next iteration
+        if (sctx->log.append(seen.epoch, local.size() - 1, local.back(), sparams.greedy() ? token_dist() : local_dists.back()))
+        {
+            seen.size = local.size();
+            sctx->notify();
         }
     }
 
+    if (corpus != nullptr)
+    {
+        // the rest of the output, verified after our last sync
+        const token_log::view v = sctx->log.read(n_corpus, delta);
+        for (size_t i = n_corpus; i < v.n_verified; i++)
+        {
+            corpus->append(delta[i - n_corpus]);
+        }
+        corpus->append(suffix_index::kSeparator);
+    }
+
     llama_batch_free(batch);
 }
 
-static void target(
+// Tree drafting: follow the draft's top token and, where the draft is not
+// confident, also expand the next best alternatives. Every branch gets its
+// own seq_id in the draft KV cache, seq 0 holds the candidate.
+static void speculation_tree(
     llama_model    * model,
     llama_context  * ctx,
     shared_context * sctx,
     const llama_tokens & input,
-    size_t n_predict)
+    size_t n_cached,
+    size_t n_draft,
+    const duo_params & dparams,
+    const vocab_subset & draft_vocab)
 {
-    dbg_not_matched(to_string(ctx, input.begin(), input.end()));
-
-    llama_batch batch = llama_batch_init(512, 0, 1);
-    decode(ctx, input.begin(), input.end(), 0, false, batch);
-
-    size_t n_accepted = input.size();
-
-    int logits_from = input.size() - 1;
-    int logits_to   = input.size();
+    struct branch
+    {
+        llama_seq_id seq;
+        int32_t      node;       // last tree node on this branch
+        int32_t      logits_idx; // its logits row in the last batch
+    };
 
-    llama_tokens input_seq, next_tokens;
-    input_seq.push_back(input.back());
+    trace_recorder::instance().name_thread("draft");
+    llama_batch batch = llama_batch_init(llama_n_batch(ctx), 0, 1);
+    draft_head head(draft_vocab, llama_n_vocab(model));
 
-    auto start_us = ggml_time_us();
+    // the log holds accepted tokens only, so local never diverges from it
+    llama_tokens local(input.begin(), input.begin() + n_cached), delta;
 
-    while (n_accepted < n_predict + input.size())
+    while (true)
     {
-        next_tokens = greedy_tokens(model, ctx, logits_from, logits_to);
-
-        size_t next_tokens_pos = n_accepted;
-        // we always accept at least one new token
-        n_accepted += 1;
-        size_t n_match = 0;
-        while (n_match + 1 < input_seq.size() && next_tokens[n_match] == input_seq[n_match + 1])
-        {
-            n_match++;
-        }
-        n_accepted += n_match;
-        next_tokens.erase(next_tokens.begin() + n_match + 1, next_tokens.end());
-        llama_kv_cache_seq_rm(ctx, 0, n_accepted - 1, -1);
-
-        bool eog = false;
-        for (size_t i = 0; i < next_tokens.size(); i++)
         {
-            // TODO: what should we do here, is this correct
-            if (next_tokens[i] == llama_token_eos(model) || llama_token_is_eog(model, next_tokens[i]))
+            trace_span span("wait");
+            std::unique_lock<std::mutex> lock(sctx->mtx);
+            sctx->cv.wait(lock, [&]() { return sctx->done || sctx->log.size() != local.size(); });
+            if (sctx->done)
             {
-                eog = true;
-                next_tokens.erase(next_tokens.begin() + i, next_tokens.end());
                 break;
             }
         }
+        // all of local is in seq 0. The last token is always decoded again,
+        // we need its logits at the root of the tree.
+        sctx->log.read(local.size(), delta);
+        local.insert(local.end(), delta.begin(), delta.end());
+        const size_t n_common = std::min(local.size() - delta.size(), local.size() - 1);
+        llama_kv_cache_seq_rm(ctx, 0, n_common, -1);
+        {
+            draft_decode_scope sched(sctx->sched, ctx);
+            decode(ctx, local.begin() + n_common, local.end(), n_common, false, batch, dparams.prefill_chunk);
+        }
 
+        draft_tree tree;
+        std::vector<branch> branches = { { 1, -1, batch.n_tokens - 1 } };
+        llama_kv_cache_seq_cp(ctx, 0, 1, -1, -1);
+        llama_seq_id n_seq = 2;
+        const llama_pos root_pos = local.size();
+
+        while (tree.size() < n_draft)
         {
-            std::unique_lock<std::mutex> lock(sctx->mtx);
-            sctx->cv.wait(lock, [&sctx] { return sctx->turn == Turn::MAIN; });
-            auto & spec = sctx->candidate;
-            size_t n_match = 0;
-            while (n_match < next_tokens.size()
-                && n_match + next_tokens_pos < spec.size()
-                && next_tokens[n_match] == spec[n_match + next_tokens_pos])
+            std::vector<std::vector<token_prob>> cands;
+            for (const auto & b : branches)
             {
-                n_match++;
+                cands.push_back(top_tokens(head.row(llama_get_logits_ith(ctx, b.logits_idx)), head.n_cols(), dparams.tree_split_k));
+                for (auto & c : cands.back())
+                {
+                    c.token = head.token(c.token);
+                }
             }
 
-            dbg_accepted(to_string(ctx, spec.begin() + next_tokens_pos, spec.begin() + next_tokens_pos + n_match));
-            if (n_match != next_tokens.size())
+            llama_batch_clear(batch);
+            const size_t n_branches = branches.size();
+            for (size_t i = 0; i < n_branches && tree.size() < n_draft; i++)
             {
-                //dbg_rejected(to_string(ctx, spec.begin() + next_tokens_pos + n_match, spec.end()));
-                dbg_not_matched(to_string(ctx, next_tokens.begin() + n_match, next_tokens.end()));
-                spec.erase(spec.begin() + next_tokens_pos, spec.end());
-                for (const auto tok: next_tokens)
+                const auto &  c           = cands[i];
+                const int32_t parent_node = branches[i].node;
+                const bool    split       = c[0].p < dparams.tree_split_p;
+                for (size_t j = 0; j < c.size() && tree.size() < n_draft; j++)
                 {
-                    spec.push_back(tok);
+                    size_t bi = i;
+                    if (j > 0)
+                    {
+                        if (!split || branches.size() >= static_cast<size_t>(dparams.tree_branches))
+                        {
+                            break;
+                        }
+                        // new branch shares everything the current one has so far
+                        llama_kv_cache_seq_cp(ctx, branches[i].seq, n_seq, -1, -1);
+                        branches.push_back({ n_seq++, parent_node, 0 });
+                        bi = branches.size() - 1;
+                    }
+                    const int32_t node = tree.add(c[j].token, parent_node);
+                    branches[bi].node       = node;
+                    branches[bi].logits_idx = batch.n_tokens;
+                    llama_batch_add(batch, c[j].token, root_pos + tree.depth[node], { branches[bi].seq }, true);
                 }
             }
-            input_seq.assign(spec.begin() + n_accepted - 1, spec.end());
-            sctx->turn = Turn::SPEC;
-            sctx->cv.notify_one();
+
+            if (batch.n_tokens == 0)
+            {
+                break;
+            }
+            trace_span span("decode", "tokens", batch.n_tokens, "branches", branches.size());
+            draft_decode_scope sched(sctx->sched, ctx);
+            if (llama_decode(ctx, batch) != 0)
+            {
+                break;
+            }
         }
 
-        if (n_accepted >= n_predict + input.size() || eog)
+        for (llama_seq_id s = 1; s < n_seq; s++)
         {
-            break;
+            llama_kv_cache_seq_rm(ctx, s, -1, -1);
         }
 
-        decode(ctx, input_seq.begin(), input_seq.end(), n_accepted - 1, true, batch);
-
-        logits_from = 0;
-        logits_to   = input_seq.size();
-    }
-
-    double dur_s  = 1.0e-6 * (ggml_time_us() - start_us);
-    size_t tokens = n_accepted - input.size(); 
-    
-    dbg_not_matched("\n");
-    std::cerr << "tokens: " << tokens << " tps: " << tokens / dur_s << std::endl;
-    {
-        std::lock_guard<std::mutex> _lock(sctx->mtx);
-        sctx->done = true;
+        {
+            std::unique_lock<std::mutex> lock(sctx->mtx);
+            sctx->tree      = std::move(tree);
+            sctx->tree_base = local.size();
+            sctx->cv.notify_all();
+        }
     }
 
     llama_batch_free(batch);
 }
 
-} // llama_duo
+// The prompt is prefilled in chunks. The last chunk also carries whatever the
+// drafter has drafted after the prompt by then, so the first verification
+// comes with the prefill instead of after it.
+static void target(
+    llama_model    * model,
+    llama_context  * ctx,
+    shared_context * sctx,
+    const llama_tokens & input,
+    size_t n_cached,
+    size_t n_predict,
+    size_t prefill_chunk,
+    draft_controller & controller,
+    argmax_pool & pool,
+    const sampling_params & sparams,
+    uint32_t seed,
+    bool wait_for_drafts,
+    generation_stats & stats)
+{
+    trace_recorder::instance().name_thread("target");
 
-int main(int argc, char ** argv) {
-    gpt_params params;
+    const size_t n_batch = llama_n_batch(ctx);
+    llama_batch batch = llama_batch_init(n_batch, 0, 1);
+    const int64_t prefill_start_us = ggml_time_us();
 
-    if (gpt_params_parse(argc, argv, params) == false)
+    // the last chunk is whatever is left after the full ones, at least the last token
+    const size_t n_chunk = chunk_size(ctx, prefill_chunk);
+    const size_t n_last  = (input.size() - n_cached - 1) % n_chunk + 1;
     {
-        return 1;
+        target_decode_scope sched(sctx->sched);
+        decode(ctx, input.begin() + n_cached, input.end() - n_last, n_cached, false, batch, n_chunk);
     }
 
-    if (params.seed == LLAMA_DEFAULT_SEED)
-    {
-        params.seed = time(NULL);
-    }
-    
-    // TODO: hacky: we use rpc_servers for draft model only
-    std::string draft_rpc = params.rpc_servers;
-    params.rpc_servers = "";
+    llama_tokens input_seq, next_tokens, pending;
+    input_seq.push_back(input.back());
 
-    llama_backend_init();
-    llama_numa_init(params.numa);
+    std::mt19937 rng(seed);
+    dist_builder builder;
+    // target distributions for the current logits rows and
+    // draft distributions for input_seq, sampling only
+    std::vector<token_dist> dists, input_dists(1);
 
-    // main model and context
-    llama_init_result main_init = llama_init_from_gpt_params(params);
-    llama_model * model = main_init.model;
-    llama_context * ctx = main_init.context;
+    // draft tokens the main model checked and how many of them it accepted
+    size_t n_drafted        = 0;
+    size_t n_draft_accepted = 0;
+    // verification decodes with no drafts, fewer than asked for, and all of them
+    draft_fill_stats fill;
 
-    llama_duo::llama_tokens input = llama_tokenize(ctx, params.prompt, true);
+    // nothing is committed yet, the drafter only appends to what we read;
+    // an ensemble has not picked a drafter yet
+    const size_t n_first = std::min<size_t>(controller.next_length(), n_batch - n_last);
+    if (sctx->ensemble == nullptr)
+    {
+        sctx->log.read(input.size(), pending);
+        for (size_t i = 0; i < std::min(n_first, pending.size()); i++)
+        {
+            input_seq.push_back(pending[i]);
+            if (!sparams.greedy())
+            {
+                input_dists.push_back(sctx->log.dist(input.size() + i));
+            }
+        }
+    }
+    fill.add(input_seq.size() - 1, n_first);
 
-    params.model = params.model_draft;
-    params.n_gpu_layers = params.n_gpu_layers_draft;
-    if (params.n_threads_draft > 0) 
+    llama_batch_clear(batch);
+    for (size_t i = input.size() - n_last; i + 1 < input.size(); i++)
+    {
+        llama_batch_add(batch, input[i], i, { 0 }, false);
+    }
+    // rows of the last batch
+    int logits_from = batch.n_tokens;
+    for (size_t i = 0; i < input_seq.size(); i++)
     {
-        params.n_threads = params.n_threads_draft;
+        llama_batch_add(batch, input_seq[i], input.size() - 1 + i, { 0 }, true);
+    }
+    int logits_to = batch.n_tokens;
+    {
+        trace_span span("decode", "tokens", batch.n_tokens, "pos", input.size() - n_last);
+        target_decode_scope sched(sctx->sched);
+        if (llama_decode(ctx, batch) != 0)
+        {
+            fprintf(stderr, "llama_decode() failed: n_tokens=%d\n", batch.n_tokens);
+        }
     }
-    params.n_threads_batch = params.n_threads_batch_draft;
+    stats.n_prefill  += input.size() - n_cached;
+    stats.prefill_us += ggml_time_us() - prefill_start_us;
 
-    params.rpc_servers = draft_rpc;
-    llama_init_result draft_init = llama_init_from_gpt_params(params);
-    // draft model and contexts.
-    llama_model * draft_model = draft_init.model;
-    llama_context * draft_ctx = draft_init.context;
-    
-    llama_duo::shared_context sctx;
-    sctx.candidate = input;
-    sctx.turn = llama_duo::Turn::SPEC;
+    size_t n_accepted = input.size();
 
-    std::thread spec_thread = std::thread(llama_duo::speculation, draft_model, draft_ctx, &sctx, input, params.n_draft);
-    target(model, ctx, &sctx, input, params.n_predict);
-    spec_thread.join();
-    
-    llama_free(ctx);
-    llama_free(draft_ctx);
-    llama_free_model(model);
-    llama_free_model(draft_model);
-    llama_backend_free();
+    auto start_us = ggml_time_us();
+    int64_t last_us = start_us;
 
-    return 0;
+    while (n_accepted < n_predict + input.size())
+    {
+        size_t next_tokens_pos = n_accepted;
+        size_t n_match = 0;
+        if (sparams.greedy())
+        {
+            next_tokens = greedy_verified_tokens(model, ctx, logits_from, logits_to, input_seq, pool);
+            n_match = next_tokens.size() - 1;
+        }
+        else
+        {
+            // rows after the first rejected draft are never needed
+            dists.clear();
+            next_tokens.clear();
+            while (true)
+            {
+                dists.push_back(builder.build(llama_get_logits_ith(ctx, logits_from + n_match), llama_n_vocab(model), sparams));
+                if (n_match + 1 == input_seq.size())
+                {
+                    break;
+                }
+                auto res = verify_draft(dists[n_match], input_dists[n_match + 1], input_seq[n_match + 1], rng);
+                next_tokens.push_back(res.token);
+                if (!res.accepted)
+                {
+                    break;
+                }
+                n_match++;
+            }
+            // if all drafts were accepted, the token after them is picked below,
+            // once we can see what the drafter has put at that position.
+        }
+        // drafts checked in this verification and how many were accepted
+        size_t n_offered = input_seq.size() - 1;
+        size_t n_taken   = n_match;
+
+        // we always accept at least one new token
+        n_accepted += 1 + n_match;
+        const int64_t now_us = ggml_time_us();
+        stats.add_tokens(1 + n_match, now_us - last_us);
+        last_us = now_us;
+        llama_kv_cache_seq_rm(ctx, 0, n_accepted - 1, -1);
+
+        // drafts we want for the next verification: one at the bonus
+        // position plus n_verify after it. Wait for them unless the
+        // drafter has stopped extending or we were asked not to wait.
+        const size_t n_verify = std::min<size_t>(controller.next_length(), n_batch - 1);
+        const size_t n_wanted = next_tokens_pos + n_match + 1 + n_verify;
+        if (wait_for_drafts)
+        {
+            trace_span span("wait", "wanted", n_verify);
+            std::unique_lock<std::mutex> lock(sctx->mtx);
+            sctx->cv.wait(lock, [&]()
+            {
+                return sctx->ensemble != nullptr ? sctx->ensemble->ready(n_wanted) : sctx->log.size() >= n_wanted || sctx->draft_idle;
+            });
+        }
+        // from here to the verdict, the drafter works on a stale log
+        trace_span reconcile("reconcile");
+        if (sctx->ensemble != nullptr)
+        {
+            sctx->ensemble->select(sctx->log, next_tokens_pos, next_tokens, n_verify);
+        }
+        // everything after what we had verified, drafts only
+        sctx->log.read(next_tokens_pos, pending);
+
+        // position right after the verified drafts, the drafter might have
+        // speculated on it while we were busy.
+        const size_t bonus = n_match;
+        const bool   has_bonus = n_match + 1 == input_seq.size();
+        if (has_bonus && bonus < pending.size())
+        {
+            n_offered++;
+            if (sparams.greedy())
+            {
+                n_taken += next_tokens.back() == pending[bonus];
+            }
+            else
+            {
+                auto res = verify_draft(dists[n_match], sctx->log.dist(next_tokens_pos + bonus), pending[bonus], rng);
+                n_taken += res.accepted;
+                next_tokens.push_back(res.token);
+            }
+        }
+        else if (has_bonus && !sparams.greedy())
+        {
+            next_tokens.push_back(sample(dists[n_match], rng));
+        }
+
+        bool eog = false;
+        for (size_t i = 0; i < next_tokens.size(); i++)
+        {
+            // TODO: what should we do here, is this correct
+            if (next_tokens[i] == llama_token_eos(model) || llama_token_is_eog(model, next_tokens[i]))
+            {
+                // interactive mode keeps it, it ends the reply in the
+                // conversation the next message goes after
+                eog = true;
+                next_tokens.erase(next_tokens.begin() + i + (sctx->multi_turn ? 1 : 0), next_tokens.end());
+                break;
+            }
+        }
+
+        n_match = 0;
+        while (n_match < next_tokens.size() && n_match < pending.size() && next_tokens[n_match] == pending[n_match])
+        {
+            n_match++;
+        }
+
+        // the end-of-generation token is not printed
+        const size_t n_shown = next_tokens.size() - (eog && sctx->multi_turn ? 1 : 0);
+        dbg_accepted(to_string(ctx, pending.begin(), pending.begin() + std::min(n_match, n_shown)));
+        if (n_match < n_shown)
+        {
+            dbg_not_matched(to_string(ctx, next_tokens.begin() + n_match, next_tokens.begin() + n_shown));
+        }
+        if (!sctx->log.commit(next_tokens_pos, next_tokens, next_tokens_pos + next_tokens.size()))
+        {
+            fprintf(stderr, "context is full\n");
+            break;
+        }
+        if (sctx->ensemble != nullptr)
+        {
+            sctx->ensemble->commit(next_tokens_pos, next_tokens, next_tokens_pos + next_tokens.size());
+        }
+
+        // the drafter may be further ahead, verify n_verify drafts at most
+        if (!eog)
+        {
+            input_seq.assign(1, next_tokens.back());
+            if (!sparams.greedy())
+            {
+                input_dists.assign(1, token_dist());
+            }
+            if (n_match == next_tokens.size())
+            {
+                const size_t input_end = std::min(pending.size(), n_match + n_verify);
+                for (size_t i = n_match; i < input_end; i++)
+                {
+                    input_seq.push_back(pending[i]);
+                    if (!sparams.greedy())
+                    {
+                        input_dists.push_back(sctx->log.dist(next_tokens_pos + i));
+                    }
+                }
+            }
+        }
+        {
+            std::lock_guard<std::mutex> _lock(sctx->mtx);
+            sctx->draft_idle = false;
+        }
+        sctx->cv.notify_all();
+        n_drafted        += n_offered;
+        n_draft_accepted += n_taken;
+        controller.report_verification(n_offered, n_taken);
+        stats.add_verification(n_offered, n_taken);
+        reconcile.set(0, "offered", n_offered);
+        reconcile.set(1, "accepted", n_taken);
+        reconcile.end();
+
+        if (n_accepted >= n_predict + input.size() || eog)
+        {
+            break;
+        }
+
+        fill.add(input_seq.size() - 1, n_verify);
+
+        const int64_t decode_start_us = ggml_time_us();
+        {
+            target_decode_scope sched(sctx->sched);
+            decode(ctx, input_seq.begin(), input_seq.end(), n_accepted - 1, true, batch);
+        }
+        controller.report_target_time(ggml_time_us() - decode_start_us);
+
+        logits_from = 0;
+        logits_to   = input_seq.size();
+    }
+
+    double dur_s  = 1.0e-6 * (ggml_time_us() - start_us);
+    size_t tokens = n_accepted - input.size(); 
+    stats.n_tokens  += tokens;
+    stats.decode_us += ggml_time_us() - start_us;
+    
+    dbg_not_matched("\n");
+    std::cerr << "tokens: " << tokens << " tps: " << tokens / dur_s
+              << " drafted: " << n_drafted << " accepted: " << n_draft_accepted
+              << " acceptance: " << (n_drafted > 0 ? 1.0 * n_draft_accepted / n_drafted : 0.0)
+              << " " << fill.summary()
+              << " " << controller.summary()
+              << std::endl;
+    sctx->end_turn();
+
+    llama_batch_free(batch);
+}
+
+// Tree verification, one target decode per round: the newest accepted token
+// together with the whole tree the drafter grew after it. Every tree leaf
+// gets its own seq_id, the newest token and shared nodes carry the seq_ids
+// of all leaves below them, so each token only attends to its ancestors.
+// The longest path where the main model agrees with the tree is accepted,
+// plus the main model's next token after it.
+static void target_tree(
+    llama_model    * model,
+    llama_context  * ctx,
+    shared_context * sctx,
+    const llama_tokens & input,
+    size_t n_cached,
+    size_t n_predict,
+    argmax_pool & pool,
+    const duo_params & dparams,
+    bool wait_for_drafts)
+{
+    trace_recorder::instance().name_thread("target");
+
+    // all but the last token, which goes with the first tree
+    llama_batch batch = llama_batch_init(llama_n_batch(ctx), 0, dparams.tree_branches + 1);
+    {
+        target_decode_scope sched(sctx->sched);
+        decode(ctx, input.begin() + n_cached, input.end() - 1, n_cached, false, batch, dparams.prefill_chunk);
+    }
+
+    auto is_eog = [model](llama_token t)
+    {
+        return t == llama_token_eos(model) || llama_token_is_eog(model, t);
+    };
+
+    const size_t n_max = n_predict + input.size();
+    llama_tokens accepted = input;
+
+    size_t n_drafted        = 0;
+    size_t n_draft_accepted = 0;
+    size_t n_target_decodes = 0;
+    // rounds without a tree and with one
+    draft_fill_stats fill;
+
+    auto start_us = ggml_time_us();
+
+    while (accepted.size() < n_max)
+    {
+        // a tree grown from an earlier log is of no use anymore, nor is one
+        // when a single token is left to generate
+        draft_tree tree;
+        {
+            trace_span span("wait");
+            std::unique_lock<std::mutex> lock(sctx->mtx);
+            if (wait_for_drafts && accepted.size() + 1 < n_max)
+            {
+                sctx->cv.wait(lock, [&]() { return sctx->tree_base == accepted.size(); });
+            }
+            if (sctx->tree_base == accepted.size() && accepted.size() + 1 < n_max)
+            {
+                tree = std::move(sctx->tree);
+                sctx->tree.clear();
+            }
+        }
+        n_drafted += tree.size();
+        fill.add(tree.size(), 1);
+
+        // leaves get seq ids 1, 2, ...
+        std::vector<std::vector<llama_seq_id>> seqs(tree.size());
+        std::vector<llama_seq_id> newest_seqs = { 0 };
+        llama_seq_id n_seq = 1;
+        for (size_t i = 0; i < tree.size(); i++)
+        {
+            if (tree.has_children(i))
+            {
+                continue;
+            }
+            for (int32_t n = i; n >= 0; n = tree.parent[n])
+            {
+                seqs[n].push_back(n_seq);
+            }
+            newest_seqs.push_back(n_seq++);
+        }
+        for (llama_seq_id s = 1; s < n_seq; s++)
+        {
+            llama_kv_cache_seq_cp(ctx, 0, s, -1, -1);
+        }
+
+        // row 0 is the newest token, row i + 1 tree node i
+        const llama_pos pos0 = accepted.size() - 1;
+        llama_batch_clear(batch);
+        llama_batch_add(batch, accepted.back(), pos0, newest_seqs, true);
+        for (size_t i = 0; i < tree.size(); i++)
+        {
+            llama_batch_add(batch, tree.tokens[i], pos0 + 1 + tree.depth[i], seqs[i], true);
+        }
+        {
+            trace_span span("decode", "tokens", batch.n_tokens, "tree", tree.size());
+            target_decode_scope sched(sctx->sched);
+            if (llama_decode(ctx, batch) != 0)
+            {
+                fprintf(stderr, "llama_decode() failed: n_tokens=%d\n", batch.n_tokens);
+                break;
+            }
+        }
+        n_target_decodes++;
+
+        // only the rows on the accepted path are reduced
+        llama_tokens new_tokens;
+        size_t  n_from_draft = 0;
+        int32_t cur          = -1;
+        while (true)
+        {
+            const llama_token pred  = greedy_tokens(model, ctx, cur + 1, cur + 2, pool)[0];
+            const int32_t     child = tree.find_child(cur, pred);
+            new_tokens.push_back(pred);
+            if (child < 0 || is_eog(pred))
+            {
+                break;
+            }
+            n_from_draft++;
+            cur = child;
+        }
+
+        // keep the accepted path in seq 0 and drop all leaves
+        if (cur >= 0)
+        {
+            llama_kv_cache_seq_cp(ctx, seqs[cur][0], 0, pos0 + 1, pos0 + 2 + tree.depth[cur]);
+        }
+        for (llama_seq_id s = 1; s < n_seq; s++)
+        {
+            llama_kv_cache_seq_rm(ctx, s, -1, -1);
+        }
+        n_draft_accepted += n_from_draft;
+
+        bool eog = false;
+        for (size_t i = 0; i < new_tokens.size(); i++)
+        {
+            if (is_eog(new_tokens[i]))
+            {
+                eog = true;
+                new_tokens.resize(i);
+                break;
+            }
+        }
+        if (accepted.size() + new_tokens.size() > n_max)
+        {
+            new_tokens.resize(n_max - accepted.size());
+        }
+
+        n_from_draft = std::min(n_from_draft, new_tokens.size());
+        dbg_accepted(to_string(ctx, new_tokens.begin(), new_tokens.begin() + n_from_draft));
+        dbg_not_matched(to_string(ctx, new_tokens.begin() + n_from_draft, new_tokens.end()));
+        if (!sctx->log.commit(accepted.size(), new_tokens, accepted.size() + new_tokens.size()))
+        {
+            fprintf(stderr, "context is full\n");
+            break;
+        }
+        accepted.insert(accepted.end(), new_tokens.begin(), new_tokens.end());
+
+        sctx->notify();
+
+        if (accepted.size() >= n_max || eog)
+        {
+            break;
+        }
+        // the newest token goes with the next tree
+        llama_kv_cache_seq_rm(ctx, 0, accepted.size() - 1, -1);
+    }
+
+    double dur_s  = 1.0e-6 * (ggml_time_us() - start_us);
+    size_t tokens = accepted.size() - input.size();
+
+    dbg_not_matched("\n");
+    std::cerr << "tokens: " << tokens << " tps: " << tokens / dur_s
+              << " drafted: " << n_drafted << " accepted: " << n_draft_accepted
+              << " acceptance: " << (n_drafted > 0 ? 1.0 * n_draft_accepted / n_drafted : 0.0)
+              << " tokens/decode: " << (n_target_decodes > 0 ? 1.0 * tokens / n_target_decodes : 0.0)
+              << " " << fill.summary()
+              << std::endl;
+    {
+        std::lock_guard<std::mutex> _lock(sctx->mtx);
+        sctx->done = true;
+    }
+    sctx->cv.notify_all();
+
+    llama_batch_free(batch);
+}
+
+// says hello to a new remote drafter and checks it drafts with the same vocab
+static bool handshake_drafter(
+    draft_channel & ch,
+    const std::string & name,
+    llama_model * model,
+    const gpt_params & params,
+    size_t n_draft,
+    const sampling_params & sparams)
+{
+    frame_writer hello(frame_type::hello);
+    hello.put_varint(kDraftProtocolVersion);
+    hello.put_varint(llama_n_vocab(model));
+    hello.put_varint(n_draft);
+    hello.put_float(sparams.temp);
+    hello.put_varint(sparams.top_k);
+    hello.put_float(sparams.top_p);
+    hello.put_varint(params.seed);
+
+    std::vector<uint8_t> payload;
+    if (!ch.send(hello) || !ch.recv(payload))
+    {
+        fprintf(stderr, "drafter %s closed the connection\n", name.c_str());
+        return false;
+    }
+    frame_reader r(payload);
+    const uint64_t version = r.get_varint();
+    const uint64_t n_vocab = r.get_varint();
+    if (!r.ok() || r.type() != frame_type::hello || version != kDraftProtocolVersion)
+    {
+        fprintf(stderr, "drafter %s speaks another protocol\n", name.c_str());
+        return false;
+    }
+    if (n_vocab != static_cast<uint64_t>(llama_n_vocab(model)))
+    {
+        fprintf(stderr, "drafter %s: main and draft models have different vocab sizes: %d vs %d\n", name.c_str(), llama_n_vocab(model), static_cast<int>(n_vocab));
+        return false;
+    }
+    return true;
+}
+
+// decodes input[from, to) into seq 0 of ctx, n_chunk tokens at a time
+static bool prefill(llama_context * ctx, const llama_tokens & input, size_t from, size_t to, size_t n_chunk)
+{
+    llama_batch batch = llama_batch_init(llama_n_batch(ctx), 0, 1);
+    const bool ok = decode(ctx, input.begin() + from, input.begin() + to, from, false, batch, n_chunk) == 0;
+    llama_batch_free(batch);
+    return ok;
+}
+
+// Brings seq 0 of ctx to input[0, size - 1) from the state cache, prefilling
+// and storing what it did not have. The last token is left to the caller,
+// which needs its logits. Returns the number of tokens in the KV cache.
+static size_t warm_start(llama_context * ctx, state_cache & cache, const llama_tokens & input, size_t n_chunk)
+{
+    if (input.size() < 2)
+    {
+        return 0;
+    }
+    const size_t n_prefix = input.size() - 1;
+    const size_t n_cached = cache.restore(ctx, input, n_prefix);
+    if (n_cached == n_prefix)
+    {
+        return n_cached;
+    }
+    if (!prefill(ctx, input, n_cached, n_prefix, n_chunk))
+    {
+        llama_kv_cache_seq_rm(ctx, 0, -1, -1);
+        return 0;
+    }
+    cache.save(ctx, llama_tokens(input.begin(), input.begin() + n_prefix));
+    return n_prefix;
+}
+
+// One generation for a remote main model: speculation() drafts against a
+// copy of its log, which we keep up to date with its verdicts. Drafts are
+// forwarded as they appear, tagged with the main model's epoch as of the
+// last verdict we applied.
+static void serve_draft_session(
+    llama_model   * model,
+    llama_context * ctx,
+    draft_channel * ch,
+    const duo_params & dparams,
+    const vocab_subset & draft_vocab,
+    argmax_pool & pool)
+{
+    // open for this generation only, so the drafter can be stopped between them
+    suffix_index corpus;
+    if (!dparams.corpus.empty() && !corpus.open(dparams.corpus))
+    {
+        return;
+    }
+
+    std::vector<uint8_t> payload;
+    if (!ch->recv(payload))
+    {
+        return;
+    }
+    frame_reader hello(payload);
+    const uint64_t version = hello.get_varint();
+    const uint64_t n_vocab = hello.get_varint();
+    const size_t   n_draft = hello.get_varint();
+    sampling_params sparams;
+    sparams.temp  = hello.get_float();
+    sparams.top_k = hello.get_varint();
+    sparams.top_p = hello.get_float();
+    const uint32_t seed = hello.get_varint();
+    if (!hello.ok() || hello.type() != frame_type::hello)
+    {
+        return;
+    }
+    frame_writer reply(frame_type::hello);
+    reply.put_varint(kDraftProtocolVersion);
+    reply.put_varint(llama_n_vocab(model));
+    if (!ch->send(reply) || version != kDraftProtocolVersion || n_vocab != static_cast<uint64_t>(llama_n_vocab(model)))
+    {
+        return;
+    }
+
+    // the first verdict is the prompt
+    llama_tokens input, tokens;
+    if (!ch->recv(payload))
+    {
+        return;
+    }
+    frame_reader first(payload);
+    uint64_t target_epoch = first.get_varint();
+    const uint64_t from   = first.get_varint();
+    first.get_tokens(input);
+    const uint64_t crc    = first.get_varint();
+    prefix_crc verified;
+    verified.append(input.begin(), input.end());
+    if (!first.ok() || first.type() != frame_type::verdict || from != 0 || input.empty() || crc != verified.prefix(input.size()))
+    {
+        return;
+    }
+
+    shared_context mirror(std::max<size_t>(llama_n_ctx(ctx), input.size()), !sparams.greedy());
+    mirror.log.commit(0, input, input.size());
+    // commit() rewrites distributions, the sender reads them under this
+    std::mutex apply_mtx;
+
+    // a drafter joining late gets a long prefix, prefill it in batches
+    llama_kv_cache_seq_rm(ctx, 0, -1, -1);
+    const size_t n_cached = prefill(ctx, input, 0, input.size() - 1, dparams.prefill_chunk) ? input.size() - 1 : 0;
+    if (n_cached == 0)
+    {
+        llama_kv_cache_seq_rm(ctx, 0, -1, -1);
+    }
+    // our own --draft-max, if any, wins: drafters of an ensemble may run ahead by different lengths
+    const size_t n_ahead = dparams.draft_max > 0 ? dparams.draft_max : n_draft;
+    draft_controller controller(n_ahead, n_ahead, dparams.draft_window);
+    std::thread spec(speculation, model, ctx, &mirror, input, n_cached, std::ref(controller), std::cref(dparams), std::ref(pool), std::cref(sparams), seed + 1, corpus.is_open() ? &corpus : nullptr, std::cref(draft_vocab));
+
+    std::thread sender([&]()
+    {
+        size_t   n_sent    = input.size();
+        uint64_t epoch     = 0;
+        size_t   idle_sent = 0;
+        llama_tokens drafts;
+        while (true)
+        {
+            token_log::view v;
+            bool idle = false;
+            {
+                std::unique_lock<std::mutex> lock(mirror.mtx);
+                mirror.cv.wait(lock, [&]()
+                {
+                    v = mirror.log.state();
+                    return mirror.done || v.epoch != epoch || v.size > n_sent || (mirror.draft_idle && idle_sent != v.n_verified);
+                });
+                if (mirror.done)
+                {
+                    break;
+                }
+                idle = mirror.draft_idle;
+            }
+
+            frame_writer f(frame_type::drafts);
+            {
+                std::lock_guard<std::mutex> _lock(apply_mtx);
+                v = mirror.log.state();
+                if (v.epoch != epoch)
+                {
+                    // truncation never reaches below what was verified
+                    n_sent = std::min(n_sent, v.n_verified);
+                    epoch  = v.epoch;
+                }
+                v = mirror.log.read(n_sent, drafts);
+                f.put_varint(target_epoch);
+                f.put_varint(n_sent);
+                f.put_tokens(drafts.data(), drafts.size());
+                f.put_varint(sparams.greedy() ? 0 : 1);
+                for (size_t i = 0; i < drafts.size() && !sparams.greedy(); i++)
+                {
+                    f.put_dist(mirror.log.dist(n_sent + i));
+                }
+                n_sent += drafts.size();
+            }
+            if (!drafts.empty() && !ch->send(f))
+            {
+                break;
+            }
+            if (idle && n_sent == v.size && idle_sent != v.n_verified)
+            {
+                frame_writer notice(frame_type::idle);
+                notice.put_varint(v.n_verified);
+                if (!ch->send(notice))
+                {
+                    break;
+                }
+                idle_sent = v.n_verified;
+            }
+        }
+    });
+
+    // verdicts until the main model stops or goes away
+    while (ch->recv(payload))
+    {
+        frame_reader r(payload);
+        if (r.type() != frame_type::verdict)
+        {
+            break;
+        }
+        const uint64_t epoch = r.get_varint();
+        const uint64_t pos   = r.get_varint();
+        r.get_tokens(tokens);
+        const uint64_t crc   = r.get_varint();
+        if (!r.ok() || pos != verified.size())
+        {
+            break;
+        }
+        verified.append(tokens.begin(), tokens.end());
+        if (crc != verified.prefix(verified.size()))
+        {
+            fprintf(stderr, "verified tokens differ from the main model's, ending the session\n");
+            break;
+        }
+        {
+            std::lock_guard<std::mutex> _lock(apply_mtx);
+            if (!mirror.log.commit(pos, tokens, pos + tokens.size()))
+            {
+                break;
+            }
+            target_epoch = epoch;
+        }
+        {
+            std::lock_guard<std::mutex> _lock(mirror.mtx);
+            mirror.draft_idle = false;
+        }
+        mirror.cv.notify_all();
+    }
+    {
+        std::lock_guard<std::mutex> _lock(mirror.mtx);
+        mirror.done = true;
+    }
+    mirror.cv.notify_all();
+    ch->close();
+    spec.join();
+    sender.join();
+
+    const token_log::view v = mirror.log.state();
+    fprintf(stderr, "session done: prompt: %zu tokens: %zu\n", input.size(), v.n_verified - input.size());
+}
+
+// duo --draft-serve / --draft-join: drafts for one remote main model at a time
+static int serve_drafts(llama_model * model, llama_context * ctx, const gpt_params & params, const duo_params & dparams, const vocab_subset & draft_vocab)
+{
+    argmax_pool pool(1);
+    if (!dparams.draft_join.empty())
+    {
+        // keep dialing, the main model may not be up yet or between generations
+        fprintf(stderr, "joining the main model at %s\n", dparams.draft_join.c_str());
+        while (true)
+        {
+            std::unique_ptr<draft_channel> ch = draft_channel::connect(dparams.draft_join);
+            if (ch)
+            {
+                serve_draft_session(model, ctx, ch.get(), dparams, draft_vocab, pool);
+            }
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+    }
+
+    draft_listener listener;
+    if (!listener.listen(params.hostname, dparams.draft_serve))
+    {
+        fprintf(stderr, "could not listen on %s:%d\n", params.hostname.c_str(), dparams.draft_serve);
+        return 1;
+    }
+    fprintf(stderr, "drafting on %s:%d\n", params.hostname.c_str(), dparams.draft_serve);
+
+    while (true)
+    {
+        std::unique_ptr<draft_channel> ch = listener.accept();
+        if (ch)
+        {
+            serve_draft_session(model, ctx, ch.get(), dparams, draft_vocab, pool);
+        }
+    }
+    return 0;
+}
+
+// duo --draft-vocab-build N: the N most frequent tokens of the prompt text
+// and the end-of-generation tokens, for --draft-vocab. Only the vocab of
+// the draft model is loaded, its weights are not needed.
+static int build_draft_vocab(const gpt_params & params, const duo_params & dparams)
+{
+    const std::string & path = params.model_draft.empty() ? params.model : params.model_draft;
+    llama_model_params mparams = llama_model_default_params();
+    mparams.vocab_only = true;
+    llama_model * model = llama_load_model_from_file(path.c_str(), mparams);
+    if (model == nullptr)
+    {
+        fprintf(stderr, "could not load the vocab of %s\n", path.c_str());
+        return 1;
+    }
+    const int32_t n_vocab = llama_n_vocab(model);
+    std::vector<llama_token> eog;
+    for (llama_token t = 0; t < n_vocab; t++)
+    {
+        if (llama_token_is_eog(model, t))
+        {
+            eog.push_back(t);
+        }
+    }
+    const llama_tokens tokens = ::llama_tokenize(model, params.prompt, false, true);
+    const llama_tokens ids = vocab_subset::most_frequent(tokens, n_vocab, dparams.draft_vocab_build, eog);
+    llama_free_model(model);
+
+    if (!vocab_subset::save(dparams.draft_vocab, ids))
+    {
+        fprintf(stderr, "could not write %s\n", dparams.draft_vocab.c_str());
+        return 1;
+    }
+    fprintf(stderr, "draft vocab: %zu of %d tokens from %zu sample tokens written to %s\n", ids.size(), n_vocab, tokens.size(), dparams.draft_vocab.c_str());
+    return 0;
+}
+
+// Interactive mode: the next line from stdin between --in-prefix and
+// --in-suffix, tokenized with special tokens so they can hold the chat
+// template's. Empty lines are skipped, false at the end of the input.
+static bool read_message(llama_context * ctx, const gpt_params & params, llama_tokens & message)
+{
+    std::string line;
+    do
+    {
+        std::cout << "> " << std::flush;
+        if (!std::getline(std::cin, line))
+        {
+            return false;
+        }
+        message = llama_tokenize(ctx, params.input_prefix + line + params.input_suffix, false, true);
+    }
+    while (message.empty());
+    return true;
+}
+
+static void print_state_cache_stats(const char * name, const state_cache & cache, size_t n_prompt)
+{
+    const state_cache::stats & st = cache.get_stats();
+    fprintf(stderr, "state cache: %s: %s, %zu of %zu prompt tokens restored, %.1f MiB loaded in %.1f ms, %.1f MiB saved\n",
+        name, st.n_restored > 0 ? "hit" : "miss", st.n_restored, n_prompt,
+        st.bytes_loaded / 1048576.0, st.load_us / 1000.0, st.bytes_saved / 1048576.0);
+}
+
+} // llama_duo
+
+int main(int argc, char ** argv) {
+    gpt_params params;
+    // greedy unless --temp is passed explicitly
+    params.sparams.temp = 0.0f;
+
+    llama_duo::duo_params dparams;
+    std::vector<char *> llama_argv;
+    if (!llama_duo::duo_params_parse(argc, argv, dparams, llama_argv))
+    {
+        return 1;
+    }
+
+    if (gpt_params_parse(llama_argv.size(), llama_argv.data(), params) == false)
+    {
+        return 1;
+    }
+    // llama_init_from_gpt_params applies these, models are loaded without it
+    const std::string unsupported = llama_duo::find_flag(llama_argv, {
+        "--lora", "--lora-scaled", "--lora-base", "--control-vector", "--control-vector-scaled", "--control-vector-layer-range",
+        "-hfr", "--hf-repo", "-hff", "--hf-file", "-mu", "--model-url" });
+    if (!unsupported.empty())
+    {
+        fprintf(stderr, "%s is not supported: models are loaded without LoRA adapters, control vectors or downloads\n", unsupported.c_str());
+        return 1;
+    }
+
+    const bool tree_mode = dparams.tree_branches > 1;
+    if (tree_mode)
+    {
+        if (params.sparams.temp > 0.0f)
+        {
+            fprintf(stderr, "tree speculation supports greedy decoding only\n");
+            return 1;
+        }
+        if (dparams.server)
+        {
+            fprintf(stderr, "server mode drafts chains only\n");
+            return 1;
+        }
+        // every tree leaf needs a seq_id in both contexts
+        params.n_parallel = std::max(params.n_parallel, dparams.tree_branches + 1);
+    }
+
+    const bool remote_draft = !dparams.draft_remote.empty() || dparams.draft_listen > 0;
+    const bool draft_serve  = dparams.draft_serve > 0 || !dparams.draft_join.empty();
+    if ((remote_draft || draft_serve) && (tree_mode || dparams.server))
+    {
+        fprintf(stderr, "remote drafting supports one-shot chain mode only\n");
+        return 1;
+    }
+    const bool interactive = params.interactive || params.interactive_first;
+    if (interactive && (tree_mode || remote_draft || draft_serve || dparams.server))
+    {
+        fprintf(stderr, "interactive mode drafts chains with a local drafter only\n");
+        return 1;
+    }
+    // without -md the main model decodes on its own, as a baseline, unless
+    // prompt lookup drafts for it
+    const bool no_draft_model = params.model_draft.empty() && !remote_draft;
+    const bool no_draft       = no_draft_model && dparams.lookup == 0 && dparams.corpus.empty();
+    if (no_draft_model && (draft_serve || tree_mode || dparams.server))
+    {
+        fprintf(stderr, "a draft model (-md) is needed\n");
+        return 1;
+    }
+    if ((dparams.lookup > 0 || !dparams.corpus.empty()) && (remote_draft || tree_mode || dparams.server))
+    {
+        fprintf(stderr, "lookup and corpus drafting support one-shot chain mode and --draft-serve only\n");
+        return 1;
+    }
+    if (dparams.draft_vocab_build > 0 && dparams.draft_vocab.empty())
+    {
+        fprintf(stderr, "--draft-vocab-build writes to --draft-vocab, which is not set\n");
+        return 1;
+    }
+    if (!dparams.draft_vocab.empty() && dparams.draft_vocab_build == 0 && no_draft_model)
+    {
+        fprintf(stderr, "--draft-vocab needs a local draft model (-md)\n");
+        return 1;
+    }
+
+    if (dparams.server)
+    {
+        // sessions use seq ids [0, -np), cached prefixes the ones after them
+        params.n_parallel += dparams.prefix_cache;
+    }
+
+    llama_duo::draft_scheduler::policy_t sched_policy = llama_duo::draft_scheduler::OFF;
+    if (!llama_duo::draft_scheduler::parse_policy(dparams.draft_sched, sched_policy))
+    {
+        fprintf(stderr, "unknown --draft-sched %s\n", dparams.draft_sched.c_str());
+        return 1;
+    }
+
+    // main and draft model on cores of their own, so they do not evict each
+    // other's caches or share SMT siblings
+    llama_duo::core_set main_cores, draft_cores;
+    if (dparams.pin_threads)
+    {
+        if (remote_draft || draft_serve || no_draft_model)
+        {
+            fprintf(stderr, "--pin-threads needs both models in this process\n");
+            return 1;
+        }
+        if (params.numa != GGML_NUMA_STRATEGY_DISABLED)
+        {
+            fprintf(stderr, "--pin-threads and --numa both place threads, use one of them\n");
+            return 1;
+        }
+        const llama_duo::cpu_topology topo = llama_duo::cpu_topology::read();
+        const int32_t n_threads_draft = params.n_threads_draft > 0 ? params.n_threads_draft : params.n_threads;
+        if (!topo.split(params.n_threads, n_threads_draft, main_cores, draft_cores))
+        {
+            fprintf(stderr, "--pin-threads: cannot split %zu cores between two models\n", topo.n_cores());
+            return 1;
+        }
+        params.n_threads       = params.n_threads_batch       = main_cores.n_cores;
+        params.n_threads_draft = params.n_threads_batch_draft = draft_cores.n_cores;
+        fprintf(stderr, "cpu layout: %zu nodes, %zu cores, %zu cpus\n", topo.n_nodes(), topo.n_cores(), topo.n_cpus());
+        fprintf(stderr, "  main:  %zu threads on node %d, cpus %s\n", main_cores.n_cores, main_cores.node, llama_duo::format_cpu_list(main_cores.cpus).c_str());
+        fprintf(stderr, "  draft: %zu threads on node %d, cpus %s\n", draft_cores.n_cores, draft_cores.node, llama_duo::format_cpu_list(draft_cores.cpus).c_str());
+    }
+
+    if (params.seed == LLAMA_DEFAULT_SEED)
+    {
+        params.seed = time(NULL);
+    }
+    
+    // TODO: hacky: we use rpc_servers for draft model only
+    std::string draft_rpc = params.rpc_servers;
+    params.rpc_servers = "";
+
+    llama_backend_init();
+    llama_numa_init(params.numa);
+
+    if (dparams.draft_vocab_build > 0)
+    {
+        const int res = llama_duo::build_draft_vocab(params, dparams);
+        llama_backend_free();
+        return res;
+    }
+
+    // main model and context, a remote drafter has none
+    llama_model * model = nullptr;
+    llama_context * ctx = nullptr;
+    llama_duo::llama_tokens input;
+    // a model's buffers are allocated, and first touched, on its own node
+    auto place_on = [&](const llama_duo::core_set & cores)
+    {
+        if (dparams.pin_threads)
+        {
+            llama_duo::pin_thread(cores);
+            llama_duo::prefer_node(cores.node);
+        }
+    };
+    // the draft model's settings replace the main model's in params once
+    // both are loaded
+    const std::string main_model_path = params.model;
+    gpt_params draft_params = params;
+    draft_params.model = params.model_draft;
+    draft_params.n_gpu_layers = params.n_gpu_layers_draft;
+    if (params.n_threads_draft > 0) 
+    {
+        draft_params.n_threads = params.n_threads_draft;
+    }
+    draft_params.n_threads_batch = params.n_threads_batch_draft;
+    draft_params.rpc_servers = draft_rpc;
+
+    // Both models load at the same time, the draft model on a thread of its
+    // own, unless it is on a remote drafter.
+    llama_model * draft_model = nullptr;
+    llama_context * draft_ctx = nullptr;
+    llama_duo::load_timings main_load, draft_load;
+    const int64_t load_start_us = ggml_time_us();
+    std::thread draft_loader;
+    if (!remote_draft && !no_draft_model)
+    {
+        draft_loader = std::thread([&]()
+        {
+            place_on(draft_cores);
+            llama_init_result draft_init = llama_duo::load_model(draft_params, dparams.prefault, draft_load);
+            draft_model = draft_init.model;
+            draft_ctx   = draft_init.context;
+        });
+    }
+    if (!draft_serve)
+    {
+        place_on(main_cores);
+        llama_init_result main_init = llama_duo::load_model(params, dparams.prefault, main_load);
+        model = main_init.model;
+        ctx   = main_init.context;
+    }
+    if (draft_loader.joinable())
+    {
+        draft_loader.join();
+    }
+    const bool main_loaded  = draft_serve || ctx != nullptr;
+    const bool draft_loaded = remote_draft || no_draft_model || draft_ctx != nullptr;
+    if (!main_loaded || !draft_loaded)
+    {
+        return 1;
+    }
+    if (model != nullptr)
+    {
+        fprintf(stderr, "startup: main:  %s\n", main_load.summary().c_str());
+        input = llama_tokenize(ctx, params.prompt, true);
+    }
+    if (draft_model != nullptr)
+    {
+        fprintf(stderr, "startup: draft: %s\n", draft_load.summary().c_str());
+    }
+    const int64_t load_us = ggml_time_us() - load_start_us;
+    fprintf(stderr, "startup: %.1f ms wall%s\n", 1e-3 * load_us, model != nullptr && draft_model != nullptr ? ", both models loaded in parallel" : "");
+    params = draft_params;
+
+    // from here on this thread decodes for the main model
+    if (dparams.pin_threads)
+    {
+        llama_duo::pin_thread(main_cores);
+        llama_duo::prefer_node(-1);
+    }
+
+    if (model != nullptr && draft_model != nullptr && llama_n_vocab(model) != llama_n_vocab(draft_model))
+    {
+        fprintf(stderr, "main and draft models have different vocab sizes: %d vs %d\n", llama_n_vocab(model), llama_n_vocab(draft_model));
+        return 1;
+    }
+
+    llama_duo::vocab_subset draft_vocab;
+    if (draft_model != nullptr && !dparams.draft_vocab.empty())
+    {
+        if (!draft_vocab.load(dparams.draft_vocab, llama_n_vocab(draft_model)))
+        {
+            fprintf(stderr, "could not read token ids below %d from %s\n", llama_n_vocab(draft_model), dparams.draft_vocab.c_str());
+            return 1;
+        }
+        fprintf(stderr, "draft vocab: %zu of %d tokens\n", draft_vocab.size(), llama_n_vocab(draft_model));
+    }
+
+    llama_duo::sampling_params sparams;
+    sparams.temp  = params.sparams.temp;
+    sparams.top_k = params.sparams.top_k;
+    sparams.top_p = params.sparams.top_p;
+
+    if (!dparams.trace.empty())
+    {
+        llama_duo::trace_recorder::instance().enable(true);
+    }
+
+    int res = 0;
+    if (draft_serve)
+    {
+        res = llama_duo::serve_drafts(draft_model, draft_ctx, params, dparams, draft_vocab);
+    }
+    else if (dparams.server)
+    {
+        res = llama_duo::serve(model, ctx, draft_model, draft_ctx, params, dparams, sparams, draft_vocab, draft_cores);
+    }
+    else
+    {
+        // fixed --draft unless --draft-max asks for adaptive length
+        const size_t n_draft_min = dparams.draft_max > 0 ? dparams.draft_min : params.n_draft;
+        const size_t n_draft_max = dparams.draft_max > 0 ? dparams.draft_max : params.n_draft;
+        llama_duo::draft_controller controller(n_draft_min, n_draft_max, dparams.draft_window);
+
+        // Both models restore what the state cache has of the prompt at the
+        // same time, each on its own thread. Whatever is left is prefilled by
+        // the drafter and by target(), so the drafter drafts as soon as its
+        // own prompt is in, while the main model is still at its prompt.
+        auto cached_prefix = [&](llama_context * c, const std::string & path, llama_model * m, const char * name)
+        {
+            size_t n = 0;
+            if (!dparams.state_cache.empty())
+            {
+                llama_duo::state_cache cache(dparams.state_cache, path, m, std::max(0, dparams.state_cache_max));
+                n = llama_duo::warm_start(c, cache, input, dparams.prefill_chunk);
+                llama_duo::print_state_cache_stats(name, cache, input.size());
+            }
+            return n;
+        };
+
+        // the prompt, output follows it; -if has the first message come first
+        llama_duo::dbg_not_matched(llama_duo::to_string(ctx, input.begin(), input.end()));
+        llama_duo::llama_tokens message;
+        if (params.interactive_first)
+        {
+            if (!llama_duo::read_message(ctx, params, message))
+            {
+                return 0;
+            }
+            input.insert(input.end(), message.begin(), message.end());
+        }
+
+        // generation stops at the main model's context size, so does the log
+        llama_duo::shared_context sctx(std::max<size_t>(llama_n_ctx(ctx), input.size()), !sparams.greedy());
+        sctx.log.commit(0, input, input.size());
+        sctx.multi_turn = interactive;
+
+        // remote drafters have devices of their own
+        llama_duo::draft_scheduler sched(sched_policy, dparams.draft_sched_duty, dparams.draft_sched_threads);
+        if (draft_ctx != nullptr)
+        {
+            sctx.sched = &sched;
+        }
+
+        std::unique_ptr<llama_duo::draft_ensemble> ensemble;
+        if (remote_draft)
+        {
+            ensemble.reset(new llama_duo::draft_ensemble(sctx.mtx, sctx.cv, sctx.log, !sparams.greedy(),
+                [&](llama_duo::draft_channel & ch, const std::string & name)
+                {
+                    return llama_duo::handshake_drafter(ch, name, model, params, n_draft_max, sparams);
+                }));
+            if (!ensemble->start(llama_duo::split_list(dparams.draft_remote), params.hostname, dparams.draft_listen))
+            {
+                return 1;
+            }
+            sctx.ensemble = ensemble.get();
+        }
+
+        // verification produces n_draft + 1 rows per step and is worth splitting;
+        // the draft only ever needs one row, so it runs argmax inline.
+        llama_duo::argmax_pool target_argmax(std::min<size_t>(4, std::max(1u, std::thread::hardware_concurrency())));
+        llama_duo::argmax_pool draft_argmax(1);
+
+        // earlier generations, the drafter adds this one
+        llama_duo::suffix_index corpus;
+        if (!dparams.corpus.empty() && !corpus.open(dparams.corpus))
+        {
+            return 1;
+        }
+
+        llama_duo::generation_stats stats;
+        std::thread spec_thread;
+        if (tree_mode)
+        {
+            spec_thread = std::thread([&]()
+            {
+                llama_duo::pin_thread(draft_cores);
+                const size_t n_draft_cached = cached_prefix(draft_ctx, params.model_draft, draft_model, "draft");
+                llama_duo::speculation_tree(draft_model, draft_ctx, &sctx, input, n_draft_cached, params.n_draft, dparams, draft_vocab);
+            });
+            const size_t n_cached = cached_prefix(ctx, main_model_path, model, "main");
+            target_tree(model, ctx, &sctx, input, n_cached, params.n_predict, target_argmax, dparams, dparams.draft_wait != 0);
+        }
+        else if (ensemble)
+        {
+            // a remote drafter prefills on its own
+            const size_t n_cached = cached_prefix(ctx, main_model_path, model, "main");
+            target(model, ctx, &sctx, input, n_cached, params.n_predict, dparams.prefill_chunk, controller, target_argmax, sparams, params.seed, dparams.draft_wait != 0, stats);
+            ensemble->stop();
+            ensemble->print_stats();
+        }
+        else if (no_draft)
+        {
+            // nothing ever drafts, every verification is a single token
+            const size_t n_cached = cached_prefix(ctx, main_model_path, model, "main");
+            target(model, ctx, &sctx, input, n_cached, params.n_predict, dparams.prefill_chunk, controller, target_argmax, sparams, params.seed, false, stats);
+        }
+        else
+        {
+            spec_thread = std::thread([&]()
+            {
+                llama_duo::pin_thread(draft_cores);
+                // lookup and corpus only drafting has no draft model to warm up
+                const size_t n_draft_cached = draft_ctx != nullptr ? cached_prefix(draft_ctx, params.model_draft, draft_model, "draft") : 0;
+                llama_duo::speculation(draft_model, draft_ctx, &sctx, input, n_draft_cached, controller, dparams, draft_argmax, sparams, params.seed + 1, corpus.is_open() ? &corpus : nullptr, draft_vocab);
+            });
+            const size_t n_cached = cached_prefix(ctx, main_model_path, model, "main");
+            target(model, ctx, &sctx, input, n_cached, params.n_predict, dparams.prefill_chunk, controller, target_argmax, sparams, params.seed, dparams.draft_wait != 0, stats);
+        }
+
+        // Every further message goes after the verified conversation, so
+        // both KV caches only prefill the message. The main model's cache
+        // may lack the last token of the reply, which then comes with it.
+        llama_duo::llama_tokens conversation;
+        while (interactive && llama_duo::read_message(ctx, params, message))
+        {
+            const size_t n_cached = std::min<size_t>(llama_kv_cache_seq_pos_max(ctx, 0) + 1, sctx.log.state().n_verified);
+            llama_kv_cache_seq_rm(ctx, 0, n_cached, -1);
+            if (!sctx.begin_turn(message))
+            {
+                fprintf(stderr, "context is full\n");
+                break;
+            }
+            const llama_duo::token_log::view v = sctx.log.read(0, conversation);
+            conversation.resize(v.n_verified);
+            const bool wait_for_drafts = !no_draft && dparams.draft_wait != 0;
+            target(model, ctx, &sctx, conversation, n_cached, params.n_predict, dparams.prefill_chunk, controller, target_argmax, sparams, params.seed, wait_for_drafts, stats);
+        }
+        sctx.stop();
+        if (spec_thread.joinable())
+        {
+            spec_thread.join();
+        }
+        if (sctx.sched != nullptr && sched_policy != llama_duo::draft_scheduler::OFF)
+        {
+            sched.print_stats();
+        }
+
+        if (!dparams.stats_json.empty() && !tree_mode)
+        {
+            std::ofstream out(dparams.stats_json);
+            nlohmann::json j = stats.to_json();
+            j["draft_length"] = controller.to_json();
+            if (sctx.sched != nullptr)
+            {
+                j["scheduler"] = sched.to_json();
+            }
+            j["startup"] = { { "main", main_load.to_json() }, { "wall_ms", 1e-3 * load_us } };
+            if (draft_model != nullptr)
+            {
+                j["startup"]["draft"] = draft_load.to_json();
+            }
+            out << j.dump(2) << std::endl;
+            if (!out)
+            {
+                fprintf(stderr, "could not write %s\n", dparams.stats_json.c_str());
+                res = 1;
+            }
+        }
+    }
+
+    if (!dparams.trace.empty() && !llama_duo::trace_recorder::instance().write(dparams.trace))
+    {
+        fprintf(stderr, "could not write %s\n", dparams.trace.c_str());
+        res = 1;
+    }
+
+    llama_free(ctx);
+    llama_free(draft_ctx);
+    llama_free_model(model);
+    llama_free_model(draft_model);
+    llama_backend_free();
+
+    return res;
 }
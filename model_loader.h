@@ -0,0 +1,215 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <common.h>
+#include <json.hpp>
+#include <llama.h>
+
+namespace llama_duo
+{
+
+// Where one model's startup time went.
+struct load_timings
+{
+    int64_t prefault_us    = 0; // model files read into the page cache
+    int64_t mmap_us        = 0; // metadata, mmap and buffer allocation
+    int64_t upload_us      = 0; // tensor data loaded and uploaded to the backends
+    int64_t context_us     = 0; // context and KV cache
+    int64_t warmup_us      = 0; // first decode
+    size_t  prefault_bytes = 0;
+
+    int64_t total_us() const
+    {
+        return prefault_us + mmap_us + upload_us + context_us + warmup_us;
+    }
+
+    std::string summary() const
+    {
+        char buf[256];
+        snprintf(buf, sizeof(buf), "prefault %.1f ms (%.1f MiB), mmap %.1f ms, upload %.1f ms, context %.1f ms, warmup %.1f ms, %.1f ms in all",
+            1e-3 * prefault_us, prefault_bytes / 1048576.0, 1e-3 * mmap_us, 1e-3 * upload_us, 1e-3 * context_us, 1e-3 * warmup_us, 1e-3 * total_us());
+        return buf;
+    }
+
+    nlohmann::json to_json() const
+    {
+        return {
+            { "prefault_ms",  1e-3 * prefault_us },
+            { "prefault_mib", prefault_bytes / 1048576.0 },
+            { "mmap_ms",      1e-3 * mmap_us },
+            { "upload_ms",    1e-3 * upload_us },
+            { "context_ms",   1e-3 * context_us },
+            { "warmup_ms",    1e-3 * warmup_us },
+            { "total_ms",     1e-3 * total_us() }
+        };
+    }
+};
+
+// path and, for a split gguf ("name-00001-of-00003.gguf"), all other splits
+inline std::vector<std::string> model_files(const std::string & path)
+{
+    char prefix[1024];
+    int  i_split = 0, n_split = 0;
+    const size_t pos = path.rfind("-of-");
+    if (pos == std::string::npos || pos < 6 || sscanf(path.c_str() + pos - 6, "-%5d-of-%5d.gguf", &i_split, &n_split) != 2 || n_split < 2 ||
+        llama_split_prefix(prefix, sizeof(prefix), path.c_str(), i_split - 1, n_split) <= 0)
+    {
+        return { path };
+    }
+    std::vector<std::string> res;
+    for (int i = 0; i < n_split; i++)
+    {
+        char split[1024];
+        llama_split_path(split, sizeof(split), prefix, i, n_split);
+        res.push_back(split);
+    }
+    return res;
+}
+
+// Reads a file into the page cache with one MAP_POPULATE mapping, so llama's
+// own mapping of it later finds every page resident instead of faulting them
+// in one by one, at random, while it loads. Files larger than the physical
+// memory are skipped, they would only evict each other. Bytes read.
+inline size_t prefault_file(const std::string & path)
+{
+#if defined(__linux__)
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+        return 0;
+    }
+    const size_t size = st.st_size;
+    const long   page = sysconf(_SC_PAGESIZE);
+    const long   n_pages = sysconf(_SC_PHYS_PAGES);
+    if (page > 0 && n_pages > 0 && size > static_cast<size_t>(page) * n_pages)
+    {
+        fprintf(stderr, "%s is larger than the physical memory, not prefaulting it\n", path.c_str());
+        ::close(fd);
+        return 0;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    void * addr = mmap(nullptr, size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED)
+    {
+        return 0;
+    }
+    munmap(addr, size);
+    return size;
+#else
+    (void) path;
+    return 0;
+#endif
+}
+
+// Loads the model and creates its context like llama_init_from_gpt_params
+// does, with each phase timed: files prefaulted (if asked to), model
+// mapped, tensors uploaded, context created and, unless --no-warmup, one
+// decode of bos/eos with the KV cache cleared afterwards, so the first real
+// decode does not pay for first-touch allocations and kernel setup. LoRA
+// adapters, control vectors and downloads are not applied, main() rejects
+// their flags.
+inline llama_init_result load_model(const gpt_params & params, bool prefault, load_timings & t)
+{
+    using clock = std::chrono::steady_clock;
+    auto since_us = [](clock::time_point start)
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start).count();
+    };
+
+    llama_init_result res;
+    if (prefault)
+    {
+        const auto start = clock::now();
+        for (const auto & f : model_files(params.model))
+        {
+            t.prefault_bytes += prefault_file(f);
+        }
+        t.prefault_us = since_us(start);
+    }
+
+    // tensors start loading at the first progress report
+    struct progress
+    {
+        clock::time_point start;
+        clock::time_point upload;
+        bool              started = false;
+    } p;
+    llama_model_params mparams = llama_model_params_from_gpt_params(params);
+    mparams.progress_callback_user_data = &p;
+    mparams.progress_callback = [](float, void * user_data)
+    {
+        progress * p = static_cast<progress *>(user_data);
+        if (!p->started)
+        {
+            p->upload  = clock::now();
+            p->started = true;
+        }
+        return true;
+    };
+    p.start = clock::now();
+    res.model = llama_load_model_from_file(params.model.c_str(), mparams);
+    if (res.model == nullptr)
+    {
+        fprintf(stderr, "could not load %s\n", params.model.c_str());
+        return res;
+    }
+    const auto loaded = clock::now();
+    if (!p.started)
+    {
+        p.upload = loaded;
+    }
+    t.mmap_us   = std::chrono::duration_cast<std::chrono::microseconds>(p.upload - p.start).count();
+    t.upload_us = std::chrono::duration_cast<std::chrono::microseconds>(loaded - p.upload).count();
+
+    auto start = clock::now();
+    res.context = llama_new_context_with_model(res.model, llama_context_params_from_gpt_params(params));
+    t.context_us = since_us(start);
+    if (res.context == nullptr)
+    {
+        fprintf(stderr, "could not create a context for %s\n", params.model.c_str());
+        llama_free_model(res.model);
+        res.model = nullptr;
+        return res;
+    }
+
+    if (params.warmup)
+    {
+        start = clock::now();
+        llama_batch batch = llama_batch_init(2, 0, 1);
+        const llama_token bos = llama_token_bos(res.model);
+        const llama_token eos = llama_token_eos(res.model);
+        llama_batch_add(batch, bos != -1 ? bos : 0, 0, { 0 }, false);
+        if (eos != -1)
+        {
+            llama_batch_add(batch, eos, 1, { 0 }, false);
+        }
+        batch.logits[batch.n_tokens - 1] = true;
+        llama_decode(res.context, batch);
+        llama_batch_free(batch);
+        llama_kv_cache_clear(res.context);
+        llama_synchronize(res.context);
+        llama_reset_timings(res.context);
+        t.warmup_us = since_us(start);
+    }
+    return res;
+}
+
+}
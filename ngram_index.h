@@ -0,0 +1,93 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include <llama.h>
+
+namespace llama_duo
+{
+
+// Prompt lookup: drafts by copying what followed the latest earlier
+// occurrence of the current suffix, in the prompt or in verified output.
+//
+// For every n in [n_min, n_max] a hash map takes an n-gram to the position
+// right after its latest occurrence. Tokens are indexed as they are
+// appended, an n-gram only once the token after it is known, so a lookup
+// never finds the suffix it is looking for with nothing after it. Longer
+// matches win; hash collisions are checked against the tokens.
+class ngram_index
+{
+  public:
+    ngram_index(size_t n_min, size_t n_max)
+        : n_min_(std::max<size_t>(1, n_min))
+        , n_max_(std::max(n_max, n_min_))
+        , maps_(n_max_ - n_min_ + 1)
+    {
+    }
+
+    size_t size() const
+    {
+        return tokens_.size();
+    }
+
+    template<typename iter_t>
+    void append(iter_t from, iter_t to)
+    {
+        for (auto it = from; it != to; ++it)
+        {
+            tokens_.push_back(*it);
+            // n-grams ending right before the new token now have a continuation
+            const size_t pos = tokens_.size() - 1;
+            for (size_t n = n_min_; n <= n_max_ && n <= pos; n++)
+            {
+                maps_[n - n_min_][hash(tokens_.data() + pos - n, n)] = pos;
+            }
+        }
+    }
+
+    // up to n_draft tokens that could follow 'context', empty if no suffix
+    // of it was seen before
+    void draft(const std::vector<llama_token> & context, size_t n_draft, std::vector<llama_token> & out) const
+    {
+        out.clear();
+        for (size_t n = std::min(n_max_, context.size()); n >= n_min_ && n_draft > 0; n--)
+        {
+            const llama_token * suffix = context.data() + context.size() - n;
+            const auto & map = maps_[n - n_min_];
+            const auto it = map.find(hash(suffix, n));
+            if (it == map.end() || !std::equal(suffix, suffix + n, tokens_.begin() + it->second - n))
+            {
+                continue;
+            }
+            const size_t pos = it->second;
+            out.assign(tokens_.begin() + pos, tokens_.begin() + std::min(tokens_.size(), pos + n_draft));
+            return;
+        }
+    }
+
+  private:
+    // FNV-1a over the token bytes
+    static uint64_t hash(const llama_token * tokens, size_t n)
+    {
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (size_t i = 0; i < n; i++)
+        {
+            uint32_t t = static_cast<uint32_t>(tokens[i]);
+            for (int b = 0; b < 4; b++, t >>= 8)
+            {
+                h = (h ^ (t & 0xff)) * 0x100000001b3ull;
+            }
+        }
+        return h;
+    }
+
+    const size_t n_min_;
+    const size_t n_max_;
+    std::vector<llama_token> tokens_;
+    std::vector<std::unordered_map<uint64_t, size_t>> maps_;
+};
+
+}
@@ -0,0 +1,262 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <initializer_list>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace llama_duo
+{
+
+// options which are specific to duo. Everything else is handled by
+// llama.cpp's gpt_params_parse.
+struct duo_params
+{
+    // token tree speculation
+    int32_t tree_branches = 1;    // max leaves in the draft tree, 1 drafts a linear chain
+    int32_t tree_split_k  = 2;    // alternatives expanded at a low-confidence node
+    float   tree_split_p  = 0.5f; // expand when draft top token probability is below this
+
+    // adaptive draft length, chain mode
+    int32_t draft_min     = 1;    // lower bound for the draft length
+    int32_t draft_max     = 0;    // upper bound, 0 keeps --draft fixed
+    int32_t draft_window  = 64;   // verifications the acceptance estimate looks at
+    float   draft_p_min   = 0.0f; // stop a round once draft top probability is below this
+    int32_t draft_wait    = 1;    // 0: main model verifies whatever drafts are ready, never waits
+
+    // prompt lookup drafting: copy what followed an earlier occurrence of the last n tokens
+    int32_t lookup        = 0;    // longest n-gram to match, 0: off
+    int32_t lookup_min    = 2;    // shortest n-gram to match
+
+    // retrieval drafting: most frequent continuation in earlier generations
+    std::string corpus;            // directory of the suffix index, empty: off
+    int32_t     corpus_min    = 4; // shortest suffix of the context to match
+
+    // drafts come from the most frequent tokens only
+    std::string draft_vocab;             // sidecar with their ids, empty: the whole vocab
+    int32_t     draft_vocab_build = 0;   // write the n most frequent tokens of the prompt text to draft_vocab and exit
+
+    // tokens per prefill decode, 0: the batch size (-b)
+    int32_t prefill_chunk = 0;
+
+    // drafter vs main model on a shared device
+    std::string draft_sched         = "off"; // off, pause, throttle or shrink
+    float       draft_sched_duty    = 0.5f;  // throttle: drafter's share of the time while the main model decodes
+    int32_t     draft_sched_threads = 1;     // shrink: drafter threads while the main model decodes
+
+    // main and draft model threads on disjoint cores
+    bool pin_threads = false;
+
+    // read the model files into the page cache before llama maps them
+    bool prefault = false;
+
+    // prompt states kept on disk between runs, empty: off
+    std::string state_cache;
+    int32_t     state_cache_max = 32; // blobs per model, least recently used removed first, 0: no limit
+
+    // one-shot chain mode: speed, acceptance and latency of the run as json, empty: off
+    std::string stats_json;
+
+    // timeline of decodes, argmax and waits as Chrome trace json, empty: off
+    std::string trace;
+
+    // remote drafting
+    std::string draft_remote;      // host:port[,host:port...] of duo --draft-serve, replaces the local draft model
+    int32_t     draft_listen  = 0; // port remote drafters can join on at any time, 0: off
+    int32_t     draft_serve   = 0; // port to draft on for a remote main model, 0: off
+    std::string draft_join;        // host:port of a main model's --draft-listen to draft for
+
+    // server mode
+    bool    server        = false; // serve /messages over http instead of a one-shot run
+    int32_t prefix_cache  = 0;     // prefixes kept in the KV caches after their session ends
+};
+
+struct value_parser
+{
+    template<typename value_t>
+    static void parse(const char * value, value_t & field)
+    {
+        std::istringstream iss(value);
+        iss >> field;
+    }
+};
+
+template<>
+inline void value_parser::parse<std::string>(const char * value, std::string & field)
+{
+    field = value;
+}
+
+// same idea as the parser in _deprecated/utils.h, but unknown arguments
+// are collected into 'rest' so they can be passed to gpt_params_parse.
+template<typename config_t>
+struct parser
+{
+    int parse_options(int argc, char ** argv, config_t & conf, std::vector<char *> & rest)
+    {
+        rest.assign(argv, argv + 1);
+        for (int i = 1; i < argc; i++)
+        {
+            std::string key(argv[i]);
+            auto it = setters_.find(key);
+            if (it == setters_.end())
+            {
+                rest.push_back(argv[i]);
+                continue;
+            }
+            if (!it->second.has_value)
+            {
+                it->second.set(nullptr, conf);
+            }
+            else if (++i < argc)
+            {
+                it->second.set(argv[i], conf);
+            }
+            else
+            {
+                fprintf(stderr, "No argument value provided for %s\n", argv[i - 1]);
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    template<typename T>
+    void add_option(const std::initializer_list<std::string> & keys, T config_t::* field, const std::string & help)
+    {
+        for (const auto & key : keys)
+        {
+            setters_[key] = { [field](const char * value, config_t & conf)
+            {
+                value_parser::parse(value, conf.*field);
+            }, true };
+        }
+        add_help(keys, help);
+    }
+
+    // option without a value, sets the field to true
+    void add_flag(const std::initializer_list<std::string> & keys, bool config_t::* field, const std::string & help)
+    {
+        for (const auto & key : keys)
+        {
+            setters_[key] = { [field](const char *, config_t & conf)
+            {
+                conf.*field = true;
+            }, false };
+        }
+        add_help(keys, help);
+    }
+
+    void print_usage() const
+    {
+        fprintf(stderr, "duo options:\n");
+        for (const auto & h : help_)
+        {
+            fprintf(stderr, "  %-36s %s\n", h.first.c_str(), h.second.c_str());
+        }
+        fprintf(stderr, "\n");
+    }
+
+  private:
+    struct setter
+    {
+        std::function<void(const char *, config_t &)> set;
+        bool has_value;
+    };
+
+    void add_help(const std::initializer_list<std::string> & keys, const std::string & help)
+    {
+        std::string names;
+        for (const auto & key : keys)
+        {
+            names += (names.empty() ? "" : ", ") + key;
+        }
+        help_.push_back({ names, help });
+    }
+
+    std::map<std::string, setter> setters_;
+    std::vector<std::pair<std::string, std::string>> help_;
+};
+
+// "a,b,,c" -> { "a", "b", "c" }
+inline std::vector<std::string> split_list(const std::string & value)
+{
+    std::vector<std::string> res;
+    std::istringstream iss(value);
+    std::string item;
+    while (std::getline(iss, item, ','))
+    {
+        if (!item.empty())
+        {
+            res.push_back(item);
+        }
+    }
+    return res;
+}
+
+// the first of 'keys' among the llama.cpp arguments, "" if none is there
+inline std::string find_flag(const std::vector<char *> & args, const std::initializer_list<std::string> & keys)
+{
+    for (const char * arg : args)
+    {
+        if (arg != nullptr && std::find(keys.begin(), keys.end(), arg) != keys.end())
+        {
+            return arg;
+        }
+    }
+    return "";
+}
+
+// parses duo options and leaves the rest of argv in 'rest'
+inline bool duo_params_parse(int argc, char ** argv, duo_params & dparams, std::vector<char *> & rest)
+{
+    parser<duo_params> p;
+    p.add_option({"--tree-branches"}, &duo_params::tree_branches, "max leaves of the draft token tree, 1 drafts a chain (default: 1)");
+    p.add_option({"--tree-split-k"},  &duo_params::tree_split_k,  "alternatives expanded at a low-confidence draft position (default: 2)");
+    p.add_option({"--tree-split-p"},  &duo_params::tree_split_p,  "expand when the draft top token probability is below this (default: 0.5)");
+    p.add_option({"--draft-min"},     &duo_params::draft_min,     "adaptive draft length: lower bound (default: 1)");
+    p.add_option({"--draft-max"},     &duo_params::draft_max,     "adaptive draft length: upper bound, 0 keeps --draft fixed (default: 0)");
+    p.add_option({"--draft-window"},  &duo_params::draft_window,  "adaptive draft length: verifications in the acceptance window (default: 64)");
+    p.add_option({"--draft-p-min"},   &duo_params::draft_p_min,   "stop a draft round once the draft top token probability is below this (default: 0, off)");
+    p.add_option({"--draft-wait"},    &duo_params::draft_wait,    "1: main model waits for a full draft while the drafter is producing, 0: it verifies whatever is ready (default: 1)");
+    p.add_option({"--lookup"},        &duo_params::lookup,        "prompt lookup drafting: longest n-gram of the prompt and output to match, copied continuations are drafted before (or, without -md, instead of) the draft model's (default: 0, off)");
+    p.add_option({"--lookup-min"},    &duo_params::lookup_min,    "prompt lookup drafting: shortest n-gram to match (default: 2)");
+    p.add_option({"--corpus"},        &duo_params::corpus,        "retrieval drafting: existing directory with a suffix index of earlier outputs; drafts their most frequent continuation and adds this output (default: off)");
+    p.add_option({"--corpus-min"},    &duo_params::corpus_min,    "retrieval drafting: shortest suffix of the context to match (default: 4)");
+    p.add_option({"--draft-vocab"},   &duo_params::draft_vocab,   "draft only from the token ids listed in this file, argmax/top-k/softmax of the draft look at those columns only (default: off, the whole vocab)");
+    p.add_option({"--draft-vocab-build"}, &duo_params::draft_vocab_build, "write the ids of the n most frequent tokens of the prompt text (-p/-f), tokenized with -md (or -m), and the end-of-generation tokens to --draft-vocab, then exit (default: 0, off)");
+    p.add_option({"--prefill-chunk"}, &duo_params::prefill_chunk, "prompt tokens per prefill decode, smaller chunks let drafts and other sessions in sooner (default: 0, the batch size)");
+    p.add_option({"--draft-sched"},   &duo_params::draft_sched,   "drafter while the main model decodes: off, pause (no draft decodes), throttle (rest to stay within --draft-sched-duty) or shrink (--draft-sched-threads threads) (default: off)");
+    p.add_option({"--draft-sched-duty"}, &duo_params::draft_sched_duty, "throttle: share of the time the drafter decodes while the main model does (default: 0.5)");
+    p.add_option({"--draft-sched-threads"}, &duo_params::draft_sched_threads, "shrink: drafter threads while the main model decodes (default: 1)");
+    p.add_flag({"--pin-threads"},       &duo_params::pin_threads,   "split the physical cores between the main and the draft model by NUMA node and shared cache, pin each model's threads to its share and allocate its KV cache on its node; -t and -td are scaled down if they do not fit");
+    p.add_flag({"--prefault"},          &duo_params::prefault,      "read each model's files (all splits) into the page cache with one sequential MAP_POPULATE pass before loading, both models at once; skipped for files larger than the physical memory");
+    p.add_option({"--state-cache"},   &duo_params::state_cache,   "directory for prompt states of both models, a warm start restores the longest cached prefix instead of prefilling it (default: off)");
+    p.add_option({"--state-cache-max"}, &duo_params::state_cache_max, "prompt states kept per model in --state-cache, the least recently used are removed beyond this; 0 keeps all, which grows without bound (default: 32)");
+    p.add_option({"--stats-json"},    &duo_params::stats_json,    "one-shot chain mode: write prefill/decode speed, acceptance per draft position and token latency percentiles to this file (default: off)");
+    p.add_option({"--trace"},         &duo_params::trace,         "record a timeline of decodes, argmax and waits per thread, written as Chrome trace json to this file at exit (default: off)");
+    p.add_option({"--draft-remote"},  &duo_params::draft_remote,  "comma-separated host:port of drafters started with --draft-serve, used instead of -md (default: off)");
+    p.add_option({"--draft-listen"},  &duo_params::draft_listen,  "accept drafters started with --draft-join on --host and this port, used instead of -md (default: 0, off)");
+    p.add_option({"--draft-serve"},   &duo_params::draft_serve,   "draft with -md for a remote main model on --host and this port (default: 0, off)");
+    p.add_option({"--draft-join"},    &duo_params::draft_join,    "draft with -md for the main model listening on this host:port (default: off)");
+    p.add_flag({"--server"},            &duo_params::server,        "serve /messages on --host/--port, sessions share batched decodes, up to -np at a time");
+    p.add_option({"--prefix-cache"},  &duo_params::prefix_cache,  "server: prompts and conversations kept in the KV caches for later sessions, each takes a seq_id (default: 0)");
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg(argv[i]);
+        if (arg == "-h" || arg == "--help")
+        {
+            p.print_usage();
+        }
+    }
+
+    return 0 == p.parse_options(argc, argv, dparams, rest);
+}
+
+}
@@ -0,0 +1,303 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <llama.h>
+
+namespace llama_duo
+{
+
+// Token prefixes kept in a KV cache after the session that computed them is
+// gone, so later sessions with the same system prompt or the next turn of a
+// conversation skip their prefill.
+//
+// Each cached entry owns a seq_id from [seq_begin, seq_begin + n_seqs). A
+// radix tree over the tokens of all entries finds the longest cached prefix
+// of a new prompt. The session gets it with llama_kv_cache_seq_cp, which adds
+// the session's seq_id to the cached cells instead of copying them; whatever
+// the session decodes next goes to new cells, so cached cells are never
+// written again. Least recently used entries are dropped when we run out of
+// seq_ids or of KV cells.
+//
+// Not thread safe, apart from the counters. Every context has its own
+// cache, used by the thread which owns the context.
+class prefix_cache
+{
+  public:
+    prefix_cache(llama_context * ctx, llama_seq_id seq_begin, size_t n_seqs)
+        : ctx_(ctx)
+        , seq_begin_(seq_begin)
+        , entries_(n_seqs)
+        , root_(new node)
+    {
+    }
+
+    size_t n_hits() const
+    {
+        return n_hits_;
+    }
+
+    size_t n_misses() const
+    {
+        return n_misses_;
+    }
+
+    size_t n_reused() const
+    {
+        return n_reused_;
+    }
+
+    // replaces the content of 'seq' with the longest cached prefix of
+    // tokens[0, n_max), returns its length
+    size_t restore(const std::vector<llama_token> & tokens, size_t n_max, llama_seq_id seq)
+    {
+        llama_kv_cache_seq_rm(ctx_, seq, -1, -1);
+        const match m = lookup(tokens, n_max);
+        if (m.n == 0)
+        {
+            n_misses_++;
+            return 0;
+        }
+        touch(m.entry);
+        llama_kv_cache_seq_cp(ctx_, seq_of(m.entry), seq, 0, m.n);
+        n_hits_++;
+        n_reused_ += m.n;
+        return m.n;
+    }
+
+    // keeps tokens[0, n), which 'src' holds in the KV cache, for later sessions
+    void insert(const std::vector<llama_token> & tokens, size_t n, llama_seq_id src)
+    {
+        if (n == 0 || entries_.empty())
+        {
+            return;
+        }
+        const match m = lookup(tokens, n);
+        if (m.n == n)
+        {
+            touch(m.entry);
+            return;
+        }
+
+        // an entry ending where the match ends is extended in place
+        int32_t idx = -1;
+        if (m.n > 0)
+        {
+            for (int32_t e : m.at->entries)
+            {
+                if (entries_[e].tokens.size() == m.n)
+                {
+                    idx = e;
+                    break;
+                }
+            }
+        }
+        if (idx >= 0)
+        {
+            remove_path(idx);
+            llama_kv_cache_seq_cp(ctx_, src, seq_of(idx), m.n, n);
+        }
+        else
+        {
+            idx = free_entry();
+            llama_kv_cache_seq_rm(ctx_, seq_of(idx), -1, -1);
+            llama_kv_cache_seq_cp(ctx_, src, seq_of(idx), 0, n);
+        }
+        entries_[idx].tokens.assign(tokens.begin(), tokens.begin() + n);
+        entries_[idx].in_use = true;
+        insert_path(idx);
+        touch(idx);
+    }
+
+    // drops least recently used entries until n_cells more cells fit
+    void make_room(size_t n_cells)
+    {
+        const size_t n_ctx = llama_n_ctx(ctx_);
+        while (static_cast<size_t>(llama_get_kv_cache_used_cells(ctx_)) + n_cells > n_ctx)
+        {
+            const int32_t idx = lru();
+            if (idx < 0)
+            {
+                break;
+            }
+            evict(idx);
+        }
+    }
+
+  private:
+    struct node
+    {
+        std::vector<llama_token> edge;  // tokens from the parent to this node
+        std::map<llama_token, std::unique_ptr<node>> children;
+        std::vector<int32_t> entries;   // entries whose tokens include this node
+    };
+
+    struct entry
+    {
+        std::vector<llama_token> tokens;
+        uint64_t last_used = 0;
+        bool     in_use    = false;
+    };
+
+    struct match
+    {
+        node *  at;    // deepest node the match reached into
+        int32_t entry; // any entry with this prefix
+        size_t  n;
+    };
+
+    llama_seq_id seq_of(int32_t idx) const
+    {
+        return seq_begin_ + idx;
+    }
+
+    void touch(int32_t idx)
+    {
+        entries_[idx].last_used = ++clock_;
+    }
+
+    match lookup(const std::vector<llama_token> & tokens, size_t n_max) const
+    {
+        match res = { nullptr, -1, 0 };
+        node * cur = root_.get();
+        size_t i   = 0;
+        while (i < n_max)
+        {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end())
+            {
+                break;
+            }
+            node * c = it->second.get();
+            size_t k = 0;
+            while (k < c->edge.size() && i + k < n_max && c->edge[k] == tokens[i + k])
+            {
+                k++;
+            }
+            res = { c, c->entries.front(), i + k };
+            if (k < c->edge.size())
+            {
+                break;
+            }
+            i  += k;
+            cur = c;
+        }
+        return res;
+    }
+
+    void insert_path(int32_t idx)
+    {
+        const auto & tokens = entries_[idx].tokens;
+        node * cur = root_.get();
+        size_t i   = 0;
+        while (i < tokens.size())
+        {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end())
+            {
+                std::unique_ptr<node> leaf(new node);
+                leaf->edge.assign(tokens.begin() + i, tokens.end());
+                leaf->entries.push_back(idx);
+                cur->children[tokens[i]] = std::move(leaf);
+                return;
+            }
+            node * c = it->second.get();
+            size_t k = 0;
+            while (k < c->edge.size() && i + k < tokens.size() && c->edge[k] == tokens[i + k])
+            {
+                k++;
+            }
+            if (k < c->edge.size())
+            {
+                // split the edge, the new node gets the first k tokens
+                std::unique_ptr<node> mid(new node);
+                mid->edge.assign(c->edge.begin(), c->edge.begin() + k);
+                mid->entries = c->entries;
+                c->edge.erase(c->edge.begin(), c->edge.begin() + k);
+                mid->children[c->edge[0]] = std::move(it->second);
+                it->second = std::move(mid);
+                c = it->second.get();
+            }
+            c->entries.push_back(idx);
+            i  += k;
+            cur = c;
+        }
+    }
+
+    void remove_path(int32_t idx)
+    {
+        const auto & tokens = entries_[idx].tokens;
+        node * cur = root_.get();
+        size_t i   = 0;
+        while (i < tokens.size())
+        {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end())
+            {
+                return;
+            }
+            node * c = it->second.get();
+            c->entries.erase(std::remove(c->entries.begin(), c->entries.end(), idx), c->entries.end());
+            if (c->entries.empty())
+            {
+                // every entry below passes through c as well
+                cur->children.erase(it);
+                return;
+            }
+            i  += c->edge.size();
+            cur = c;
+        }
+    }
+
+    int32_t lru() const
+    {
+        int32_t res = -1;
+        for (size_t i = 0; i < entries_.size(); i++)
+        {
+            if (entries_[i].in_use && (res < 0 || entries_[i].last_used < entries_[res].last_used))
+            {
+                res = i;
+            }
+        }
+        return res;
+    }
+
+    void evict(int32_t idx)
+    {
+        remove_path(idx);
+        llama_kv_cache_seq_rm(ctx_, seq_of(idx), -1, -1);
+        entries_[idx].tokens.clear();
+        entries_[idx].in_use = false;
+    }
+
+    int32_t free_entry()
+    {
+        for (size_t i = 0; i < entries_.size(); i++)
+        {
+            if (!entries_[i].in_use)
+            {
+                return i;
+            }
+        }
+        const int32_t idx = lru();
+        evict(idx);
+        return idx;
+    }
+
+    llama_context *       ctx_;
+    const llama_seq_id    seq_begin_;
+    std::vector<entry>    entries_;
+    std::unique_ptr<node> root_;
+    uint64_t              clock_ = 0;
+
+    std::atomic<size_t> n_hits_{0};
+    std::atomic<size_t> n_misses_{0};
+    std::atomic<size_t> n_reused_{0};
+};
+
+}
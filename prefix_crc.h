@@ -0,0 +1,216 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include <llama.h>
+
+namespace llama_duo
+{
+
+// CRC32C (Castagnoli) checksums of token sequences.
+//
+// Kernels take and return the raw register state: start from ~0 and invert
+// the result, crc32c() does both. They all produce the same values; the
+// SSE4.2 one is compiled with a target attribute and picked at runtime like
+// the argmax kernels, ARMv8 CRC32C is used when the compiler targets it and
+// slicing-by-8 tables are the fallback. Tables assume a little-endian host.
+
+struct crc32c_tables
+{
+    uint32_t t[8][256];
+
+    crc32c_tables()
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+            {
+                c = (c >> 1) ^ (0x82F63B78u & (0u - (c & 1)));
+            }
+            t[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            for (int k = 1; k < 8; k++)
+            {
+                t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+            }
+        }
+    }
+};
+
+inline const crc32c_tables & crc32c_table()
+{
+    static const crc32c_tables tables;
+    return tables;
+}
+
+inline uint32_t crc32c_slice8(uint32_t crc, const uint8_t * p, size_t n)
+{
+    const auto & t = crc32c_table().t;
+    for (; n >= 8; p += 8, n -= 8)
+    {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24]
+            ^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+    }
+    for (; n > 0; p++, n--)
+    {
+        crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xff];
+    }
+    return crc;
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define LLAMA_DUO_CRC32C_X86 1
+
+__attribute__((target("sse4.2")))
+inline uint32_t crc32c_sse42(uint32_t crc, const uint8_t * p, size_t n)
+{
+#if defined(__x86_64__)
+    uint64_t c = crc;
+    for (; n >= 8; p += 8, n -= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = static_cast<uint32_t>(c);
+#endif
+    for (; n >= 4; p += 4, n -= 4)
+    {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        crc = _mm_crc32_u32(crc, v);
+    }
+    for (; n > 0; p++, n--)
+    {
+        crc = _mm_crc32_u8(crc, *p);
+    }
+    return crc;
+}
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define LLAMA_DUO_CRC32C_ARM 1
+
+inline uint32_t crc32c_armv8(uint32_t crc, const uint8_t * p, size_t n)
+{
+    for (; n >= 8; p += 8, n -= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+    }
+    for (; n >= 4; p += 4, n -= 4)
+    {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        crc = __crc32cw(crc, v);
+    }
+    for (; n > 0; p++, n--)
+    {
+        crc = __crc32cb(crc, *p);
+    }
+    return crc;
+}
+#endif
+
+using crc32c_fn = uint32_t (*)(uint32_t, const uint8_t *, size_t);
+
+struct crc32c_kernel
+{
+    const char * name;
+    crc32c_fn    fn;
+};
+
+// best kernel for the CPU we are running on, resolved once
+inline const crc32c_kernel & crc32c_best_kernel()
+{
+    static const crc32c_kernel kernel = []()
+    {
+#if defined(LLAMA_DUO_CRC32C_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse4.2"))
+        {
+            return crc32c_kernel{ "sse4.2", crc32c_sse42 };
+        }
+#elif defined(LLAMA_DUO_CRC32C_ARM)
+        return crc32c_kernel{ "armv8", crc32c_armv8 };
+#endif
+        return crc32c_kernel{ "slice8", crc32c_slice8 };
+    }();
+    return kernel;
+}
+
+inline uint32_t crc32c(const void * data, size_t n)
+{
+    return ~crc32c_best_kernel().fn(~0u, static_cast<const uint8_t *>(data), n);
+}
+
+// Checksums of every prefix of a token sequence which grows at the end and
+// is sometimes cut back, like an approved candidate. The state after each
+// token is kept, so appending a token and asking for the checksum of any
+// prefix are both O(1); truncating drops states. prefix(n) equals
+// crc32c() over the bytes of the first n tokens.
+class prefix_crc
+{
+  public:
+    prefix_crc()
+        : states_(1, ~0u)
+        , fn_(crc32c_best_kernel().fn)
+    {
+    }
+
+    size_t size() const
+    {
+        return states_.size() - 1;
+    }
+
+    // n <= size()
+    uint32_t prefix(size_t n) const
+    {
+        return ~states_[n];
+    }
+
+    void push_back(llama_token token)
+    {
+        states_.push_back(fn_(states_.back(), reinterpret_cast<const uint8_t *>(&token), sizeof(token)));
+    }
+
+    template<typename iter_t>
+    void append(iter_t begin, iter_t end)
+    {
+        for (auto it = begin; it != end; ++it)
+        {
+            push_back(*it);
+        }
+    }
+
+    void truncate(size_t n)
+    {
+        states_.resize(std::min(n, size()) + 1);
+    }
+
+  private:
+    std::vector<uint32_t> states_;
+    crc32c_fn             fn_;
+};
+
+}
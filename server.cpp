@@ -0,0 +1,1098 @@
+#include "server.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <httplib.h>
+#include <json.hpp>
+
+#include "argmax.h"
+#include "draft_controller.h"
+#include "draft_scheduler.h"
+#include "draft_tree.h"
+#include "prefix_cache.h"
+#include "trace.h"
+
+namespace llama_duo
+{
+
+namespace
+{
+
+using json = nlohmann::json;
+using llama_tokens = std::vector<llama_token>;
+
+std::string llama3_instruct_fmt_msg(const json & j)
+{
+    std::ostringstream oss;
+    oss << "<|begin_of_text|><|start_header_id|>system<|end_header_id|>\n\n";
+    oss << j.value("system", "") << "<|eot_id|>\n";
+
+    for (const auto& msg: j["messages"])
+    {
+        oss
+            << "<|start_header_id|>"
+            << msg["role"].get<std::string>()
+            << "<|end_header_id|>\n\n"
+            << msg["content"].get<std::string>() << "<|eot_id|>";
+    }
+
+    oss << "<|start_header_id|>assistant<|end_header_id|>";
+    return oss.str();
+}
+
+// length of 'text' without an incomplete utf-8 sequence at its end; a token
+// piece can be part of a multi-byte character, the rest comes with the next
+size_t utf8_complete(const std::string & text)
+{
+    const size_t n = text.size();
+    for (size_t k = 1; k <= std::min<size_t>(n, 4); k++)
+    {
+        const unsigned char c = text[n - k];
+        if ((c & 0xC0) == 0x80)
+        {
+            continue;
+        }
+        const size_t len = (c & 0x80) == 0x00 ? 1 : (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 1;
+        return len > k ? n - k : n;
+    }
+    return n;
+}
+
+// invalid utf-8, if any, is replaced rather than thrown on
+std::string dump(const json & j)
+{
+    return j.dump(-1, ' ', false, json::error_handler_t::replace);
+}
+
+// one server-sent event
+bool send_event(httplib::DataSink & sink, const char * event, const json & data)
+{
+    std::string msg = event != nullptr ? std::string("event: ") + event + "\n" : "";
+    msg += "data: " + dump(data) + "\n\n";
+    return sink.write(msg.data(), msg.size());
+}
+
+draft_scheduler::policy_t sched_policy(const std::string & name)
+{
+    draft_scheduler::policy_t policy = draft_scheduler::OFF;
+    draft_scheduler::parse_policy(name, policy);
+    return policy;
+}
+
+// decodes tokens [from, to) into 'seq' without logits, n_batch at a time
+bool prefill(llama_context * ctx, prefix_cache & cache, llama_batch & batch, const llama_tokens & tokens, size_t from, size_t to, llama_seq_id seq)
+{
+    const size_t n_batch = llama_n_batch(ctx);
+    for (size_t i = from; i < to; i += n_batch)
+    {
+        trace_span span("prefill", "tokens", std::min(to - i, n_batch), "pos", i);
+        cache.make_room(std::min(to - i, n_batch));
+        llama_batch_clear(batch);
+        for (size_t j = i; j < std::min(to, i + n_batch); j++)
+        {
+            llama_batch_add(batch, tokens[j], j, { seq }, false);
+        }
+        if (llama_decode(ctx, batch) != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// One request in flight. A session is owned by whichever thread its state
+// says; the thread moves it to the next state under the server mutex.
+struct session
+{
+    enum state_t
+    {
+        FREE,      // slot not in use
+        NEW,       // waiting for the main model to prefill the prompt
+        PREFILL,   // prompt partly prefilled, waiting for the next chunk
+        DRAFT,     // waiting for drafts
+        DRAFTING,  // owned by the draft thread
+        VERIFY,    // drafts ready, waiting for the main model
+        VERIFYING, // owned by the main model thread
+        FINISHED   // result ready for the http handler
+    };
+
+    explicit session(llama_seq_id seq, size_t n_draft_min, size_t n_draft_max, size_t window)
+        : seq(seq)
+        , controller(n_draft_min, n_draft_max, window)
+    {
+    }
+
+    const llama_seq_id seq;
+    state_t            state = FREE;
+    uint64_t           id    = 0;    // changes with every new request
+
+    llama_tokens       tokens;       // prompt and everything accepted so far
+    size_t             n_prompt = 0;
+    size_t             n_max    = 0; // stop once tokens has this many
+    sampling_params    sp;
+    std::mt19937       rng;
+
+    // main model: tokens [0, n_past) are in its KV cache
+    size_t             n_past = 0;
+
+    // draft: d_tokens are in its KV cache, the first d_ok of them are
+    // known to be accepted. They belong to request d_id and, once it is
+    // over, go to the draft prefix cache unless d_archived.
+    llama_tokens            d_tokens;
+    size_t                  d_ok       = 0;
+    uint64_t                d_id       = 0;
+    bool                    d_archived = true;
+    llama_tokens            drafts;
+    std::vector<token_dist> draft_dists;
+    size_t                  n_wanted = 0;
+    draft_controller        controller;
+
+    // result
+    std::string        text;
+    std::string        error;
+    size_t             n_drafted  = 0;
+    size_t             n_accepted = 0;
+    int64_t            start_us   = 0;
+    int64_t            first_us   = 0; // first token accepted
+
+    // streaming: text accepted since the session last changed hands, moved
+    // to outbox when it does. The decode threads never wait for the client,
+    // a slow one gets everything since its last read in one event.
+    bool               stream = false;
+    std::string        unsent;
+    // guarded by the server mutex
+    std::string        outbox;
+    bool               cancelled = false; // the client went away
+};
+
+// what the http thread reports for a finished session
+struct outcome
+{
+    int          seq        = 0;
+    std::string  text;
+    std::string  error;
+    size_t       n_prompt   = 0;
+    size_t       n_tokens   = 0;
+    size_t       n_drafted  = 0;
+    size_t       n_accepted = 0;
+    double       dur_s      = 0.0;
+    double       ttft_ms    = 0.0;
+
+    json usage() const
+    {
+        return { { "prompt_tokens", n_prompt }, { "completion_tokens", n_tokens },
+                 { "drafted", n_drafted }, { "accepted", n_accepted } };
+    }
+};
+
+class duo_server
+{
+  public:
+    duo_server(
+        llama_model * model, llama_context * ctx,
+        llama_model * draft_model, llama_context * draft_ctx,
+        const gpt_params & params, const duo_params & dparams, const sampling_params & sparams,
+        const vocab_subset & draft_vocab, const core_set & draft_cores)
+        : model_(model)
+        , ctx_(ctx)
+        , draft_model_(draft_model)
+        , draft_ctx_(draft_ctx)
+        , params_(params)
+        , dparams_(dparams)
+        , sparams_(sparams)
+        , draft_vocab_(draft_vocab)
+        , draft_cores_(draft_cores)
+        , n_vocab_(llama_n_vocab(model))
+        , n_slots_(std::max(1, params.n_parallel - dparams.prefix_cache))
+        , n_ctx_slot_(llama_n_ctx(ctx) / n_slots_)
+        , target_argmax_(std::min<size_t>(4, std::max(1u, std::thread::hardware_concurrency())))
+        , draft_argmax_(1)
+        , sched_(sched_policy(dparams.draft_sched), dparams.draft_sched_duty, dparams.draft_sched_threads)
+        , target_cache_(ctx, n_slots_, dparams.prefix_cache)
+        , draft_cache_(draft_ctx, n_slots_, dparams.prefix_cache)
+    {
+        const size_t n_draft_min = dparams.draft_max > 0 ? dparams.draft_min : params.n_draft;
+        const size_t n_draft_max = dparams.draft_max > 0 ? dparams.draft_max : params.n_draft;
+        for (size_t i = 0; i < n_slots_; i++)
+        {
+            sessions_.emplace_back(new session(i, n_draft_min, n_draft_max, dparams.draft_window));
+        }
+    }
+
+    int run()
+    {
+        if (llama_n_batch(draft_ctx_) < sessions_.size())
+        {
+            fprintf(stderr, "draft batch size %u is smaller than the number of sessions %zu\n", llama_n_batch(draft_ctx_), sessions_.size());
+            return 1;
+        }
+
+        std::thread target_thread(&duo_server::target_loop, this);
+        std::thread draft_thread(&duo_server::draft_loop, this);
+
+        // sessions waiting for a free slot hold an http thread as well
+        const size_t n_http = params_.n_threads_http > 0 ? params_.n_threads_http : 2 * sessions_.size() + 2;
+        http_server_.new_task_queue = [n_http] { return new httplib::ThreadPool(n_http); };
+        http_server_.Post("/messages", [this](const httplib::Request & req, httplib::Response & res)
+        {
+            handle_messages(req, res);
+        });
+        http_server_.Get("/stats", [this](const httplib::Request &, httplib::Response & res)
+        {
+            res.set_content(stats().dump(), "application/json");
+        });
+        http_server_.Get("/trace", [](const httplib::Request &, httplib::Response & res)
+        {
+            res.set_content(trace_recorder::instance().take(), "application/json");
+        });
+        http_server_.Post("/trace", [](const httplib::Request & req, httplib::Response & res)
+        {
+            try
+            {
+                trace_recorder::instance().enable(json::parse(req.body).at("enabled").get<bool>());
+            }
+            catch (const std::exception & e)
+            {
+                res.status = 400;
+                res.set_content(dump(json({ { "error", e.what() } })), "application/json");
+                return;
+            }
+            res.set_content(json({ { "enabled", trace_recorder::instance().enabled() } }).dump(), "application/json");
+        });
+
+        fprintf(stderr, "listening on %s:%d, %zu sessions, %zu tokens of context each\n", params_.hostname.c_str(), params_.port, sessions_.size(), n_ctx_slot_);
+        const bool ok = http_server_.listen(params_.hostname, params_.port);
+        if (!ok)
+        {
+            fprintf(stderr, "unable to listen on %s:%d\n", params_.hostname.c_str(), params_.port);
+        }
+
+        {
+            std::lock_guard<std::mutex> _lock(mtx_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        target_thread.join();
+        draft_thread.join();
+        return ok ? 0 : 1;
+    }
+
+  private:
+    void handle_messages(const httplib::Request & req, httplib::Response & res)
+    {
+        json req_j;
+        llama_tokens prompt;
+        size_t n_predict = 0;
+        sampling_params sp = sparams_;
+        bool stream = false;
+        try
+        {
+            req_j  = json::parse(req.body);
+            prompt = llama_tokenize(model_, llama3_instruct_fmt_msg(req_j), false, true);
+            const int64_t max_tokens = req_j.value("max_tokens", static_cast<int64_t>(1024));
+            sp.temp  = req_j.value("temperature", sparams_.temp);
+            sp.top_k = req_j.value("top_k", sparams_.top_k);
+            sp.top_p = req_j.value("top_p", sparams_.top_p);
+            stream   = req_j.value("stream", false);
+            if (max_tokens < 1)
+            {
+                throw std::invalid_argument("max_tokens must be at least 1");
+            }
+            if (!(sp.temp >= 0.0f))
+            {
+                throw std::invalid_argument("temperature must not be negative");
+            }
+            if (!(sp.top_p > 0.0f && sp.top_p <= 1.0f))
+            {
+                throw std::invalid_argument("top_p must be in (0, 1]");
+            }
+            n_predict = static_cast<size_t>(max_tokens);
+        }
+        catch (const std::exception & e)
+        {
+            res.status = 400;
+            res.set_content(dump(json({ { "error", e.what() } })), "application/json");
+            return;
+        }
+
+        if (prompt.empty() || prompt.size() >= n_ctx_slot_)
+        {
+            res.status = 400;
+            res.set_content(dump(json({ { "error", "prompt does not fit into the context of a session" } })), "application/json");
+            return;
+        }
+
+        session * s = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            cv_.wait(lock, [&]()
+            {
+                s = free_session();
+                return s != nullptr || stop_;
+            });
+            if (s == nullptr)
+            {
+                res.status = 503;
+                return;
+            }
+            s->tokens      = prompt;
+            s->n_prompt    = prompt.size();
+            s->n_max       = std::min(prompt.size() + std::min(n_predict, n_ctx_slot_), n_ctx_slot_);
+            s->sp          = sp;
+            s->id          = ++n_sessions_started_;
+            s->rng.seed(params_.seed + s->id);
+            s->text.clear();
+            s->error.clear();
+            s->n_drafted   = 0;
+            s->n_accepted  = 0;
+            s->start_us    = ggml_time_us();
+            s->first_us    = 0;
+            s->stream      = stream;
+            s->unsent.clear();
+            s->outbox.clear();
+            s->cancelled   = false;
+            s->state       = session::NEW;
+        }
+        cv_.notify_all();
+
+        if (stream)
+        {
+            stream_session(s, res);
+            return;
+        }
+
+        outcome o;
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            cv_.wait(lock, [s]() { return s->state == session::FINISHED; });
+            o = release(s);
+        }
+        cv_.notify_all();
+        print_outcome(o);
+
+        if (!o.error.empty())
+        {
+            res.status = 500;
+            res.set_content(dump(json({ { "error", o.error } })), "application/json");
+            return;
+        }
+        json res_j = {
+            { "content", { { "text", o.text } } },
+            { "usage",   o.usage() }
+        };
+        res.set_content(dump(res_j), "application/json");
+    }
+
+    // Server-sent events: one 'data: {"text": ...}' per verification which
+    // accepted tokens, then 'event: done' with the usage or 'event: error'.
+    // Bytes of a character split across verifications wait for the rest.
+    // A client which disconnects cancels its session.
+    void stream_session(session * s, httplib::Response & res)
+    {
+        struct stream_state
+        {
+            std::string carry;
+            bool        released = false;
+        };
+        auto st = std::make_shared<stream_state>();
+
+        res.set_chunked_content_provider("text/event-stream",
+            [this, s, st](size_t, httplib::DataSink & sink)
+            {
+                std::string chunk;
+                bool finished = false;
+                {
+                    std::unique_lock<std::mutex> lock(mtx_);
+                    cv_.wait(lock, [s]() { return !s->outbox.empty() || s->state == session::FINISHED; });
+                    chunk.swap(s->outbox);
+                    finished = s->state == session::FINISHED;
+                }
+                st->carry += chunk;
+                const size_t n = finished ? st->carry.size() : utf8_complete(st->carry);
+                if (n > 0 && !send_event(sink, nullptr, json({ { "text", st->carry.substr(0, n) } })))
+                {
+                    return false;
+                }
+                st->carry.erase(0, n);
+                if (!finished)
+                {
+                    return true;
+                }
+
+                outcome o;
+                {
+                    std::lock_guard<std::mutex> _lock(mtx_);
+                    o = release(s);
+                    st->released = true;
+                }
+                cv_.notify_all();
+                print_outcome(o);
+                const bool ok = o.error.empty()
+                    ? send_event(sink, "done", json({ { "usage", o.usage() } }))
+                    : send_event(sink, "error", json({ { "error", o.error } }));
+                sink.done();
+                return ok;
+            },
+            [this, s, st](bool)
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                if (st->released)
+                {
+                    return;
+                }
+                s->cancelled = true;
+                cv_.notify_all();
+                cv_.wait(lock, [s]() { return s->state == session::FINISHED; });
+                release(s);
+                lock.unlock();
+                cv_.notify_all();
+                fprintf(stderr, "session %d: cancelled by the client\n", s->seq);
+            });
+    }
+
+    // caller holds the mutex, s is finished; frees the slot
+    outcome release(session * s)
+    {
+        outcome o;
+        o.seq        = s->seq;
+        o.text       = std::move(s->text);
+        o.error      = std::move(s->error);
+        o.n_prompt   = s->n_prompt;
+        o.n_tokens   = s->tokens.size() - s->n_prompt;
+        o.n_drafted  = s->n_drafted;
+        o.n_accepted = s->n_accepted;
+        o.dur_s      = 1.0e-6 * (ggml_time_us() - s->start_us);
+        o.ttft_ms    = s->first_us > 0 ? 1.0e-3 * (s->first_us - s->start_us) : 0.0;
+        s->state     = session::FREE;
+        return o;
+    }
+
+    static void print_outcome(const outcome & o)
+    {
+        fprintf(stderr, "session %d: prompt: %zu tokens: %zu tps: %.3f ttft: %.1f ms drafted: %zu accepted: %zu\n",
+            o.seq, o.n_prompt, o.n_tokens, o.n_tokens / o.dur_s, o.ttft_ms, o.n_drafted, o.n_accepted);
+    }
+
+    session * free_session()
+    {
+        for (auto & s : sessions_)
+        {
+            if (s->state == session::FREE)
+            {
+                return s.get();
+            }
+        }
+        return nullptr;
+    }
+
+    // moves every session in state 'from' to 'to', returns them
+    std::vector<session *> take(session::state_t from, session::state_t to)
+    {
+        std::vector<session *> res;
+        for (auto & s : sessions_)
+        {
+            if (s->state == from)
+            {
+                s->state = to;
+                res.push_back(s.get());
+            }
+        }
+        return res;
+    }
+
+    bool any(session::state_t state) const
+    {
+        for (const auto & s : sessions_)
+        {
+            if (s->state == state)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void set_state(const std::vector<session *> & ss, session::state_t state)
+    {
+        {
+            std::lock_guard<std::mutex> _lock(mtx_);
+            for (auto s : ss)
+            {
+                publish(s);
+                s->state = state;
+            }
+        }
+        cv_.notify_all();
+    }
+
+    // caller holds the mutex and owns s: new text goes to the http thread
+    static void publish(session * s)
+    {
+        if (s->stream && !s->unsent.empty())
+        {
+            s->outbox += s->unsent;
+            s->unsent.clear();
+        }
+    }
+
+    json stats()
+    {
+        std::lock_guard<std::mutex> _lock(mtx_);
+        return {
+            { "sessions_started",  n_sessions_started_ },
+            { "scheduler",         sched_.to_json() },
+            { "tokens_generated",  n_generated_ },
+            { "verify_decodes",    n_verify_decodes_ },
+            { "sessions_per_verify", n_verify_decodes_ > 0 ? 1.0 * n_verified_sessions_ / n_verify_decodes_ : 0.0 },
+            { "draft_decodes",     n_draft_decodes_ },
+            { "sessions_per_draft", n_draft_decodes_ > 0 ? 1.0 * n_drafted_sessions_ / n_draft_decodes_ : 0.0 },
+            { "prefix_cache", {
+                { "target", { { "hits", target_cache_.n_hits() }, { "misses", target_cache_.n_misses() }, { "tokens_reused", target_cache_.n_reused() } } },
+                { "draft",  { { "hits", draft_cache_.n_hits() },  { "misses", draft_cache_.n_misses() },  { "tokens_reused", draft_cache_.n_reused() } } }
+            } }
+        };
+    }
+
+    // main model: prefill new sessions, verify sessions with drafts ready.
+    // Every round prefills at most one chunk of prompt, oldest sessions
+    // first, so the others keep verifying while a long prompt comes in.
+    void target_loop()
+    {
+        trace_recorder::instance().name_thread("target");
+        llama_batch batch = llama_batch_init(llama_n_batch(ctx_), 0, 1);
+        const size_t n_batch = llama_n_batch(ctx_);
+        const size_t n_chunk = dparams_.prefill_chunk > 0 ? std::min<size_t>(dparams_.prefill_chunk, n_batch) : n_batch;
+        dist_builder builder;
+
+        while (true)
+        {
+            std::vector<session *> fresh, prefilling, work;
+            size_t n_cancelled = 0;
+            {
+                trace_span span("wait");
+                std::unique_lock<std::mutex> lock(mtx_);
+                cv_.wait(lock, [this]() { return stop_ || any(session::NEW) || any(session::PREFILL) || any(session::VERIFY); });
+                if (stop_)
+                {
+                    break;
+                }
+                // as many sessions as fit into one batch, the rest waits for the next one
+                size_t n_tokens = 0;
+                for (auto & s : sessions_)
+                {
+                    const bool waiting = s->state == session::NEW || s->state == session::PREFILL || s->state == session::VERIFY;
+                    if (waiting && s->cancelled)
+                    {
+                        s->error = "cancelled";
+                        s->state = session::FINISHED;
+                        n_cancelled++;
+                    }
+                    else if (s->state == session::NEW || s->state == session::PREFILL)
+                    {
+                        (s->state == session::NEW ? fresh : prefilling).push_back(s.get());
+                        s->state = session::VERIFYING;
+                    }
+                    else if (s->state == session::VERIFY && n_tokens + 1 + s->drafts.size() <= n_batch)
+                    {
+                        n_tokens += 1 + s->drafts.size();
+                        s->state = session::VERIFYING;
+                        work.push_back(s.get());
+                    }
+                }
+            }
+
+            if (n_cancelled > 0)
+            {
+                cv_.notify_all();
+            }
+
+            for (auto s : fresh)
+            {
+                s->n_past = target_cache_.restore(s->tokens, s->tokens.size() - 1, s->seq);
+                prefilling.push_back(s);
+            }
+            std::sort(prefilling.begin(), prefilling.end(), [](const session * a, const session * b) { return a->id < b->id; });
+
+            // the newest token is decoded with the drafts, not here
+            std::vector<session *> ready, partial;
+            size_t n_budget = n_chunk;
+            for (auto s : prefilling)
+            {
+                const size_t n = std::min(n_budget, s->tokens.size() - 1 - s->n_past);
+                target_decode_scope sched(&sched_);
+                if (!prefill(ctx_, target_cache_, batch, s->tokens, s->n_past, s->n_past + n, s->seq))
+                {
+                    finish(s, "llama_decode() failed during prefill");
+                    continue;
+                }
+                sched.end();
+                s->n_past += n;
+                n_budget  -= n;
+                if (s->n_past + 1 < s->tokens.size())
+                {
+                    partial.push_back(s);
+                    continue;
+                }
+                target_cache_.insert(s->tokens, s->n_past, s->seq);
+                ready.push_back(s);
+            }
+            set_state(ready, session::DRAFT);
+            set_state(partial, session::PREFILL);
+
+            if (work.empty())
+            {
+                continue;
+            }
+
+            llama_batch_clear(batch);
+            std::vector<int32_t> first_row;
+            for (auto s : work)
+            {
+                first_row.push_back(batch.n_tokens);
+                llama_batch_add(batch, s->tokens.back(), s->n_past, { s->seq }, true);
+                for (size_t i = 0; i < s->drafts.size(); i++)
+                {
+                    llama_batch_add(batch, s->drafts[i], s->n_past + 1 + i, { s->seq }, true);
+                }
+            }
+            target_cache_.make_room(batch.n_tokens);
+            const int64_t start_us = ggml_time_us();
+            trace_span decode_span("decode", "tokens", batch.n_tokens, "sessions", work.size());
+            target_decode_scope sched(&sched_);
+            if (llama_decode(ctx_, batch) != 0)
+            {
+                for (auto s : work)
+                {
+                    finish(s, "llama_decode() failed");
+                }
+                continue;
+            }
+            sched.end();
+            decode_span.end();
+            for (auto s : work)
+            {
+                s->controller.report_target_time(ggml_time_us() - start_us);
+            }
+
+            std::vector<const float *> rows;
+            for (int32_t i = 0; i < batch.n_tokens; i++)
+            {
+                rows.push_back(llama_get_logits_ith(ctx_, i));
+            }
+            // greedy sessions are verified together, each up to its first
+            // rejected draft
+            std::vector<greedy_candidate<llama_token>> cands(work.size());
+            size_t n_reduced = 0;
+            for (size_t k = 0; k < work.size(); k++)
+            {
+                if (work[k]->sp.greedy())
+                {
+                    cands[k].rows.assign(rows.begin() + first_row[k], rows.begin() + first_row[k] + 1 + work[k]->drafts.size());
+                    cands[k].drafts = work[k]->drafts;
+                }
+            }
+            {
+                trace_span span("argmax", "rows", rows.size());
+                greedy_verify(target_argmax_, n_vocab_, cands);
+                for (const auto & c : cands)
+                {
+                    n_reduced += c.preds.size();
+                }
+                span.set(1, "reduced", n_reduced);
+            }
+
+            trace_span reconcile("reconcile", "sessions", work.size());
+            std::vector<session *> next;
+            size_t n_new = 0;
+            for (size_t k = 0; k < work.size(); k++)
+            {
+                if (accept(work[k], cands[k].preds.data(), rows.data() + first_row[k], builder, n_new))
+                {
+                    next.push_back(work[k]);
+                }
+            }
+
+            {
+                std::lock_guard<std::mutex> _lock(mtx_);
+                n_verify_decodes_++;
+                n_verified_sessions_ += work.size();
+                n_generated_ += n_new;
+            }
+            reconcile.set(1, "accepted", n_new);
+            reconcile.end();
+            set_state(next, session::DRAFT);
+        }
+
+        llama_batch_free(batch);
+    }
+
+    // applies the verdict for one session, false if it is finished and
+    // handed back to the http thread
+    bool accept(session * s, const llama_token * preds, const float * const * rows, dist_builder & builder, size_t & n_new)
+    {
+        const size_t n_drafts = s->drafts.size();
+        llama_tokens new_tokens;
+        size_t n_match = 0;
+        if (s->sp.greedy())
+        {
+            while (n_match < n_drafts && preds[n_match] == s->drafts[n_match])
+            {
+                n_match++;
+            }
+            new_tokens.assign(s->drafts.begin(), s->drafts.begin() + n_match);
+            new_tokens.push_back(preds[n_match]);
+        }
+        else
+        {
+            llama_token next = -1;
+            while (n_match < n_drafts)
+            {
+                auto p   = builder.build(rows[n_match], n_vocab_, s->sp);
+                auto res = verify_draft(p, s->draft_dists[n_match], s->drafts[n_match], s->rng);
+                if (!res.accepted)
+                {
+                    next = res.token;
+                    break;
+                }
+                n_match++;
+            }
+            if (n_match == n_drafts)
+            {
+                next = sample(builder.build(rows[n_match], n_vocab_, s->sp), s->rng);
+            }
+            new_tokens.assign(s->drafts.begin(), s->drafts.begin() + n_match);
+            new_tokens.push_back(next);
+        }
+        s->n_drafted  += n_drafts;
+        s->n_accepted += n_match;
+        s->controller.report_verification(n_drafts, n_match);
+
+        bool eog = false;
+        for (size_t i = 0; i < new_tokens.size(); i++)
+        {
+            if (llama_token_is_eog(model_, new_tokens[i]))
+            {
+                eog = true;
+                new_tokens.resize(i);
+                break;
+            }
+        }
+        if (s->tokens.size() + new_tokens.size() > s->n_max)
+        {
+            new_tokens.resize(s->n_max - s->tokens.size());
+        }
+
+        // keep the KV cache up to, not including, the newest token
+        s->n_past += n_match + 1;
+        llama_kv_cache_seq_rm(ctx_, s->seq, s->n_past, -1);
+        if (s->first_us == 0 && !new_tokens.empty())
+        {
+            s->first_us = ggml_time_us();
+        }
+        for (auto t : new_tokens)
+        {
+            const std::string piece = llama_token_to_piece(ctx_, t);
+            s->text += piece;
+            if (s->stream)
+            {
+                s->unsent += piece;
+            }
+        }
+        s->tokens.insert(s->tokens.end(), new_tokens.begin(), new_tokens.end());
+        n_new += new_tokens.size();
+
+        if (eog || s->tokens.size() >= s->n_max)
+        {
+            // the next turn of this conversation starts with all of it
+            target_cache_.insert(s->tokens, std::min(s->n_past, s->tokens.size()), s->seq);
+            finish(s, "");
+            return false;
+        }
+        return true;
+    }
+
+    void finish(session * s, const std::string & error)
+    {
+        {
+            std::lock_guard<std::mutex> _lock(mtx_);
+            publish(s);
+            s->error = error;
+            s->state = session::FINISHED;
+        }
+        cv_.notify_all();
+    }
+
+    // draft: one decode per draft position for all sessions waiting for drafts.
+    // Like the main model, every round prefills at most one chunk of prompt;
+    // a session whose prompt is not in yet is verified without drafts.
+    void draft_loop()
+    {
+        trace_recorder::instance().name_thread("draft");
+        pin_thread(draft_cores_);
+        llama_batch batch = llama_batch_init(llama_n_batch(draft_ctx_), 0, 1);
+        const size_t n_batch_target = llama_n_batch(ctx_);
+        const size_t n_batch = llama_n_batch(draft_ctx_);
+        const size_t n_chunk = dparams_.prefill_chunk > 0 ? std::min<size_t>(dparams_.prefill_chunk, n_batch) : n_batch;
+        dist_builder builder;
+        draft_head head(draft_vocab_, n_vocab_);
+
+        while (true)
+        {
+            std::vector<session *> work, idle;
+            {
+                trace_span span("wait");
+                std::unique_lock<std::mutex> lock(mtx_);
+                auto collect_idle = [this, &idle]()
+                {
+                    idle.clear();
+                    for (auto & s : sessions_)
+                    {
+                        if ((s->state == session::FREE || s->state == session::FINISHED) && !s->d_archived)
+                        {
+                            idle.push_back(s.get());
+                        }
+                    }
+                    return !idle.empty();
+                };
+                cv_.wait(lock, [&]() { return stop_ || any(session::DRAFT) || collect_idle(); });
+                if (stop_)
+                {
+                    break;
+                }
+                work = take(session::DRAFT, session::DRAFTING);
+            }
+
+            // finished sessions: keep what they drafted on for later ones
+            for (auto s : idle)
+            {
+                archive(s);
+            }
+
+            // sessions which are generating already catch up first
+            std::sort(work.begin(), work.end(), [](const session * a, const session * b) { return a->id < b->id; });
+            std::vector<session *> active;
+            size_t n_budget = n_chunk;
+            for (auto s : work)
+            {
+                s->drafts.clear();
+                s->draft_dists.clear();
+                // a verification never yields more than drafts + 1 tokens
+                s->n_wanted = std::min({ s->controller.next_length(), s->n_max - s->tokens.size() - 1, n_batch_target - 1 });
+                if (s->n_wanted > 0 && sync(s, batch, n_budget))
+                {
+                    active.push_back(s);
+                }
+            }
+
+            const int64_t start_us = ggml_time_us();
+            size_t n_steps = 0;
+            while (!active.empty())
+            {
+                draft_cache_.make_room(active.size());
+                llama_batch_clear(batch);
+                for (auto s : active)
+                {
+                    const llama_token t = s->drafts.empty() ? s->tokens.back() : s->drafts.back();
+                    llama_batch_add(batch, t, s->d_tokens.size(), { s->seq }, true);
+                    s->d_tokens.push_back(t);
+                }
+                trace_span decode_span("decode", "tokens", batch.n_tokens, "sessions", active.size());
+                draft_decode_scope sched(&sched_, draft_ctx_);
+                if (llama_decode(draft_ctx_, batch) != 0)
+                {
+                    // go with what we have, the KV cache is resynced next round
+                    for (auto s : active)
+                    {
+                        s->d_tokens.pop_back();
+                    }
+                    break;
+                }
+                sched.end();
+                decode_span.end();
+                n_steps++;
+
+                // argmax only for the rows that are drafted from greedily
+                std::vector<const float *> rows, greedy_rows;
+                std::vector<size_t> greedy_idx(active.size(), 0);
+                for (int32_t i = 0; i < batch.n_tokens; i++)
+                {
+                    rows.push_back(head.row(llama_get_logits_ith(draft_ctx_, i), i));
+                    if (active[i]->sp.greedy() && dparams_.draft_p_min <= 0.0f)
+                    {
+                        greedy_idx[i] = greedy_rows.size();
+                        greedy_rows.push_back(rows.back());
+                    }
+                }
+                std::vector<llama_token> preds(greedy_rows.size());
+                {
+                    trace_span span("argmax", "rows", greedy_rows.size());
+                    draft_argmax_.run(greedy_rows, head.n_cols(), preds.data());
+                }
+
+                std::vector<session *> still;
+                for (size_t k = 0; k < active.size(); k++)
+                {
+                    session * s = active[k];
+                    float p_top = 1.0f;
+                    if (!s->sp.greedy())
+                    {
+                        s->draft_dists.push_back(builder.build(rows[k], head.n_cols(), s->sp));
+                        head.to_tokens(s->draft_dists.back().ids);
+                        s->drafts.push_back(sample(s->draft_dists.back(), s->rng));
+                        p_top = *std::max_element(s->draft_dists.back().p.begin(), s->draft_dists.back().p.end());
+                    }
+                    else if (dparams_.draft_p_min > 0.0f)
+                    {
+                        const auto top = top_tokens(rows[k], head.n_cols(), 1)[0];
+                        s->drafts.push_back(head.token(top.token));
+                        p_top = top.p;
+                    }
+                    else
+                    {
+                        s->drafts.push_back(head.token(preds[greedy_idx[k]]));
+                    }
+                    if (p_top < dparams_.draft_p_min)
+                    {
+                        s->controller.report_early_stop();
+                        continue;
+                    }
+                    if (s->drafts.size() < s->n_wanted && !llama_token_is_eog(draft_model_, s->drafts.back()))
+                    {
+                        still.push_back(s);
+                    }
+                }
+                active.swap(still);
+
+                std::lock_guard<std::mutex> _lock(mtx_);
+                n_draft_decodes_++;
+                n_drafted_sessions_ += batch.n_tokens;
+            }
+            // every session waited for all batched steps
+            for (auto s : work)
+            {
+                s->controller.report_draft_time(ggml_time_us() - start_us, n_steps);
+            }
+
+            set_state(work, session::VERIFY);
+        }
+
+        llama_batch_free(batch);
+    }
+
+    // brings the draft KV cache of a session to tokens[0, size - 1), or as far
+    // as n_budget more tokens of prefill get it; true once it is there
+    bool sync(session * s, llama_batch & batch, size_t & n_budget)
+    {
+        const bool fresh = s->d_id != s->id;
+        if (fresh)
+        {
+            if (!s->d_archived)
+            {
+                archive(s);
+            }
+            const size_t n_cached = draft_cache_.restore(s->tokens, s->tokens.size() - 1, s->seq);
+            s->d_tokens.assign(s->tokens.begin(), s->tokens.begin() + n_cached);
+            s->d_ok       = n_cached;
+            s->d_id       = s->id;
+            s->d_archived = false;
+        }
+
+        size_t n_common = std::min(s->d_ok, s->d_tokens.size());
+        while (n_common < s->d_tokens.size() && n_common + 1 < s->tokens.size() && s->d_tokens[n_common] == s->tokens[n_common])
+        {
+            n_common++;
+        }
+        llama_kv_cache_seq_rm(draft_ctx_, s->seq, n_common, -1);
+        s->d_tokens.resize(n_common);
+        const size_t n_to = std::min(s->tokens.size() - 1, n_common + n_budget);
+        draft_decode_scope sched(n_to > n_common ? &sched_ : nullptr, draft_ctx_);
+        if (!prefill(draft_ctx_, draft_cache_, batch, s->tokens, n_common, n_to, s->seq))
+        {
+            s->d_tokens.clear();
+            s->d_ok = 0;
+            return false;
+        }
+        sched.end();
+        n_budget -= n_to - n_common;
+        s->d_tokens.assign(s->tokens.begin(), s->tokens.begin() + n_to);
+        s->d_ok = n_to;
+        // the prompt is in, keep it for sessions with the same one
+        if (n_common + 1 < s->n_prompt && n_to + 1 >= s->n_prompt)
+        {
+            draft_cache_.insert(s->d_tokens, s->d_ok, s->seq);
+        }
+        return n_to + 1 == s->tokens.size();
+    }
+
+    void archive(session * s)
+    {
+        draft_cache_.insert(s->d_tokens, s->d_ok, s->seq);
+        s->d_archived = true;
+    }
+
+    llama_model   * model_;
+    llama_context * ctx_;
+    llama_model   * draft_model_;
+    llama_context * draft_ctx_;
+
+    const gpt_params      params_;
+    const duo_params      dparams_;
+    const sampling_params sparams_;
+    const vocab_subset &  draft_vocab_;
+    const core_set        draft_cores_; // the main model's threads run where serve() was called
+    const int32_t         n_vocab_;
+    const size_t          n_slots_;
+    const size_t          n_ctx_slot_;
+
+    argmax_pool target_argmax_;
+    argmax_pool draft_argmax_;
+
+    draft_scheduler sched_;
+
+    // owned by the main model and the draft thread respectively
+    prefix_cache target_cache_;
+    prefix_cache draft_cache_;
+
+    std::vector<std::unique_ptr<session>> sessions_;
+    std::mutex              mtx_;
+    std::condition_variable cv_;
+    bool                    stop_ = false;
+
+    size_t n_sessions_started_  = 0;
+    size_t n_generated_         = 0;
+    size_t n_verify_decodes_    = 0;
+    size_t n_verified_sessions_ = 0;
+    size_t n_draft_decodes_     = 0;
+    size_t n_drafted_sessions_  = 0;
+
+    httplib::Server http_server_;
+};
+
+}
+
+int serve(
+    llama_model   * model,
+    llama_context * ctx,
+    llama_model   * draft_model,
+    llama_context * draft_ctx,
+    const gpt_params & params,
+    const duo_params & dparams,
+    const sampling_params & sparams,
+    const vocab_subset & draft_vocab,
+    const core_set & draft_cores)
+{
+    duo_server server(model, ctx, draft_model, draft_ctx, params, dparams, sparams, draft_vocab, draft_cores);
+    return server.run();
+}
+
+}
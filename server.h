@@ -0,0 +1,37 @@
+#pragma once
+
+#include <common.h>
+#include <llama.h>
+
+#include "cpu_topology.h"
+#include "options.h"
+#include "spec_sampling.h"
+#include "vocab_subset.h"
+
+namespace llama_duo
+{
+
+// Serves /messages (same request format as _deprecated/lead.cpp) with
+// continuous batching. Every session in flight owns a seq_id in both the
+// main and the draft context, -np sessions at most; other requests wait
+// for a free slot. The draft thread drafts for all sessions waiting for
+// drafts with one batched decode per draft position, the main model
+// verifies all sessions with drafts ready in a single decode. Prompts are
+// prefilled one --prefill-chunk at a time between those decodes. Requests
+// with "stream": true get the reply as server-sent events, one per
+// verification. GET /trace returns the timeline recorded since the last
+// call, POST /trace {"enabled": bool} switches recording. Blocks until the
+// http server stops. The draft thread runs on draft_cores, if any, and
+// drafts from draft_vocab unless it is empty.
+int serve(
+    llama_model   * model,
+    llama_context * ctx,
+    llama_model   * draft_model,
+    llama_context * draft_ctx,
+    const gpt_params & params,
+    const duo_params & dparams,
+    const sampling_params & sparams,
+    const vocab_subset & draft_vocab,
+    const core_set & draft_cores);
+
+}
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include <llama.h>
+
+namespace llama_duo
+{
+
+// Stochastic speculative sampling.
+//
+// Both models turn logits into a distribution with the same temperature /
+// top-k / top-p settings. The draft samples x ~ q, the target accepts it with
+// probability min(1, p(x) / q(x)) and on rejection resamples from
+// norm(max(0, p - q)). Every emitted token is distributed exactly as if it
+// was sampled from the target's p, no matter how bad the draft is.
+
+struct sampling_params
+{
+    float   temp  = 0.0f; // <= 0 is greedy
+    int32_t top_k = 0;    // <= 0 keeps the whole vocab
+    float   top_p = 1.0f; // >= 1 disables nucleus filtering
+
+    bool greedy() const
+    {
+        return temp <= 0.0f;
+    }
+};
+
+// distribution after temperature / top-k / top-p.
+// sparse, sorted by token id, probabilities sum to 1.
+struct token_dist
+{
+    std::vector<llama_token> ids;
+    std::vector<float>       p;
+
+    bool empty() const
+    {
+        return ids.empty();
+    }
+
+    float prob(llama_token id) const
+    {
+        auto it = std::lower_bound(ids.begin(), ids.end(), id);
+        if (it == ids.end() || *it != id)
+        {
+            return 0.0f;
+        }
+        return p[it - ids.begin()];
+    }
+};
+
+// keeps scratch buffers around, one per thread
+class dist_builder
+{
+  public:
+    token_dist build(const float * logits, int32_t n_vocab, const sampling_params & sp)
+    {
+        cand_.resize(n_vocab);
+        for (int32_t i = 0; i < n_vocab; i++)
+        {
+            cand_[i] = { logits[i], i };
+        }
+
+        auto by_logit = [](const std::pair<float, llama_token> & a, const std::pair<float, llama_token> & b)
+        {
+            return a.first > b.first || (a.first == b.first && a.second < b.second);
+        };
+
+        size_t n = cand_.size();
+        if (sp.top_k > 0 && static_cast<size_t>(sp.top_k) < n)
+        {
+            n = sp.top_k;
+            std::nth_element(cand_.begin(), cand_.begin() + n - 1, cand_.end(), by_logit);
+        }
+        std::sort(cand_.begin(), cand_.begin() + n, by_logit);
+
+        const float max_logit = cand_[0].first;
+        float sum = 0.0f;
+        for (size_t i = 0; i < n; i++)
+        {
+            cand_[i].first = std::exp((cand_[i].first - max_logit) / sp.temp);
+            sum += cand_[i].first;
+        }
+
+        if (sp.top_p < 1.0f)
+        {
+            float cum = 0.0f;
+            for (size_t i = 0; i < n; i++)
+            {
+                cum += cand_[i].first;
+                if (cum >= sp.top_p * sum)
+                {
+                    n   = i + 1;
+                    sum = cum;
+                    break;
+                }
+            }
+        }
+
+        std::sort(cand_.begin(), cand_.begin() + n, [](const std::pair<float, llama_token> & a, const std::pair<float, llama_token> & b)
+        {
+            return a.second < b.second;
+        });
+
+        token_dist res;
+        res.ids.resize(n);
+        res.p.resize(n);
+        for (size_t i = 0; i < n; i++)
+        {
+            res.ids[i] = cand_[i].second;
+            res.p[i]   = cand_[i].first / sum;
+        }
+        return res;
+    }
+
+  private:
+    std::vector<std::pair<float, llama_token>> cand_;
+};
+
+inline float uniform01(std::mt19937 & rng)
+{
+    return std::uniform_real_distribution<float>(0.0f, 1.0f)(rng);
+}
+
+// picks index i with probability w[i] / sum(w)
+inline size_t sample_weighted(const std::vector<float> & w, float sum, std::mt19937 & rng)
+{
+    float u = uniform01(rng) * sum;
+    for (size_t i = 0; i < w.size(); i++)
+    {
+        u -= w[i];
+        if (u < 0.0f)
+        {
+            return i;
+        }
+    }
+    // rounding: fall back to the last token with non-zero weight
+    for (size_t i = w.size(); i > 0; i--)
+    {
+        if (w[i - 1] > 0.0f)
+        {
+            return i - 1;
+        }
+    }
+    return 0;
+}
+
+inline llama_token sample(const token_dist & d, std::mt19937 & rng)
+{
+    return d.ids[sample_weighted(d.p, 1.0f, rng)];
+}
+
+struct verify_result
+{
+    llama_token token;
+    bool        accepted;
+};
+
+// acceptance test for draft token x sampled from q, given target's p
+inline verify_result verify_draft(const token_dist & p, const token_dist & q, llama_token x, std::mt19937 & rng)
+{
+    const float px = p.prob(x);
+    const float qx = q.prob(x);
+    if (qx > 0.0f && uniform01(rng) * qx < px)
+    {
+        return { x, true };
+    }
+
+    // residual max(0, p - q); both are sorted by id, so walk them together
+    std::vector<float> residual(p.ids.size());
+    float  sum = 0.0f;
+    size_t j   = 0;
+    for (size_t i = 0; i < p.ids.size(); i++)
+    {
+        while (j < q.ids.size() && q.ids[j] < p.ids[i])
+        {
+            j++;
+        }
+        const float qi = (j < q.ids.size() && q.ids[j] == p.ids[i]) ? q.p[j] : 0.0f;
+        residual[i] = std::max(0.0f, p.p[i] - qi);
+        sum += residual[i];
+    }
+
+    if (sum <= 0.0f)
+    {
+        // p == q up to rounding, rejection was a rounding artifact as well
+        return { sample(p, rng), false };
+    }
+    return { p.ids[sample_weighted(residual, sum, rng)], false };
+}
+
+}
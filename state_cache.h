@@ -0,0 +1,382 @@
+#pragma once
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <sys/utime.h>
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+
+#include <llama.h>
+
+namespace llama_duo
+{
+
+// Prompt states of one model kept on disk between runs.
+//
+// A blob holds the tokens it was computed for and the seq state of the
+// context after decoding them (llama_state_seq_get_data). Files are named
+// after a hash of the model identity and of the tokens, so the same prompt
+// is stored once and blobs of other models are never looked at. A new
+// prompt restores the blob sharing the longest prefix with it; cells past
+// the shared prefix are dropped, so a cached prompt with the same system
+// preamble is useful as well. Blobs are memory-mapped and handed to llama.cpp
+// straight from the mapping, pages are read as the state is copied in.
+//
+// Files are written to a temporary name and renamed, concurrent runs
+// sharing a directory see either a complete blob or none. A restore touches
+// the blob it used; once a model has more than max_blobs, save() removes the
+// ones touched longest ago.
+class state_cache
+{
+  public:
+    struct stats
+    {
+        size_t   n_restored   = 0; // prompt tokens which were not prefilled
+        uint64_t bytes_loaded = 0;
+        uint64_t bytes_saved  = 0;
+        int64_t  load_us      = 0;
+    };
+
+    // max_blobs == 0 keeps every blob
+    state_cache(const std::string & dir, const std::string & model_path, llama_model * model, size_t max_blobs)
+        : dir_(dir)
+        , model_id_(model_identity(model_path, model))
+        , max_blobs_(max_blobs)
+    {
+    }
+
+    const stats & get_stats() const
+    {
+        return stats_;
+    }
+
+    // replaces seq 0 of ctx with the longest stored prefix of tokens[0, n_max),
+    // returns its length
+    size_t restore(llama_context * ctx, const std::vector<llama_token> & tokens, size_t n_max)
+    {
+        llama_kv_cache_seq_rm(ctx, 0, -1, -1);
+
+        std::string best_path;
+        size_t n_best = 0;
+        for (const std::string & name : list())
+        {
+            std::vector<llama_token> stored;
+            if (!read_tokens(dir_ + "/" + name, stored))
+            {
+                continue;
+            }
+            size_t n = 0;
+            while (n < n_max && n < stored.size() && stored[n] == tokens[n])
+            {
+                n++;
+            }
+            if (n > n_best)
+            {
+                n_best    = n;
+                best_path = dir_ + "/" + name;
+            }
+        }
+        if (n_best == 0)
+        {
+            return 0;
+        }
+
+        const int64_t start_us = ggml_time_us();
+        mapped_file file(best_path);
+        header h;
+        if (file.size() < sizeof(h))
+        {
+            return 0;
+        }
+        memcpy(&h, file.data(), sizeof(h));
+        const uint64_t n_body = file.size() - sizeof(h);
+        if (h.n_tokens > n_body / sizeof(llama_token)
+            || h.state_size > n_body - h.n_tokens * sizeof(llama_token)
+            || llama_state_seq_set_data(ctx, file.data() + sizeof(h) + h.n_tokens * sizeof(llama_token), h.state_size, 0) == 0)
+        {
+            fprintf(stderr, "state cache: could not restore %s\n", best_path.c_str());
+            llama_kv_cache_seq_rm(ctx, 0, -1, -1);
+            return 0;
+        }
+        llama_kv_cache_seq_rm(ctx, 0, n_best, -1);
+        utime(best_path.c_str(), nullptr);
+
+        stats_.n_restored    = n_best;
+        stats_.bytes_loaded += h.state_size;
+        stats_.load_us      += ggml_time_us() - start_us;
+        return n_best;
+    }
+
+    // stores seq 0 of ctx, which holds exactly 'tokens'
+    bool save(llama_context * ctx, const std::vector<llama_token> & tokens)
+    {
+        header h;
+        h.model_id   = model_id_;
+        h.n_tokens   = tokens.size();
+        h.state_size = llama_state_seq_get_size(ctx, 0);
+        std::vector<uint8_t> state(h.state_size);
+        h.state_size = llama_state_seq_get_data(ctx, state.data(), state.size(), 0);
+
+        const std::string path = dir_ + "/" + file_name(tokens);
+        const std::string tmp  = path + ".tmp" + std::to_string(ggml_time_us());
+        FILE * f = fopen(tmp.c_str(), "wb");
+        if (f == nullptr)
+        {
+            fprintf(stderr, "state cache: could not write %s\n", tmp.c_str());
+            return false;
+        }
+        bool ok = fwrite(&h, sizeof(h), 1, f) == 1
+            && fwrite(tokens.data(), sizeof(llama_token), tokens.size(), f) == tokens.size()
+            && fwrite(state.data(), 1, h.state_size, f) == h.state_size;
+        ok = fclose(f) == 0 && ok;
+        if (ok)
+        {
+            remove(path.c_str());
+            ok = rename(tmp.c_str(), path.c_str()) == 0;
+        }
+        if (!ok)
+        {
+            fprintf(stderr, "state cache: could not write %s\n", path.c_str());
+            remove(tmp.c_str());
+            return false;
+        }
+        stats_.bytes_saved += h.state_size;
+        evict();
+        return true;
+    }
+
+  private:
+    struct header
+    {
+        char     magic[4] = { 'D', 'U', 'O', 'S' };
+        uint32_t version  = 1;
+        uint64_t model_id = 0;
+        uint64_t n_tokens = 0;
+        uint64_t state_size = 0;
+    };
+
+    // read-only view of a whole file, memory-mapped where we can
+    class mapped_file
+    {
+      public:
+        explicit mapped_file(const std::string & path)
+        {
+#ifdef _WIN32
+            FILE * f = fopen(path.c_str(), "rb");
+            if (f != nullptr)
+            {
+                fseek(f, 0, SEEK_END);
+                buf_.resize(ftell(f));
+                fseek(f, 0, SEEK_SET);
+                if (fread(buf_.data(), 1, buf_.size(), f) != buf_.size())
+                {
+                    buf_.clear();
+                }
+                fclose(f);
+            }
+            data_ = buf_.data();
+            size_ = buf_.size();
+#else
+            const int fd = open(path.c_str(), O_RDONLY);
+            struct stat st;
+            if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0)
+            {
+                void * p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+                if (p != MAP_FAILED)
+                {
+                    // the state is copied front to back, once
+                    posix_madvise(p, st.st_size, POSIX_MADV_SEQUENTIAL);
+                    data_ = static_cast<const uint8_t *>(p);
+                    size_ = st.st_size;
+                }
+            }
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+#endif
+        }
+
+        ~mapped_file()
+        {
+#ifndef _WIN32
+            if (data_ != nullptr)
+            {
+                munmap(const_cast<uint8_t *>(data_), size_);
+            }
+#endif
+        }
+
+        mapped_file(const mapped_file &) = delete;
+        mapped_file & operator=(const mapped_file &) = delete;
+
+        const uint8_t * data() const
+        {
+            return data_;
+        }
+
+        size_t size() const
+        {
+            return size_;
+        }
+
+      private:
+        const uint8_t * data_ = nullptr;
+        size_t          size_ = 0;
+#ifdef _WIN32
+        std::vector<uint8_t> buf_;
+#endif
+    };
+
+    static uint64_t fnv1a(uint64_t h, const void * data, size_t size)
+    {
+        const uint8_t * p = static_cast<const uint8_t *>(data);
+        for (size_t i = 0; i < size; i++)
+        {
+            h = (h ^ p[i]) * 1099511628211ull;
+        }
+        return h;
+    }
+
+    // the file as seen by the filesystem plus what llama.cpp made of it
+    static uint64_t model_identity(const std::string & path, llama_model * model)
+    {
+        uint64_t h = 14695981039346656037ull;
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0)
+        {
+            const int64_t fields[] = { static_cast<int64_t>(st.st_size), static_cast<int64_t>(st.st_mtime) };
+            h = fnv1a(h, fields, sizeof(fields));
+        }
+        char desc[256];
+        const int32_t n = llama_model_desc(model, desc, sizeof(desc));
+        h = fnv1a(h, desc, std::max(0, std::min<int32_t>(n, sizeof(desc) - 1)));
+        const uint64_t sizes[] = { llama_model_size(model), llama_model_n_params(model) };
+        return fnv1a(h, sizes, sizeof(sizes));
+    }
+
+    std::string prefix() const
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%016" PRIx64 "-", model_id_);
+        return buf;
+    }
+
+    std::string file_name(const std::vector<llama_token> & tokens) const
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%016" PRIx64, fnv1a(14695981039346656037ull, tokens.data(), tokens.size() * sizeof(llama_token)));
+        return prefix() + buf + ".state";
+    }
+
+    // blobs of this model
+    std::vector<std::string> list() const
+    {
+        const std::string p = prefix();
+        const std::string suffix = ".state";
+        std::vector<std::string> res;
+        auto consider = [&](const std::string & name)
+        {
+            if (name.size() > p.size() + suffix.size() && name.compare(0, p.size(), p) == 0
+                && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0)
+            {
+                res.push_back(name);
+            }
+        };
+#ifdef _WIN32
+        WIN32_FIND_DATAA fd;
+        HANDLE h = FindFirstFileA((dir_ + "/" + p + "*").c_str(), &fd);
+        if (h != INVALID_HANDLE_VALUE)
+        {
+            do
+            {
+                consider(fd.cFileName);
+            } while (FindNextFileA(h, &fd));
+            FindClose(h);
+        }
+#else
+        DIR * d = opendir(dir_.c_str());
+        if (d != nullptr)
+        {
+            while (struct dirent * e = readdir(d))
+            {
+                consider(e->d_name);
+            }
+            closedir(d);
+        }
+#endif
+        return res;
+    }
+
+    // drops the least recently used blobs of this model beyond max_blobs_
+    void evict() const
+    {
+        std::vector<std::string> names = list();
+        if (max_blobs_ == 0 || names.size() <= max_blobs_)
+        {
+            return;
+        }
+        std::vector<std::pair<time_t, std::string>> by_age;
+        for (const std::string & name : names)
+        {
+            struct stat st;
+            const std::string path = dir_ + "/" + name;
+            if (stat(path.c_str(), &st) == 0)
+            {
+                by_age.emplace_back(st.st_mtime, path);
+            }
+        }
+        std::sort(by_age.begin(), by_age.end());
+        for (size_t i = 0; i + max_blobs_ < by_age.size(); i++)
+        {
+            remove(by_age[i].second.c_str());
+        }
+    }
+
+    bool read_tokens(const std::string & path, std::vector<llama_token> & tokens) const
+    {
+        FILE * f = fopen(path.c_str(), "rb");
+        if (f == nullptr)
+        {
+            return false;
+        }
+        struct stat st;
+        header h;
+        const header expected;
+        bool ok = fstat(fileno(f), &st) == 0
+            && fread(&h, sizeof(h), 1, f) == 1
+            && memcmp(h.magic, expected.magic, sizeof(h.magic)) == 0
+            && h.version == expected.version
+            && h.model_id == model_id_
+            && h.n_tokens <= (static_cast<uint64_t>(st.st_size) - sizeof(h)) / sizeof(llama_token);
+        if (ok)
+        {
+            tokens.resize(h.n_tokens);
+            ok = fread(tokens.data(), sizeof(llama_token), tokens.size(), f) == tokens.size();
+        }
+        fclose(f);
+        return ok;
+    }
+
+    const std::string dir_;
+    const uint64_t    model_id_;
+    const size_t      max_blobs_;
+    stats             stats_;
+};
+
+}
@@ -0,0 +1,547 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <llama.h>
+
+namespace llama_duo
+{
+
+// Array of trivially copyable elements backed by a file and memory-mapped
+// read-write, so whatever is stored survives the process. Grows by doubling
+// the file. On Windows the array lives on the heap and is written back by
+// sync().
+template<typename T>
+class mapped_array
+{
+  public:
+    mapped_array() = default;
+    mapped_array(const mapped_array &) = delete;
+    mapped_array & operator=(const mapped_array &) = delete;
+
+    ~mapped_array()
+    {
+        unmap();
+#ifndef _WIN32
+        if (fd_ >= 0)
+        {
+            ::close(fd_);
+        }
+#endif
+    }
+
+    // maps the file at path, creating it if needed, with room for n elements at least
+    bool open(const std::string & path, size_t n)
+    {
+        path_ = path;
+#ifdef _WIN32
+        FILE * f = fopen(path.c_str(), "rb");
+        if (f != nullptr)
+        {
+            fseek(f, 0, SEEK_END);
+            buf_.resize(ftell(f) / sizeof(T));
+            fseek(f, 0, SEEK_SET);
+            const bool ok = fread(buf_.data(), sizeof(T), buf_.size(), f) == buf_.size();
+            fclose(f);
+            if (!ok)
+            {
+                return false;
+            }
+        }
+        return reserve(n);
+#else
+        fd_ = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        struct stat st;
+        if (fd_ < 0 || fstat(fd_, &st) != 0)
+        {
+            return false;
+        }
+        return map(st.st_size / sizeof(T)) && reserve(n);
+#endif
+    }
+
+    T & operator[](size_t i)
+    {
+        return data_[i];
+    }
+
+    const T & operator[](size_t i) const
+    {
+        return data_[i];
+    }
+
+    size_t capacity() const
+    {
+        return capacity_;
+    }
+
+    // elements are only valid up to what the caller wrote, new ones are zero
+    bool reserve(size_t n)
+    {
+        if (n <= capacity_)
+        {
+            return true;
+        }
+        const size_t cap = std::max<size_t>({ n, 2 * capacity_, 4096 / sizeof(T) });
+#ifdef _WIN32
+        buf_.resize(cap);
+        data_     = buf_.data();
+        capacity_ = cap;
+        return true;
+#else
+        unmap();
+        return ftruncate(fd_, cap * sizeof(T)) == 0 && map(cap);
+#endif
+    }
+
+    // zeroes [0, capacity)
+    void clear()
+    {
+        memset(static_cast<void *>(data_), 0, capacity_ * sizeof(T));
+    }
+
+    bool sync()
+    {
+#ifdef _WIN32
+        FILE * f = fopen(path_.c_str(), "wb");
+        if (f == nullptr)
+        {
+            return false;
+        }
+        const bool ok = fwrite(buf_.data(), sizeof(T), buf_.size(), f) == buf_.size();
+        return fclose(f) == 0 && ok;
+#else
+        return data_ == nullptr || msync(data_, capacity_ * sizeof(T), MS_SYNC) == 0;
+#endif
+    }
+
+  private:
+#ifdef _WIN32
+    void unmap()
+    {
+    }
+#else
+    bool map(size_t n)
+    {
+        if (n == 0)
+        {
+            return true;
+        }
+        void * p = mmap(nullptr, n * sizeof(T), PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (p == MAP_FAILED)
+        {
+            return false;
+        }
+        data_     = static_cast<T *>(p);
+        capacity_ = n;
+        return true;
+    }
+
+    void unmap()
+    {
+        if (data_ != nullptr)
+        {
+            munmap(data_, capacity_ * sizeof(T));
+            data_     = nullptr;
+            capacity_ = 0;
+        }
+    }
+
+    int fd_ = -1;
+#endif
+
+    std::string path_;
+    T *         data_     = nullptr;
+    size_t      capacity_ = 0;
+#ifdef _WIN32
+    std::vector<T> buf_;
+#endif
+};
+
+// Retrieval drafting: a suffix automaton over everything generated before,
+// kept on disk and extended online as tokens are verified.
+//
+// Every state of the automaton is a set of substrings that end at the same
+// places in the corpus. Each outgoing edge counts how often the state's
+// substrings were followed by its token, and every state knows its most
+// frequent edge, so a draft is the longest suffix of the context found in
+// the corpus followed by the most frequent continuation, token by token.
+//
+// Nodes, edges and a hash table of edges by (state, token) are arrays in
+// three files under one directory; the counts go in a small metadata file
+// written when the index is closed. An index without it, left by a run that
+// did not close it, is started over. One process uses a directory at a time.
+class suffix_index
+{
+  public:
+    // ends one generation in the corpus, drafts never cross it
+    static const llama_token kSeparator = -1;
+
+    suffix_index() = default;
+    suffix_index(const suffix_index &) = delete;
+    suffix_index & operator=(const suffix_index &) = delete;
+
+    ~suffix_index()
+    {
+        close();
+    }
+
+    bool open(const std::string & dir)
+    {
+#ifndef _WIN32
+        lock_fd_ = ::open((dir + "/index.lock").c_str(), O_RDWR | O_CREAT, 0644);
+        if (lock_fd_ < 0 || flock(lock_fd_, LOCK_EX | LOCK_NB) != 0)
+        {
+            fprintf(stderr, "suffix index: %s is missing or in use by another process\n", dir.c_str());
+            return false;
+        }
+#endif
+        meta_path_ = dir + "/index.meta";
+        FILE * f = fopen(meta_path_.c_str(), "rb");
+        meta m;
+        const bool clean = f != nullptr && fread(&m, sizeof(m), 1, f) == 1 && memcmp(m.magic, "DUOX", 4) == 0 && m.version == meta().version;
+        if (f != nullptr)
+        {
+            fclose(f);
+        }
+        if (!nodes_.open(dir + "/index.nodes", 2) || !edges_.open(dir + "/index.edges", 1) || !table_.open(dir + "/index.table", 1024))
+        {
+            fprintf(stderr, "suffix index: could not map the files in %s\n", dir.c_str());
+            return false;
+        }
+        // from here on the files change, an unclean exit leaves no metadata
+        remove(meta_path_.c_str());
+        if (clean && m.n_nodes <= nodes_.capacity() && m.n_edges <= edges_.capacity() && m.table_size == table_.capacity())
+        {
+            m_ = m;
+        }
+        else
+        {
+            m_ = meta();
+            m_.table_size = table_.capacity();
+            nodes_[0] = node();
+            table_.clear();
+        }
+        open_ = true;
+        return true;
+    }
+
+    void close()
+    {
+        if (!open_)
+        {
+            return;
+        }
+        open_ = false;
+        const std::string tmp = meta_path_ + ".tmp";
+        FILE * f = nodes_.sync() && edges_.sync() && table_.sync() ? fopen(tmp.c_str(), "wb") : nullptr;
+        bool ok = f != nullptr && fwrite(&m_, sizeof(m_), 1, f) == 1;
+        ok = f != nullptr && fclose(f) == 0 && ok && rename(tmp.c_str(), meta_path_.c_str()) == 0;
+        if (!ok)
+        {
+            fprintf(stderr, "suffix index: could not write %s\n", meta_path_.c_str());
+        }
+#ifndef _WIN32
+        if (lock_fd_ >= 0)
+        {
+            ::close(lock_fd_);
+            lock_fd_ = -1;
+        }
+#endif
+    }
+
+    bool is_open() const
+    {
+        return open_;
+    }
+
+    uint64_t n_tokens() const
+    {
+        return m_.n_tokens;
+    }
+
+    // appends one token to the corpus, false if the files could not grow
+    bool append(llama_token c)
+    {
+        // room for everything this adds first, nothing is left half done
+        size_t   n_new = 0;
+        uint32_t p = m_.last;
+        uint32_t e = kNone;
+        while (p != kNone && (e = find(p, c)) == kNone)
+        {
+            n_new++;
+            p = nodes_[p].link;
+        }
+        if (p != kNone && nodes_[p].len + 1 != nodes_[edges_[e].to].len)
+        {
+            for (uint32_t i = nodes_[edges_[e].to].first_edge; i != kNone; i = edges_[i].next)
+            {
+                n_new++;
+            }
+        }
+        if (!nodes_.reserve(m_.n_nodes + 2) || !edges_.reserve(m_.n_edges + n_new) || !ensure_table(m_.n_edges + n_new))
+        {
+            return false;
+        }
+
+        const uint32_t cur = add_node(nodes_[m_.last].len + 1);
+        p = m_.last;
+        e = kNone;
+        // states on the suffix chain without a c edge get one to cur
+        while (p != kNone && (e = find(p, c)) == kNone)
+        {
+            add_edge(p, c, cur, 1);
+            p = nodes_[p].link;
+        }
+        if (p == kNone)
+        {
+            nodes_[cur].link = 0;
+        }
+        else
+        {
+            const uint32_t q = edges_[e].to;
+            if (nodes_[p].len + 1 == nodes_[q].len)
+            {
+                nodes_[cur].link = q;
+            }
+            else
+            {
+                // q also holds longer substrings that did not end here, split
+                // off the short ones; they were followed by the same tokens
+                const uint32_t clone = add_node(nodes_[p].len + 1);
+                nodes_[clone].link = nodes_[q].link;
+                for (uint32_t i = nodes_[q].first_edge; i != kNone; i = edges_[i].next)
+                {
+                    const uint32_t copy = add_edge(clone, edges_[i].token, edges_[i].to, edges_[i].count);
+                    if (nodes_[q].best_edge == i)
+                    {
+                        nodes_[clone].best_edge = copy;
+                    }
+                }
+                for (uint32_t r = p; r != kNone; r = nodes_[r].link)
+                {
+                    const uint32_t re = find(r, c);
+                    if (re == kNone || edges_[re].to != q)
+                    {
+                        break;
+                    }
+                    edges_[re].to = clone;
+                }
+                nodes_[q].link   = clone;
+                nodes_[cur].link = clone;
+            }
+            // the rest of the chain was followed by c once more. Long chains
+            // come from long repeats; their short suffixes stop counting
+            // after kCountDepth states, the long matches drafts use do count.
+            size_t depth = 0;
+            for (uint32_t r = p; r != kNone && depth < kCountDepth; r = nodes_[r].link, depth++)
+            {
+                const uint32_t re = find(r, c);
+                edges_[re].count++;
+                uint32_t & best = nodes_[r].best_edge;
+                if (best == kNone || edges_[re].count > edges_[best].count)
+                {
+                    best = re;
+                }
+            }
+        }
+        m_.last = cur;
+        m_.n_tokens++;
+        return true;
+    }
+
+    // up to n_draft tokens that most often followed the longest suffix of
+    // context found in the corpus, nothing if it is shorter than n_min
+    void draft(const std::vector<llama_token> & context, size_t n_min, size_t n_draft, std::vector<llama_token> & out) const
+    {
+        out.clear();
+        if (!open_)
+        {
+            return;
+        }
+        uint32_t s = 0;
+        size_t   n = 0;
+        for (size_t i = context.size() > kMaxMatch ? context.size() - kMaxMatch : 0; i < context.size(); i++)
+        {
+            uint32_t e = kNone;
+            while (s != 0 && (e = find(s, context[i])) == kNone)
+            {
+                s = nodes_[s].link;
+                n = nodes_[s].len;
+            }
+            if (e == kNone)
+            {
+                e = find(s, context[i]);
+            }
+            if (e != kNone)
+            {
+                s = edges_[e].to;
+                n++;
+            }
+            else
+            {
+                n = 0;
+            }
+        }
+        // the newest text has nothing after it yet, a shorter suffix may
+        while (s != 0 && nodes_[s].best_edge == kNone)
+        {
+            s = nodes_[s].link;
+            n = nodes_[s].len;
+        }
+        if (s == 0 || n < n_min)
+        {
+            return;
+        }
+        while (out.size() < n_draft && nodes_[s].best_edge != kNone)
+        {
+            const edge & e = edges_[nodes_[s].best_edge];
+            if (e.token == kSeparator)
+            {
+                break;
+            }
+            out.push_back(e.token);
+            s = e.to;
+        }
+    }
+
+  private:
+    static const uint32_t kNone       = UINT32_MAX;
+    static const size_t   kMaxMatch   = 64;
+    static const size_t   kCountDepth = 128;
+
+    struct node
+    {
+        uint32_t len        = 0;
+        uint32_t link       = kNone;
+        uint32_t first_edge = kNone;
+        uint32_t best_edge  = kNone;
+    };
+
+    struct edge
+    {
+        uint32_t    from;
+        llama_token token;
+        uint32_t    to;
+        uint32_t    count;
+        uint32_t    next; // next edge of the same node
+    };
+
+    struct meta
+    {
+        char     magic[4]   = { 'D', 'U', 'O', 'X' };
+        uint32_t version    = 1;
+        uint64_t n_tokens   = 0;
+        uint32_t n_nodes    = 1; // the root
+        uint32_t n_edges    = 0;
+        uint32_t last       = 0;
+        uint32_t padding    = 0;
+        uint64_t table_size = 0;
+    };
+
+    uint32_t add_node(uint32_t len)
+    {
+        node & n = nodes_[m_.n_nodes];
+        n = node();
+        n.len = len;
+        return m_.n_nodes++;
+    }
+
+    uint32_t add_edge(uint32_t from, llama_token token, uint32_t to, uint32_t count)
+    {
+        const uint32_t i = m_.n_edges++;
+        edges_[i] = { from, token, to, count, nodes_[from].first_edge };
+        nodes_[from].first_edge = i;
+        if (nodes_[from].best_edge == kNone || count > edges_[nodes_[from].best_edge].count)
+        {
+            nodes_[from].best_edge = i;
+        }
+        insert(i);
+        return i;
+    }
+
+    size_t slot(uint32_t from, llama_token token) const
+    {
+        const uint64_t key = (static_cast<uint64_t>(from) << 32) | static_cast<uint32_t>(token);
+        return (key * 0x9E3779B97F4A7C15ull) >> 17 & (m_.table_size - 1);
+    }
+
+    // table entries are edge index + 1, 0 is empty
+    uint32_t find(uint32_t from, llama_token token) const
+    {
+        for (size_t i = slot(from, token); ; i = (i + 1) & (m_.table_size - 1))
+        {
+            const uint32_t v = table_[i];
+            if (v == 0)
+            {
+                return kNone;
+            }
+            if (edges_[v - 1].from == from && edges_[v - 1].token == token)
+            {
+                return v - 1;
+            }
+        }
+    }
+
+    void insert(uint32_t e)
+    {
+        size_t i = slot(edges_[e].from, edges_[e].token);
+        while (table_[i] != 0)
+        {
+            i = (i + 1) & (m_.table_size - 1);
+        }
+        table_[i] = e + 1;
+    }
+
+    // keeps the table at most half full for n_edges edges
+    bool ensure_table(size_t n_edges)
+    {
+        if (2 * n_edges <= m_.table_size)
+        {
+            return true;
+        }
+        size_t size = m_.table_size;
+        while (2 * n_edges > size)
+        {
+            size *= 2;
+        }
+        if (!table_.reserve(size) || table_.capacity() != size)
+        {
+            return false;
+        }
+        m_.table_size = size;
+        table_.clear();
+        for (uint32_t e = 0; e < m_.n_edges; e++)
+        {
+            insert(e);
+        }
+        return true;
+    }
+
+    mapped_array<node>     nodes_;
+    mapped_array<edge>     edges_;
+    mapped_array<uint32_t> table_;
+    meta                   m_;
+    std::string            meta_path_;
+    bool                   open_ = false;
+#ifndef _WIN32
+    int                    lock_fd_ = -1;
+#endif
+};
+
+}
@@ -0,0 +1,240 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <llama.h>
+
+#include "spec_sampling.h"
+
+namespace llama_duo
+{
+
+// Candidate sequence shared by the drafter and the main model.
+//
+// Tokens [0, n_verified) are confirmed by the main model and never change,
+// so readers only ever copy what is after the point they have already
+// verified. The drafter appends one token at a time; the main model
+// records each verdict with commit(), which extends n_verified and, if it
+// disagrees with drafted tokens, truncates the log and starts a new epoch.
+//
+// Readers are lock-free: appends only publish a new size, truncation is
+// wrapped in a seqlock and readers retry if one happened while they were
+// copying. Writers are serialized by a mutex, held for the length of one
+// append or one verdict. Storage is allocated once, so handoff cost does not
+// depend on how long the context is.
+class token_log
+{
+  public:
+    struct view
+    {
+        uint64_t epoch;
+        size_t   n_verified;
+        size_t   size;
+    };
+
+    // with_dists keeps a draft distribution per token, for speculative sampling
+    token_log(size_t capacity, bool with_dists)
+        : capacity_(capacity)
+        , tokens_(new std::atomic<llama_token>[capacity])
+    {
+        if (with_dists)
+        {
+            dists_.resize(capacity);
+        }
+    }
+
+    size_t capacity() const
+    {
+        return capacity_;
+    }
+
+    view state() const
+    {
+        while (true)
+        {
+            const uint64_t s = seq_.load(std::memory_order_acquire);
+            if (s & 1)
+            {
+                continue;
+            }
+            view v = load_view();
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seq_.load(std::memory_order_relaxed) == s)
+            {
+                return v;
+            }
+        }
+    }
+
+    size_t size() const
+    {
+        return size_.load(std::memory_order_acquire);
+    }
+
+    // copies tokens [from, size) into 'out'. 'from' should not be past
+    // n_verified of an earlier view, otherwise the result may be empty.
+    view read(size_t from, std::vector<llama_token> & out) const
+    {
+        while (true)
+        {
+            const uint64_t s = seq_.load(std::memory_order_acquire);
+            if (s & 1)
+            {
+                continue;
+            }
+            view v = load_view();
+            out.clear();
+            for (size_t i = from; i < v.size; i++)
+            {
+                out.push_back(tokens_[i].load(std::memory_order_relaxed));
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seq_.load(std::memory_order_relaxed) == s)
+            {
+                return v;
+            }
+        }
+    }
+
+    // draft distribution of token i. Only the thread calling commit() may
+    // read it, for i below a size it has observed.
+    const token_dist & dist(size_t i) const
+    {
+        return dists_[i];
+    }
+
+    // drafter: adds the token at position 'pos' unless the log has moved on
+    // since the drafter last synced with it
+    bool append(uint64_t epoch, size_t pos, llama_token token, token_dist dist = token_dist())
+    {
+        std::lock_guard<std::mutex> _lock(write_mtx_);
+        const size_t n = size_.load(std::memory_order_relaxed);
+        if (epoch_.load(std::memory_order_relaxed) != epoch || pos != n || n >= capacity_)
+        {
+            return false;
+        }
+        tokens_[n].store(token, std::memory_order_relaxed);
+        if (!dists_.empty())
+        {
+            dists_[n] = std::move(dist);
+        }
+        size_.store(n + 1, std::memory_order_release);
+        return true;
+    }
+
+    // main model: tokens [pos, pos + tokens.size()) are what it produced and
+    // [0, n_verified) is now confirmed. Drafts that agree are kept, including
+    // any after these; the first disagreement truncates the log there and
+    // bumps the epoch. Returns false if the tokens do not fit.
+    bool commit(size_t pos, const std::vector<llama_token> & tokens, size_t n_verified)
+    {
+        std::lock_guard<std::mutex> _lock(write_mtx_);
+        if (pos + tokens.size() > capacity_)
+        {
+            return false;
+        }
+        const size_t n = size_.load(std::memory_order_relaxed);
+        size_t n_match = 0;
+        while (n_match < tokens.size() && pos + n_match < n
+            && tokens_[pos + n_match].load(std::memory_order_relaxed) == tokens[n_match])
+        {
+            n_match++;
+        }
+
+        if (n_match == tokens.size())
+        {
+            n_verified_.store(n_verified, std::memory_order_release);
+            return true;
+        }
+
+        const uint64_t s = seq_.load(std::memory_order_relaxed);
+        seq_.store(s + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        for (size_t i = n_match; i < tokens.size(); i++)
+        {
+            tokens_[pos + i].store(tokens[i], std::memory_order_relaxed);
+            if (!dists_.empty())
+            {
+                dists_[pos + i] = token_dist();
+            }
+        }
+        size_.store(pos + tokens.size(), std::memory_order_relaxed);
+        n_verified_.store(n_verified, std::memory_order_relaxed);
+        if (pos + n_match < n)
+        {
+            epoch_.store(epoch_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+
+        seq_.store(s + 2, std::memory_order_release);
+        return true;
+    }
+
+    // main model: drafts from 'pos' on become 'tokens', for drafts which
+    // come from elsewhere than append(). The epoch changes if any drafts
+    // are dropped or differ.
+    void replace(size_t pos, const std::vector<llama_token> & tokens, const std::vector<token_dist> & dists)
+    {
+        std::lock_guard<std::mutex> _lock(write_mtx_);
+        const size_t n = size_.load(std::memory_order_relaxed);
+        const size_t n_tokens = std::min(tokens.size(), capacity_ - std::min(pos, capacity_));
+        size_t n_match = 0;
+        while (n_match < n_tokens && pos + n_match < n
+            && tokens_[pos + n_match].load(std::memory_order_relaxed) == tokens[n_match])
+        {
+            n_match++;
+        }
+        if (n_match == n_tokens && pos + n_match == n)
+        {
+            return;
+        }
+
+        const uint64_t s = seq_.load(std::memory_order_relaxed);
+        seq_.store(s + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        for (size_t i = n_match; i < n_tokens; i++)
+        {
+            tokens_[pos + i].store(tokens[i], std::memory_order_relaxed);
+            if (!dists_.empty())
+            {
+                dists_[pos + i] = i < dists.size() ? dists[i] : token_dist();
+            }
+        }
+        size_.store(pos + n_tokens, std::memory_order_relaxed);
+        if (pos + n_match < n)
+        {
+            epoch_.store(epoch_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+
+        seq_.store(s + 2, std::memory_order_release);
+    }
+
+  private:
+    view load_view() const
+    {
+        view v;
+        v.epoch      = epoch_.load(std::memory_order_relaxed);
+        v.n_verified = n_verified_.load(std::memory_order_relaxed);
+        v.size       = size_.load(std::memory_order_acquire);
+        return v;
+    }
+
+    const size_t capacity_;
+    std::unique_ptr<std::atomic<llama_token>[]> tokens_;
+    std::vector<token_dist> dists_;
+
+    std::atomic<uint64_t> seq_{0};
+    std::atomic<uint64_t> epoch_{0};
+    std::atomic<size_t>   n_verified_{0};
+    std::atomic<size_t>   size_{0};
+
+    std::mutex write_mtx_;
+};
+
+}
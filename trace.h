@@ -0,0 +1,281 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace llama_duo
+{
+
+// Timeline of what each thread is doing, as Chrome trace JSON (loads in
+// chrome://tracing and ui.perfetto.dev).
+//
+// Every thread records into a ring buffer of its own, so recording takes no
+// lock: a span is a handful of relaxed stores and one release store of the
+// ring head. Slots are atomics, a reader copies what is in the ring and
+// drops the slots the writer has reused meanwhile. A full ring overwrites
+// its oldest spans, and the ring of a thread that has exited goes to the
+// next thread that records, so memory stays bounded by the number of
+// threads recording at once, however many come and go. When off, a span
+// costs one relaxed load and a thread gets no ring at all.
+//
+// Names and argument keys must be string literals (or otherwise outlive the
+// recorder), only the pointers are stored.
+class trace_recorder
+{
+  public:
+    static const size_t kEventsPerThread = 1 << 14;
+
+    static trace_recorder & instance()
+    {
+        static trace_recorder recorder;
+        return recorder;
+    }
+
+    bool enabled() const
+    {
+        return enabled_.load(std::memory_order_relaxed);
+    }
+
+    void enable(bool on)
+    {
+        enabled_.store(on, std::memory_order_relaxed);
+    }
+
+    static int64_t now_us()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // names the calling thread's track; with recording off the ring is only
+    // created, with the name, once the thread records
+    void name_thread(const char * name)
+    {
+        thread_name() = name;
+        if (!enabled())
+        {
+            return;
+        }
+        ring & r = local();
+        std::lock_guard<std::mutex> _lock(mtx_);
+        r.name = name;
+    }
+
+    void record(const char * name, int64_t start_us, int64_t end_us, const char * key0, int64_t val0, const char * key1, int64_t val1)
+    {
+        ring & r = local();
+        const uint64_t h = r.head.load(std::memory_order_relaxed);
+        slot & s = r.slots[h % kEventsPerThread];
+        s.name.store(name, std::memory_order_relaxed);
+        s.start_us.store(start_us, std::memory_order_relaxed);
+        s.dur_us.store(end_us - start_us, std::memory_order_relaxed);
+        s.key[0].store(key0, std::memory_order_relaxed);
+        s.key[1].store(key1, std::memory_order_relaxed);
+        s.val[0].store(val0, std::memory_order_relaxed);
+        s.val[1].store(val1, std::memory_order_relaxed);
+        r.head.store(h + 1, std::memory_order_release);
+    }
+
+    // spans recorded since the last take(), as a Chrome trace JSON document
+    std::string take()
+    {
+        std::lock_guard<std::mutex> _lock(mtx_);
+        std::string res = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        bool first = true;
+        char buf[512];
+        for (size_t tid = 0; tid < rings_.size(); tid++)
+        {
+            ring & r = *rings_[tid];
+            snprintf(buf, sizeof(buf), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",", tid, r.name != nullptr ? r.name : "thread");
+            res += buf;
+            first = false;
+
+            const uint64_t head = r.head.load(std::memory_order_acquire);
+            const uint64_t from = std::max(r.n_taken, head > kEventsPerThread ? head - kEventsPerThread : 0);
+            std::vector<event> events;
+            events.reserve(head - from);
+            for (uint64_t i = from; i < head; i++)
+            {
+                const slot & s = r.slots[i % kEventsPerThread];
+                events.push_back({ s.name.load(std::memory_order_relaxed), s.start_us.load(std::memory_order_relaxed), s.dur_us.load(std::memory_order_relaxed),
+                                   { s.key[0].load(std::memory_order_relaxed), s.key[1].load(std::memory_order_relaxed) },
+                                   { s.val[0].load(std::memory_order_relaxed), s.val[1].load(std::memory_order_relaxed) } });
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            // slots below this may have been reused while we were copying
+            const uint64_t head_now = r.head.load(std::memory_order_relaxed);
+            const uint64_t valid = head_now > kEventsPerThread ? head_now - kEventsPerThread : 0;
+            for (uint64_t i = std::max(from, valid); i < head; i++)
+            {
+                const event & e = events[i - from];
+                snprintf(buf, sizeof(buf), ",{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%lld,\"dur\":%lld,\"args\":{",
+                    e.name, tid, static_cast<long long>(e.start_us - origin_us_), static_cast<long long>(e.dur_us));
+                res += buf;
+                for (int k = 0; k < 2 && e.key[k] != nullptr; k++)
+                {
+                    snprintf(buf, sizeof(buf), "%s\"%s\":%lld", k > 0 ? "," : "", e.key[k], static_cast<long long>(e.val[k]));
+                    res += buf;
+                }
+                res += "}}";
+            }
+            r.n_taken = head;
+        }
+        return res + "]}\n";
+    }
+
+    bool write(const std::string & path)
+    {
+        const std::string doc = take();
+        FILE * f = fopen(path.c_str(), "wb");
+        if (f == nullptr)
+        {
+            return false;
+        }
+        const bool ok = fwrite(doc.data(), 1, doc.size(), f) == doc.size();
+        return fclose(f) == 0 && ok;
+    }
+
+  private:
+    struct slot
+    {
+        std::atomic<const char *> name;
+        std::atomic<int64_t>      start_us;
+        std::atomic<int64_t>      dur_us;
+        std::atomic<const char *> key[2];
+        std::atomic<int64_t>      val[2];
+    };
+
+    struct event
+    {
+        const char * name;
+        int64_t      start_us;
+        int64_t      dur_us;
+        const char * key[2];
+        int64_t      val[2];
+    };
+
+    struct ring
+    {
+        std::unique_ptr<slot[]> slots { new slot[kEventsPerThread] };
+        std::atomic<uint64_t>   head { 0 };
+        // guarded by mtx_
+        const char * name    = nullptr;
+        uint64_t     n_taken = 0;
+        bool         in_use  = true;
+    };
+
+    // gives the ring back when its thread exits
+    struct ring_owner
+    {
+        trace_recorder * recorder = nullptr;
+        ring *           r        = nullptr;
+
+        ~ring_owner()
+        {
+            if (r != nullptr)
+            {
+                std::lock_guard<std::mutex> _lock(recorder->mtx_);
+                r->in_use = false;
+            }
+        }
+    };
+
+    trace_recorder()
+        : origin_us_(now_us())
+    {
+    }
+
+    static const char *& thread_name()
+    {
+        thread_local const char * name = nullptr;
+        return name;
+    }
+
+    // Rings live as long as the recorder. A new thread takes over the ring
+    // of one that has exited, preferably one whose spans were all taken;
+    // spans still in it end up on the new thread's track.
+    ring & local()
+    {
+        thread_local ring_owner owner;
+        if (owner.r == nullptr)
+        {
+            std::lock_guard<std::mutex> _lock(mtx_);
+            ring * reuse = nullptr;
+            for (auto & r : rings_)
+            {
+                if (!r->in_use && (reuse == nullptr || r->n_taken == r->head.load(std::memory_order_relaxed)))
+                {
+                    reuse = r.get();
+                }
+            }
+            if (reuse == nullptr)
+            {
+                rings_.emplace_back(new ring());
+                reuse = rings_.back().get();
+            }
+            reuse->in_use = true;
+            reuse->name   = thread_name();
+            owner.recorder = this;
+            owner.r        = reuse;
+        }
+        return *owner.r;
+    }
+
+    std::atomic<bool> enabled_ { false };
+    const int64_t     origin_us_;
+    std::mutex        mtx_;
+    std::vector<std::unique_ptr<ring>> rings_;
+};
+
+// Records the time from construction to destruction as one span, with up to
+// two integer arguments that can be set until then.
+class trace_span
+{
+  public:
+    explicit trace_span(const char * name, const char * key0 = nullptr, int64_t val0 = 0, const char * key1 = nullptr, int64_t val1 = 0)
+        : name_(name)
+        , start_us_(trace_recorder::instance().enabled() ? trace_recorder::now_us() : -1)
+        , key_ { key0, key1 }
+        , val_ { val0, val1 }
+    {
+    }
+
+    trace_span(const trace_span &) = delete;
+    trace_span & operator=(const trace_span &) = delete;
+
+    ~trace_span()
+    {
+        end();
+    }
+
+    // ends the span before the end of its scope
+    void end()
+    {
+        if (start_us_ >= 0)
+        {
+            trace_recorder::instance().record(name_, start_us_, trace_recorder::now_us(), key_[0], val_[0], key_[1], val_[1]);
+            start_us_ = -1;
+        }
+    }
+
+    void set(int k, const char * key, int64_t val)
+    {
+        key_[k] = key;
+        val_[k] = val;
+    }
+
+  private:
+    const char * name_;
+    int64_t      start_us_;
+    const char * key_[2];
+    int64_t      val_[2];
+};
+
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <llama.h>
+
+namespace llama_duo
+{
+
+// Tokens the drafter may draft, the most frequent ones of a sample text.
+// Everything the drafter does with a logits row, argmax, top-k, softmax and
+// sampling, then only looks at these columns instead of the whole vocab.
+// The main model still picks from all of it, so the output does not change;
+// a token it picks outside the set is fed to the drafter like any other,
+// it just never comes out of a draft.
+//
+// Stored as a sidecar text file, one token id per line, most frequent first.
+class vocab_subset
+{
+  public:
+    // the n most frequent of tokens, with 'always' on top of them
+    static std::vector<llama_token> most_frequent(const std::vector<llama_token> & tokens, int32_t n_vocab, size_t n, const std::vector<llama_token> & always)
+    {
+        std::vector<std::pair<size_t, llama_token>> counts(n_vocab);
+        for (int32_t i = 0; i < n_vocab; i++)
+        {
+            counts[i] = { 0, i };
+        }
+        for (llama_token t : tokens)
+        {
+            if (t >= 0 && t < n_vocab)
+            {
+                counts[t].first++;
+            }
+        }
+        std::stable_sort(counts.begin(), counts.end(), [](const std::pair<size_t, llama_token> & a, const std::pair<size_t, llama_token> & b)
+        {
+            return a.first > b.first;
+        });
+
+        std::vector<llama_token> res = always;
+        for (size_t i = 0; i < counts.size() && res.size() < n && counts[i].first > 0; i++)
+        {
+            if (std::find(always.begin(), always.end(), counts[i].second) == always.end())
+            {
+                res.push_back(counts[i].second);
+            }
+        }
+        return res;
+    }
+
+    static bool save(const std::string & path, const std::vector<llama_token> & ids)
+    {
+        FILE * f = fopen(path.c_str(), "w");
+        if (f == nullptr)
+        {
+            return false;
+        }
+        bool ok = true;
+        for (llama_token t : ids)
+        {
+            ok = ok && fprintf(f, "%d\n", t) > 0;
+        }
+        return fclose(f) == 0 && ok;
+    }
+
+    // false if the file cannot be read or has ids outside [0, n_vocab)
+    bool load(const std::string & path, int32_t n_vocab)
+    {
+        ids_.clear();
+        FILE * f = fopen(path.c_str(), "r");
+        if (f == nullptr)
+        {
+            return false;
+        }
+        int id = 0;
+        bool ok = true;
+        while (fscanf(f, "%d", &id) == 1)
+        {
+            ok = ok && id >= 0 && id < n_vocab;
+            ids_.push_back(id);
+        }
+        ok = ok && feof(f);
+        fclose(f);
+        // column order is token order, so distributions stay sorted by id
+        std::sort(ids_.begin(), ids_.end());
+        ids_.erase(std::unique(ids_.begin(), ids_.end()), ids_.end());
+        if (!ok || ids_.empty())
+        {
+            ids_.clear();
+            return false;
+        }
+        return true;
+    }
+
+    bool empty() const
+    {
+        return ids_.empty();
+    }
+
+    size_t size() const
+    {
+        return ids_.size();
+    }
+
+    const std::vector<llama_token> & ids() const
+    {
+        return ids_;
+    }
+
+  private:
+    std::vector<llama_token> ids_;
+};
+
+// The draft model's logits rows as drafting sees them: whole, or only the
+// columns of a vocab_subset, gathered into a compact row. A column maps back
+// to its token with token(). One per thread, rows live in scratch buffers.
+class draft_head
+{
+  public:
+    draft_head(const vocab_subset & subset, int32_t n_vocab)
+        : ids_(subset.ids())
+        , n_vocab_(n_vocab)
+    {
+    }
+
+    int32_t n_cols() const
+    {
+        return ids_.empty() ? n_vocab_ : static_cast<int32_t>(ids_.size());
+    }
+
+    // the row to draft from; valid until the next call with the same slot
+    const float * row(const float * logits, size_t slot = 0)
+    {
+        if (ids_.empty())
+        {
+            return logits;
+        }
+        if (slot >= rows_.size())
+        {
+            rows_.resize(slot + 1);
+        }
+        std::vector<float> & row = rows_[slot];
+        row.resize(ids_.size());
+        for (size_t i = 0; i < ids_.size(); i++)
+        {
+            row[i] = logits[ids_[i]];
+        }
+        return row.data();
+    }
+
+    llama_token token(int32_t col) const
+    {
+        return ids_.empty() ? col : ids_[col];
+    }
+
+    // in place, keeps the order
+    void to_tokens(std::vector<llama_token> & cols) const
+    {
+        for (auto & c : cols)
+        {
+            c = token(c);
+        }
+    }
+
+  private:
+    const std::vector<llama_token> & ids_;
+    const int32_t n_vocab_;
+    std::vector<std::vector<float>> rows_;
+};
+
+}